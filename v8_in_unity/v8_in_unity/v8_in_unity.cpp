@@ -32,16 +32,86 @@
 
 #include "v8_in_unity.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <sstream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <string.h>
 #include "libplatform/libplatform.h"
 #include "v8.h"
+#include "v8-profiler.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// ScriptCompiler::CompileModule only takes compile options (and so can only
+// consume a code cache) since V8 6.9.
+#if V8_MAJOR_VERSION > 6 || (V8_MAJOR_VERSION == 6 && V8_MINOR_VERSION >= 9)
+#define V8_IN_UNITY_MODULE_CODE_CACHE 1
+#else
+#define V8_IN_UNITY_MODULE_CODE_CACHE 0
+#endif
+
+// String::Utf8Length and WriteUtf8 take the isolate since V8 7.1.
+#if V8_MAJOR_VERSION > 7 || (V8_MAJOR_VERSION == 7 && V8_MINOR_VERSION >= 1)
+#define V8_IN_UNITY_UTF8_TAKES_ISOLATE 1
+#else
+#define V8_IN_UNITY_UTF8_TAKES_ISOLATE 0
+#endif
+
+// ArrayBuffer::Neuter was renamed to Detach in V8 7.4.
+#if V8_MAJOR_VERSION > 7 || (V8_MAJOR_VERSION == 7 && V8_MINOR_VERSION >= 4)
+#define V8_IN_UNITY_DETACH_ARRAY_BUFFER(buffer) (buffer)->Detach()
+#else
+#define V8_IN_UNITY_DETACH_ARRAY_BUFFER(buffer) (buffer)->Neuter()
+#endif
 
 using namespace v8;
 
+// 64-bit FNV-1a.
+static uint64_t HashSource(const char *source, size_t *length_out)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  size_t length = 0;
+  for (const char *c = source; *c; c++, length++)
+  {
+    hash ^= (uint8_t)*c;
+    hash *= 1099511628211ULL;
+  }
+  *length_out = length;
+  return hash;
+}
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
 const size_t MAX_FILEPATH_LENGTH = 1024;
 const size_t MAX_GUID_LENGTH = 128;
 const size_t MAX_JAVASCRIPT_SOURCE_LENGTH = 1024 * 1024;
@@ -49,6 +119,19 @@ const size_t MAX_JSON_LENGTH = 10 * 1024 * 1024;
 const size_t MAX_BUFFER_SIZE = 10 * 1024 * 1024;
 const size_t MAX_SERVICE_NAME_LENGTH = 128;
 const size_t MAX_LOG_MESSAGE_LENGTH = 1024 * 1024;
+const size_t MAX_CODE_CACHE_SIZE = 64 * 1024 * 1024;
+const int MAX_ACTOR_FIELD_COMPONENTS = 16;
+const size_t MAX_ASYNC_SERVICE_CALLS = 64 * 1024;
+// Rounds of follow-up batches per tick. Requests beyond that wait for the next tick.
+const int MAX_ASYNC_SERVICE_ROUNDS = 16;
+const int MAX_TRACE_EVENTS = 1024 * 1024;
+// With a task budget, service results are settled this many at a time, with a
+// microtask checkpoint after each group.
+const size_t SERVICE_RESULTS_PER_CHECKPOINT = 64;
+// GC pacing collects ahead of time once the young generation has room for
+// fewer ticks than this, going by the average allocation per tick.
+const double GC_PACING_TICKS_AHEAD = 2;
+const double GC_PACING_AVERAGE_WEIGHT = 0.2;
 
 static bool IsStringValid(const char *string, size_t max_length)
 {
@@ -77,8 +160,13 @@ SetLocalPositionFunction HOST_SET_LOCAL_POSITION_FUNCTION = nullptr;
 
 LookupIntFunction LOOK_UP_INT_FUNCTION = nullptr;
 
+// Brains may tick on worker threads, but the host log functions need not be
+// thread-safe.
+static std::mutex LOG_MUTEX;
+
 static void Log(const char *msg)
 {
+  std::lock_guard<std::mutex> lock(LOG_MUTEX);
   if (HOST_DEBUG_LOG_FUNCTION)
   {
     HOST_DEBUG_LOG_FUNCTION(msg);
@@ -87,6 +175,7 @@ static void Log(const char *msg)
 
 static void LogError(const char *msg)
 {
+  std::lock_guard<std::mutex> lock(LOG_MUTEX);
   if (HOST_ERROR_LOG_FUNCTION)
   {
     HOST_ERROR_LOG_FUNCTION(msg);
@@ -160,9 +249,10 @@ static void LookUpIntV8Callback(const FunctionCallbackInfo<Value> &info)
   info.GetReturnValue().Set(rv);
 }
 
-static void BindFunction(Isolate *isolate, Local<ObjectTemplate> object, const char *functionName, FunctionCallback callback)
+static void BindFunction(Isolate *isolate, Local<ObjectTemplate> object, const char *functionName, FunctionCallback callback,
+                         Local<Value> data = Local<Value>())
 {
-  object->Set(String::NewFromUtf8(isolate, functionName), FunctionTemplate::New(isolate, callback));
+  object->Set(String::NewFromUtf8(isolate, functionName), FunctionTemplate::New(isolate, callback, data));
 }
 
 static void SetupGlobalTemplate(Isolate *isolate, Local<ObjectTemplate> global)
@@ -209,8 +299,10 @@ public:
 };
 
 CallServiceFunction CALL_SERVICE_FUNCTION = nullptr;
-ServiceUser *CURRENT_SERVICE_USER = nullptr;
-bool WAITING_ON_SERVICE_RESULT_REPORT = false;
+CallServicesBatchFunction CALL_SERVICES_BATCH_FUNCTION = nullptr;
+// Per thread, since brains may call services from worker threads.
+thread_local ServiceUser *CURRENT_SERVICE_USER = nullptr;
+thread_local bool WAITING_ON_SERVICE_RESULT_REPORT = false;
 
 ActorVector3Getter ACTOR_VECTOR3_GETTER = nullptr;
 ActorVector3Setter ACTOR_VECTOR3_SETTER = nullptr;
@@ -222,9 +314,26 @@ ActorStringGetter ACTOR_STRING_GETTER = nullptr;
 ActorStringSetter ACTOR_STRING_SETTER = nullptr;
 ActorFloatGetter ACTOR_FLOAT_GETTER = nullptr;
 ActorFloatSetter ACTOR_FLOAT_SETTER = nullptr;
-
-// 1 mb should be plenty for an individual actor's string.
-static char GetActorStringBuffer[1 * 1024 * 1024];
+ActorVector3BatchGetter ACTOR_VECTOR3_BATCH_GETTER = nullptr;
+ActorVector3BatchSetter ACTOR_VECTOR3_BATCH_SETTER = nullptr;
+ActorQuaternionBatchGetter ACTOR_QUATERNION_BATCH_GETTER = nullptr;
+ActorQuaternionBatchSetter ACTOR_QUATERNION_BATCH_SETTER = nullptr;
+ActorBooleanBatchGetter ACTOR_BOOLEAN_BATCH_GETTER = nullptr;
+ActorBooleanBatchSetter ACTOR_BOOLEAN_BATCH_SETTER = nullptr;
+ActorFloatBatchGetter ACTOR_FLOAT_BATCH_GETTER = nullptr;
+ActorFloatBatchSetter ACTOR_FLOAT_BATCH_SETTER = nullptr;
+
+// 1 mb should be plenty for an individual actor's string. One per thread,
+// allocated on first use.
+const size_t MAX_ACTOR_STRING_LENGTH = 1 * 1024 * 1024;
+static thread_local std::vector<char> GetActorStringBuffer;
+
+// Per-brain host callbacks win over the global ones.
+template <typename F>
+static F PickCallback(F brain_callback, F global_callback)
+{
+  return brain_callback != nullptr ? brain_callback : global_callback;
+}
 
 void ReportServiceResult(CSHARP_STRING resultJson)
 {
@@ -245,21 +354,21 @@ void ReportServiceResult(CSHARP_STRING resultJson)
   CURRENT_SERVICE_USER->HandleServiceResult(resultJson);
 }
 
-static void CallService(const char *serviceName, const char *argsJson, ServiceUser *user)
+static void CallService(CallServiceFunction callService, const char *serviceName, const char *argsJson, ServiceUser *user)
 {
   if (!IsStringValid(serviceName, MAX_SERVICE_NAME_LENGTH) || !IsStringValid(argsJson, MAX_JSON_LENGTH))
   {
     return;
   }
 
-  if (CALL_SERVICE_FUNCTION == nullptr)
+  if (callService == nullptr)
   {
     LogError("CallService was called, but no CallServiceFunction was set by the host.");
     return;
   }
   CURRENT_SERVICE_USER = user;
   WAITING_ON_SERVICE_RESULT_REPORT = true;
-  CALL_SERVICE_FUNCTION(serviceName, argsJson, ReportServiceResult);
+  callService(serviceName, argsJson, ReportServiceResult);
   CURRENT_SERVICE_USER = nullptr;
 
   if (WAITING_ON_SERVICE_RESULT_REPORT)
@@ -270,6 +379,74 @@ static void CallService(const char *serviceName, const char *argsJson, ServiceUs
   }
 }
 
+// Results of one batch of async service calls, as reported by the host.
+struct ServiceBatchResults
+{
+  ServiceBatchResults(size_t count) : results(count), reported(count, false) {}
+  std::vector<std::string> results;
+  std::vector<bool> reported;
+};
+
+thread_local ServiceBatchResults *CURRENT_SERVICE_BATCH = nullptr;
+
+void ReportIndexedServiceResult(int index, CSHARP_STRING resultJson)
+{
+  if (CURRENT_SERVICE_BATCH == nullptr)
+  {
+    LogError("ReportIndexedServiceResult was called outside of a service batch. Ignoring it.");
+    return;
+  }
+  if (index < 0 || index >= (int)CURRENT_SERVICE_BATCH->results.size())
+  {
+    std::ostringstream err;
+    err << "ReportIndexedServiceResult was called with index " << index << ", but the batch only has " << CURRENT_SERVICE_BATCH->results.size() << " calls.";
+    LogError(err);
+    return;
+  }
+  if (!IsStringValid(resultJson, MAX_JSON_LENGTH))
+  {
+    return;
+  }
+  CURRENT_SERVICE_BATCH->results[index] = resultJson;
+  CURRENT_SERVICE_BATCH->reported[index] = true;
+}
+
+// For hosts without a batch function.
+class ServiceResultCollector : public ServiceUser
+{
+public:
+  ServiceResultCollector(ServiceBatchResults *batch, int index) : batch_(batch), index_(index) {}
+
+  void HandleServiceResult(CSHARP_STRING resultJson)
+  {
+    batch_->results[index_] = resultJson;
+    batch_->reported[index_] = true;
+  }
+
+private:
+  ServiceBatchResults *batch_;
+  int index_;
+};
+
+static void CallServicesBatch(CallServicesBatchFunction callServicesBatch, CallServiceFunction callService,
+                              std::vector<const char *> &serviceNames, std::vector<const char *> &argsJsons, ServiceBatchResults *results_out)
+{
+  if (callServicesBatch == nullptr)
+  {
+    for (size_t i = 0; i < serviceNames.size(); i++)
+    {
+      ServiceResultCollector collector(results_out, (int)i);
+      CallService(callService, serviceNames[i], argsJsons[i], &collector);
+    }
+    return;
+  }
+
+  ServiceBatchResults *outer_batch = CURRENT_SERVICE_BATCH;
+  CURRENT_SERVICE_BATCH = results_out;
+  callServicesBatch((int)serviceNames.size(), serviceNames.data(), argsJsons.data(), ReportIndexedServiceResult);
+  CURRENT_SERVICE_BATCH = outer_batch;
+}
+
 extern "C"
 {
   void SetCallServiceFunction(CallServiceFunction callService)
@@ -277,6 +454,11 @@ extern "C"
     CALL_SERVICE_FUNCTION = callService;
   }
 
+  void SetCallServicesBatchFunction(CallServicesBatchFunction callServicesBatch)
+  {
+    CALL_SERVICES_BATCH_FUNCTION = callServicesBatch;
+  }
+
   void SetActorVector3Getter(ActorVector3Getter f)
   {
     ACTOR_VECTOR3_GETTER = f;
@@ -317,1017 +499,6789 @@ extern "C"
   {
     ACTOR_FLOAT_SETTER = f;
   }
+  void SetActorVector3BatchGetter(ActorVector3BatchGetter f)
+  {
+    ACTOR_VECTOR3_BATCH_GETTER = f;
+  }
+  void SetActorVector3BatchSetter(ActorVector3BatchSetter f)
+  {
+    ACTOR_VECTOR3_BATCH_SETTER = f;
+  }
+  void SetActorQuaternionBatchGetter(ActorQuaternionBatchGetter f)
+  {
+    ACTOR_QUATERNION_BATCH_GETTER = f;
+  }
+  void SetActorQuaternionBatchSetter(ActorQuaternionBatchSetter f)
+  {
+    ACTOR_QUATERNION_BATCH_SETTER = f;
+  }
+  void SetActorBooleanBatchGetter(ActorBooleanBatchGetter f)
+  {
+    ACTOR_BOOLEAN_BATCH_GETTER = f;
+  }
+  void SetActorBooleanBatchSetter(ActorBooleanBatchSetter f)
+  {
+    ACTOR_BOOLEAN_BATCH_SETTER = f;
+  }
+  void SetActorFloatBatchGetter(ActorFloatBatchGetter f)
+  {
+    ACTOR_FLOAT_BATCH_GETTER = f;
+  }
+  void SetActorFloatBatchSetter(ActorFloatBatchSetter f)
+  {
+    ACTOR_FLOAT_BATCH_SETTER = f;
+  }
 }
 
-class VoosBrain : public ServiceUser
+// Code cache.
+
+// Bytecode for compiled scripts and modules, stored as one file per source in
+// a host-given directory. Files are keyed by a hash of the source and V8's
+// cache version tag, so stale entries are simply never looked up again.
+class CodeCache
 {
 public:
-  // TODO create these using a factory method instead, to better handle ctor errors.
+  CodeCache() : hits(0), misses(0), rejections(0) {}
 
-  bool valid;
+  bool IsEnabled() const { return !directory_.empty(); }
 
-  VoosBrain(const char *javascript) : isolate_(nullptr), valid(false)
+  bool SetDirectory(const char *directory)
   {
-    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
-    isolate_ = Isolate::New(create_params);
-    isolate_->SetData(0, (void *)this);
-
-    // Create the context
-    Isolate::Scope isolate_scope(isolate_);
-    // Create a stack-allocated handle scope.
-    HandleScope handle_scope(isolate_);
-
-    Local<ObjectTemplate> global_template = ObjectTemplate::New(isolate_);
-    SetupGlobalTemplate(isolate_, global_template);
-    BindFunction(isolate_, global_template, "getVoosModule", GetModuleV8Callback);
-    BindFunction(isolate_, global_template, "callVoosService", CallServiceV8Callback);
-    BindFunction(isolate_, global_template, "getActorBoolean", GetActorBooleanV8Callback);
-    BindFunction(isolate_, global_template, "setActorBoolean", SetActorBooleanV8Callback);
-    BindFunction(isolate_, global_template, "getActorVector3", GetActorVector3V8Callback);
-    BindFunction(isolate_, global_template, "setActorVector3", SetActorVector3V8Callback);
-    BindFunction(isolate_, global_template, "getActorQuaternion", GetActorQuaternionV8Callback);
-    BindFunction(isolate_, global_template, "setActorQuaternion", SetActorQuaternionV8Callback);
-    BindFunction(isolate_, global_template, "getActorString", GetActorStringV8Callback);
-    BindFunction(isolate_, global_template, "setActorString", SetActorStringV8Callback);
-    BindFunction(isolate_, global_template, "getActorFloat", GetActorFloatV8Callback);
-    BindFunction(isolate_, global_template, "setActorFloat", SetActorFloatV8Callback);
-
-    Local<Context> context = Context::New(isolate_, nullptr, global_template);
-    reusable_context_.Reset(isolate_, context);
-
-    // Compile source and pull out the functions we expect.
-    Context::Scope context_scope(context);
-
-    // Compile and evaluate the JS
-    if (!CompileBrainJavascript(javascript))
+    directory_.clear();
+    if (directory == nullptr || directory[0] == '\0')
     {
-      valid = false;
-      return;
+      return true;
+    }
+    if (!IsStringValid(directory, MAX_FILEPATH_LENGTH))
+    {
+      return false;
     }
+#ifdef _WIN32
+    _mkdir(directory);
+#else
+    mkdir(directory, 0755);
+#endif
+    directory_ = directory;
+    return true;
+  }
 
-    // Fetch out the functions we need to call
-    if (!GetReusableFunctionReference(GetIsolate(), &context, "updateAgent", &reusable_update_agent_function_))
+  std::string GetKey(const char *source) const
+  {
+    if (!IsEnabled())
     {
-      LogError("Could not find updateAgent function in brain JS! Brain JS:");
-      LogError(javascript);
-      valid = false;
-      return;
+      return std::string();
     }
 
-    // This one is optional.
-    GetReusableFunctionReference(GetIsolate(), &context, "postMessageFlush", &reusable_post_message_flush_function_);
+    size_t length = 0;
+    uint64_t hash = HashSource(source, &length);
 
-    valid = true;
+    std::ostringstream key;
+    key << std::hex << hash << "_" << length << "_" << ScriptCompiler::CachedDataVersionTag();
+    return key.str();
   }
 
-  ~VoosBrain()
+  // Returns null on a miss. Ownership goes to the caller.
+  ScriptCompiler::CachedData *Load(const std::string &key)
   {
-    // IMPORTANT: If reset's are not called, we will crash soon after.
-    // Probably because we must reset before disposing the isolate?
+    if (key.empty())
+    {
+      return nullptr;
+    }
 
-    reusable_context_.Reset();
-    reusable_update_agent_function_.Reset();
-    reusable_post_message_flush_function_.Reset();
-    for (auto &entry : module_namespaces_by_id)
+    std::ifstream file(GetPath(key), std::ios::binary | std::ios::ate);
+    std::streamoff length = file.is_open() ? (std::streamoff)file.tellg() : 0;
+    if (length <= 0 || length > (std::streamoff)MAX_CODE_CACHE_SIZE)
     {
-      entry.second.Reset();
+      misses++;
+      return nullptr;
     }
-    module_namespaces_by_id.clear();
 
-    // TODO do we really need an isolate per brain? Not really a relevant
-    // question right now, since we only have one "brain".
-    isolate_->Dispose();
-    delete create_params.array_buffer_allocator;
+    uint8_t *data = new uint8_t[(size_t)length];
+    file.seekg(0);
+    if (!file.read((char *)data, length))
+    {
+      delete[] data;
+      misses++;
+      return nullptr;
+    }
+    return new ScriptCompiler::CachedData(data, (int)length, ScriptCompiler::CachedData::BufferOwned);
   }
 
-  static MaybeLocal<Module> ModuleResolveCallback(Local<Context> context,
-                                                  Local<String> specifier,
-                                                  Local<Module> referrer)
+  bool Contains(const std::string &key) const
   {
-    std::cerr << "TEMP TEMP resolver called, looking for specifier: " << *specifier << std::endl;
-    std::cerr << "NOT IMPLEMENTED! Returning empty." << std::endl;
-    return MaybeLocal<Module>();
+    return !key.empty() && std::ifstream(GetPath(key), std::ios::binary).is_open();
   }
 
-  bool SetModule(const char *moduleUid, const char *javascriptSource)
+  // Call after compiling with data from Load. Returns true if V8 used it.
+  bool CheckConsumed(const std::string &key, const ScriptCompiler::CachedData *data)
   {
-    if (!IsStringValid(moduleUid, MAX_GUID_LENGTH) || !IsStringValid(javascriptSource, MAX_JAVASCRIPT_SOURCE_LENGTH))
+    if (data == nullptr)
     {
       return false;
     }
-
-    if (!valid)
+    if (data->rejected)
     {
-      LogError("SetModule called on invalid brain");
+      // Usually a V8 flags or version mismatch. Overwritten by the next Store.
+      rejections++;
+      std::remove(GetPath(key).c_str());
       return false;
     }
+    hits++;
+    return true;
+  }
 
-    Isolate::Scope isolate_scope(GetIsolate());
-    HandleScope handle_scope(GetIsolate());
-    Local<Context> context = GetReusableContext();
-    Context::Scope context_scope(context);
-
-    TryCatch try_catch(isolate_);
-
-    Local<String> sourceString =
-        String::NewFromUtf8(isolate_, javascriptSource, NewStringType::kNormal).ToLocalChecked();
-
-    auto moduleIdValue = String::NewFromUtf8(isolate_, moduleUid);
-    ScriptOrigin origin(moduleIdValue,
-                        Integer::New(isolate_, 0),
-                        Integer::New(isolate_, 0),
-                        Boolean::New(isolate_, false),
-                        Local<Integer>(),
-                        Local<Value>(),
-                        Local<Boolean>(),
-                        Boolean::New(isolate_, false),
-                        Boolean::New(isolate_, true));
-    ScriptCompiler::Source source(sourceString, origin);
-    MaybeLocal<Module> compiledModule = ScriptCompiler::CompileModule(isolate_, &source);
-    if (compiledModule.IsEmpty())
+  // Takes ownership of data.
+  void Store(const std::string &key, ScriptCompiler::CachedData *data)
+  {
+    std::unique_ptr<ScriptCompiler::CachedData> owned(data);
+    if (key.empty() || data == nullptr || data->length <= 0)
     {
-      LogException("Error while compiling module JS: ", isolate_, &try_catch);
-      return false;
+      return;
     }
 
-    Maybe<bool> instantiateResult = compiledModule.ToLocalChecked()->InstantiateModule(context, ModuleResolveCallback);
-    if (instantiateResult.IsNothing())
+    // Write to a temp file first, so a crash never leaves a truncated entry.
+    std::string path = GetPath(key);
+    std::string temp_path = path + ".tmp";
     {
-      LogException("Exception caught while instantiating module JS: ", isolate_, &try_catch);
-      return false;
+      std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+      if (!file.write((const char *)data->data, data->length))
+      {
+        return;
+      }
     }
-
-    MaybeLocal<Value> evalResult = compiledModule.ToLocalChecked()->Evaluate(context);
-    if (try_catch.HasCaught())
+    std::remove(path.c_str());
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0)
     {
-      LogException("Exception caught while evaluating module JS: ", GetIsolate(), &try_catch);
-      return false;
+      std::remove(temp_path.c_str());
     }
+  }
 
-    module_namespaces_by_id[std::string(moduleUid)].Reset(context->GetIsolate(), compiledModule.ToLocalChecked()->GetModuleNamespace());
+  // Brains on worker threads share the cache.
+  std::atomic<int> hits;
+  std::atomic<int> misses;
+  std::atomic<int> rejections;
 
-    return true;
+private:
+  std::string GetPath(const std::string &key) const
+  {
+    return directory_ + "/" + key + ".v8cache";
+  }
+
+  std::string directory_;
+};
+
+static CodeCache CODE_CACHE;
+
+// Startup snapshots.
+
+// A V8 startup blob with the brain JS already run, plus a chosen set of
+// modules to set right after. Brains reset with the same brain JS deserialize
+// this instead of compiling and running everything from scratch.
+class BrainSnapshot
+{
+public:
+  BrainSnapshot()
+  {
+    blob.data = nullptr;
+    blob.raw_size = 0;
   }
 
-  bool UpdateAgentJson(const char *state_json_string, BYTE_ARRAY bytes_in, int length_in, StringFunction report_result_json)
+  ~BrainSnapshot()
   {
-    if (!valid)
+    delete[] blob.data;
+  }
+
+  std::string javascript;
+  // Module UID and source, in the order they are set on new brains.
+  std::vector<std::pair<std::string, std::string>> modules;
+  StartupData blob;
+};
+
+// Read by resets on any thread, so always go through std::atomic_load/store.
+std::shared_ptr<BrainSnapshot> BRAIN_SNAPSHOT;
+
+// Tracing.
+
+static void WriteJsonString(std::ostream &out, const char *string)
+{
+  out << '"';
+  for (const char *c = string; *c != '\0'; c++)
+  {
+    switch (*c)
     {
-      LogError("UpdateAgent called on invalid brain");
-      return false;
+    case '"':
+      out << "\\\"";
+      break;
+    case '\\':
+      out << "\\\\";
+      break;
+    case '\n':
+      out << "\\n";
+      break;
+    default:
+      if ((unsigned char)*c < 0x20)
+      {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+        out << escaped;
+      }
+      else
+      {
+        out << *c;
+      }
     }
+  }
+  out << '"';
+}
 
-    Isolate::Scope isolate_scope(GetIsolate());
-    HandleScope handle_scope(GetIsolate());
-    Local<Context> context = GetReusableContext();
-    Context::Scope context_scope(context);
+const size_t TRACE_NAME_LENGTH = 64;
 
-    // Create an object to hold input/output vars.
+// A ring of the latest spans, dumped as Chrome trace-event JSON for
+// chrome://tracing or Perfetto. Spans are recorded when they end, so the
+// viewer nests them by time. Threads get small ids in the order they first
+// record something.
+class BrainTracer
+{
+public:
+  BrainTracer() : enabled_(false), next_(0), count_(0), dropped_(0) {}
 
-    Local<String> json_v8string = String::NewFromUtf8(GetIsolate(), state_json_string, NewStringType::kNormal).ToLocalChecked();
-    MaybeLocal<Value> maybe_state_obj = JSON::Parse(context, json_v8string);
+  bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
 
-    Local<ArrayBuffer> array_buffer_in = ArrayBuffer::New(GetIsolate(), bytes_in, length_in, ArrayBufferCreationMode::kExternalized);
+  // Starting again clears the ring.
+  void Start(int capacity)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.assign(capacity, Event());
+    next_ = 0;
+    count_ = 0;
+    dropped_ = 0;
+    epoch_ = std::chrono::steady_clock::now();
+    enabled_ = true;
+  }
 
-    if (maybe_state_obj.IsEmpty())
+  // Keeps the ring for dumping.
+  void Stop() { enabled_ = false; }
+
+  void Record(const char *category, const char *name, const char *brain_uid,
+              std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+  {
+    static std::atomic<int> next_thread(1);
+    static thread_local int thread = next_thread++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!enabled_ || events_.empty())
     {
-      std::ostringstream oss;
-      oss << "Failed to JSON-parse state:\n";
-      oss << state_json_string;
-      LogError(oss.str().c_str());
-      return false;
+      return;
     }
-    Local<Value> state_obj = maybe_state_obj.ToLocalChecked();
-
-    // Call updateAgent
-    TryCatch try_catch(GetIsolate());
-    const int argc = 2;
-    Local<Value> argv[argc] = {state_obj, array_buffer_in};
-    Local<Function> update_agent_function = Local<Function>::New(GetIsolate(), reusable_update_agent_function_);
-    Local<Value> result;
-    if (!update_agent_function->Call(context, context->Global(), argc, argv).ToLocal(&result))
+    Event &event = events_[next_];
+    next_ = (next_ + 1) % events_.size();
+    if (count_ < events_.size())
     {
-      LogException("Error while calling updateAgent: ", GetIsolate(), &try_catch);
-      return false;
+      count_++;
     }
-
-    while (platform::PumpMessageLoop(V8_GLOBAL_STATE.platform, GetIsolate()))
-      continue;
-    if (try_catch.HasCaught())
+    else
     {
-      LogException("Exception caught while pumping message loop: ", GetIsolate(), &try_catch);
-      return false;
+      dropped_++;
     }
+    event.category = category;
+    snprintf(event.name, sizeof(event.name), "%s", name);
+    snprintf(event.brain_uid, sizeof(event.brain_uid), "%s", brain_uid != nullptr ? brain_uid : "");
+    event.start_us = std::chrono::duration<double, std::micro>(start - epoch_).count();
+    event.duration_us = std::chrono::duration<double, std::micro>(end - start).count();
+    event.thread = thread;
+  }
 
-    if (!reusable_post_message_flush_function_.IsEmpty())
+  // Oldest first.
+  void WriteJson(std::ostream &out)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << "{\"traceEvents\":[";
+    size_t first = (next_ + events_.size() - count_) % std::max<size_t>(events_.size(), 1);
+    for (size_t i = 0; i < count_; i++)
     {
-      const int argc = 2;
-      Local<Value> argv[argc] = {state_obj, array_buffer_in};
-      Local<Function> post_flush_function = Local<Function>::New(GetIsolate(), reusable_post_message_flush_function_);
-      Local<Value> result;
-      if (!post_flush_function->Call(context, context->Global(), argc, argv).ToLocal(&result))
+      const Event &event = events_[(first + i) % events_.size()];
+      char times[64];
+      snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", event.start_us, event.duration_us);
+      out << (i > 0 ? "," : "") << "{\"name\":";
+      WriteJsonString(out, event.name);
+      out << ",\"cat\":\"" << event.category << "\",\"ph\":\"X\"," << times << ",\"pid\":1,\"tid\":" << event.thread;
+      if (event.brain_uid[0] != '\0')
       {
-        LogException("Error while calling postMessageFlush: ", GetIsolate(), &try_catch);
-        return false;
+        out << ",\"args\":{\"brain\":";
+        WriteJsonString(out, event.brain_uid);
+        out << "}";
       }
+      out << "}";
     }
+    out << "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":" << dropped_ << "}}";
+  }
 
-    if (report_result_json)
+private:
+  struct Event
+  {
+    const char *category;
+    char name[TRACE_NAME_LENGTH];
+    char brain_uid[MAX_GUID_LENGTH + 1];
+    double start_us;
+    double duration_us;
+    int thread;
+  };
+
+  std::atomic<bool> enabled_;
+  std::mutex mutex_;
+  std::vector<Event> events_;
+  size_t next_;
+  size_t count_;
+  long long dropped_;
+  std::chrono::steady_clock::time_point epoch_;
+};
+
+BrainTracer BRAIN_TRACER;
+
+// Traces from here to the end of the scope, if tracing is on. The strings must
+// outlive the scope.
+class TraceScope
+{
+public:
+  TraceScope(const char *category, const char *name, const char *brain_uid = nullptr)
+      : category_(category), name_(name), brain_uid_(brain_uid), enabled_(BRAIN_TRACER.IsEnabled())
+  {
+    if (enabled_)
     {
-      // Pull out the JSON state, stringify, and report.
-      MaybeLocal<String> maybe_string = JSON::Stringify(context, state_obj);
-      if (maybe_string.IsEmpty())
-      {
-        LogError("Could not JSON::Stringify object returned by JS! Not reporting to caller.");
-        return false;
-      }
-      String::Utf8Value json_value(GetIsolate(), maybe_string.ToLocalChecked());
-      if (json_value.length() > MAX_JSON_LENGTH)
-      {
-        LogError("JSON result too large. Not reporting to caller.");
-        return false;
-      }
-      else
-      {
-        report_result_json(*json_value);
-      }
+      start_ = std::chrono::steady_clock::now();
     }
-
-    return true;
   }
 
-  void HandleServiceResult(CSHARP_STRING resultJson)
+  ~TraceScope()
   {
-    Local<String> json_v8string = String::NewFromUtf8(GetIsolate(), resultJson, NewStringType::kNormal).ToLocalChecked();
-    last_service_call_result = JSON::Parse(GetReusableContext(), json_v8string);
-
-    if (last_service_call_result.IsEmpty())
+    if (enabled_)
     {
-      std::ostringstream err;
-      err << "Could not parse service result json: " << resultJson;
-      LogError(err);
+      BRAIN_TRACER.Record(category_, name_, brain_uid_, start_, std::chrono::steady_clock::now());
     }
   }
 
 private:
-  Local<Value> GetModuleNamespaceObject(const char *module_id)
-  {
-    return module_namespaces_by_id[module_id].Get(GetIsolate());
-  }
+  const char *category_;
+  const char *name_;
+  const char *brain_uid_;
+  bool enabled_;
+  std::chrono::steady_clock::time_point start_;
+};
 
-  static VoosBrain *GetThis(const FunctionCallbackInfo<Value> &info)
-  {
-    return (VoosBrain *)info.GetIsolate()->GetData(0);
-  }
+// Brain isolates.
+
+// Brains find themselves through their context, since several brains may
+// share an isolate. Index 0 is reserved by V8's debugger.
+const int BRAIN_EMBEDDER_DATA_INDEX = 1;
+const uint32_t BRAIN_ISOLATE_DATA_SLOT = 0;
+
+// Small buffers are bumped out of arena chunks. Each is preceded by the chunk
+// it came from, so freeing it is O(1).
+const size_t ARENA_CHUNK_SIZE = 256 * 1024;
+const size_t ARENA_MAX_ALLOCATION = 4 * 1024;
+const int ARENA_MAX_FREE_CHUNKS = 16;
+// Medium buffers round up to a power of two, from 8 KB up to 1 MB.
+const int POOL_MIN_SIZE_CLASS_BITS = 13;
+const int POOL_MAX_SIZE_CLASS_BITS = 20;
+const size_t POOL_MAX_CACHED_BYTES_PER_CLASS = 4 * 1024 * 1024;
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// An ArrayBuffer::Allocator for brains that make lots of short-lived typed
+// arrays. V8 may free buffers on its worker threads, so everything is behind
+// a mutex.
+class PooledArrayBufferAllocator : public ArrayBuffer::Allocator
+{
+public:
+  explicit PooledArrayBufferAllocator(bool huge_pages) : huge_pages_(huge_pages), current_chunk_(nullptr), stats_() {}
 
-  static bool ExtractActorAccessorCommon(TEMP_ACTOR_ID *actor_id_out, ACTOR_FIELD_ID *field_id_out, const FunctionCallbackInfo<Value> &info)
+  ~PooledArrayBufferAllocator() override
   {
-    if (info.Length() < 2)
-    {
-      LogError("Not enough args for actor accessor. Need at least 2.");
-      return false;
-    }
-
-    Local<Context> context = info.GetIsolate()->GetCurrentContext();
-
-    Maybe<uint32_t> actor_id = info[0]->Uint32Value(context);
-    if (actor_id.IsNothing())
+    // By now the isolate is gone, and every buffer with it.
+    delete current_chunk_;
+    for (ArenaChunk *chunk : free_chunks_)
     {
-      LogError("Invalid actor id argument given for actor accessor. Need a number.");
-      return false;
+      delete chunk;
     }
-    *actor_id_out = actor_id.FromJust();
-
-    Maybe<uint32_t> field_id = info[1]->Uint32Value(context);
-    if (field_id.IsNothing())
+    for (std::vector<void *> &pool : pools_)
     {
-      LogError("Invalid field id argument given for actor accessor. Need a number.");
-      return false;
+      for (void *data : pool)
+      {
+        free(data);
+      }
     }
+  }
 
-    *field_id_out = field_id.FromJust();
-    return true;
+  void *Allocate(size_t length) override
+  {
+    return AllocateImpl(length, true);
   }
 
-  static void GetActorBooleanV8Callback(const FunctionCallbackInfo<Value> &info)
+  void *AllocateUninitialized(size_t length) override
   {
-    if (ACTOR_BOOLEAN_GETTER == nullptr)
-    {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_BOOLEAN_GETTER set");
-      return;
-    }
+    return AllocateImpl(length, false);
+  }
 
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+  void Free(void *data, size_t length) override
+  {
+    if (data == nullptr)
     {
       return;
     }
-
-    bool value_out = false;
-    ACTOR_BOOLEAN_GETTER(actor_id, field_id, &value_out);
-    info.GetReturnValue().Set(value_out);
-  }
-
-  static void SetActorBooleanV8Callback(const FunctionCallbackInfo<Value> &info)
-  {
-    if (ACTOR_BOOLEAN_SETTER == nullptr)
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.liveBytes -= length;
+    if (length <= ARENA_MAX_ALLOCATION)
     {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_BOOLEAN_SETTER set");
+      ArenaChunk *chunk = ((ArenaHeader *)data - 1)->chunk;
+      if (--chunk->live == 0)
+      {
+        if (chunk == current_chunk_)
+        {
+          chunk->used = 0;
+        }
+        else
+        {
+          RecycleChunk(chunk);
+        }
+      }
       return;
     }
 
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    int size_class = GetSizeClass(length);
+    if (size_class >= 0)
     {
+      size_t class_size = (size_t)1 << (size_class + POOL_MIN_SIZE_CLASS_BITS);
+      if ((pools_[size_class].size() + 1) * class_size <= POOL_MAX_CACHED_BYTES_PER_CLASS)
+      {
+        pools_[size_class].push_back(data);
+        stats_.pooledBytes += class_size;
+      }
+      else
+      {
+        free(data);
+      }
       return;
     }
 
-    Local<Context> context = info.GetIsolate()->GetCurrentContext();
-    Maybe<bool> value = info[2]->BooleanValue(context);
-
-    if (value.IsNothing())
+#ifdef __linux__
+    if (huge_pages_ && length >= HUGE_PAGE_SIZE)
     {
-      LogError("3rd argument needs to be a boolean!");
+      size_t mapped = RoundUp(length, HUGE_PAGE_SIZE);
+      munmap(data, mapped);
+      stats_.hugePageBytes -= mapped;
       return;
     }
-
-    ACTOR_BOOLEAN_SETTER(actor_id, field_id, value.FromJust());
+#endif
+    free(data);
   }
 
-  static void GetActorStringV8Callback(const FunctionCallbackInfo<Value> &info)
+  // Called at the start of each tick. Buffers from earlier ticks that are
+  // still alive keep their chunk from being rewound, so past the halfway mark
+  // the tick starts on a fresh one instead.
+  void BeginTick()
   {
-    if (ACTOR_STRING_GETTER == nullptr)
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_chunk_ != nullptr && current_chunk_->live > 0 && current_chunk_->used > ARENA_CHUNK_SIZE / 2)
     {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_STRING_GETTER set");
-      return;
+      current_chunk_ = nullptr;
     }
+  }
 
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
-    {
-      return;
-    }
+  BrainArrayBufferStatistics GetStatistics()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
 
-    // Clear it, to avoid using old values. To be safe.
-    GetActorStringBuffer[0] = '\0';
+private:
+  struct ArenaChunk
+  {
+    size_t used = 0;
+    size_t live = 0;
+    alignas(16) char data[ARENA_CHUNK_SIZE];
+  };
 
-    ACTOR_STRING_GETTER(actor_id, field_id, GetActorStringBuffer, sizeof(GetActorStringBuffer));
-    Local<String> val = String::NewFromUtf8(info.GetIsolate(), GetActorStringBuffer);
-    String::Utf8Value value(info.GetIsolate(), val);
-    info.GetReturnValue().Set(val);
+  struct alignas(16) ArenaHeader
+  {
+    ArenaChunk *chunk;
+  };
 
-    // Clear this, to avoid any possibility of V8 referencing the buffer.
-    GetActorStringBuffer[0] = '\0';
+  static size_t RoundUp(size_t size, size_t multiple)
+  {
+    return (size + multiple - 1) / multiple * multiple;
   }
 
-  static void SetActorStringV8Callback(const FunctionCallbackInfo<Value> &info)
+  // -1 for sizes outside the pooled range.
+  static int GetSizeClass(size_t length)
   {
-    if (ACTOR_STRING_SETTER == nullptr)
+    if (length <= ARENA_MAX_ALLOCATION || length > ((size_t)1 << POOL_MAX_SIZE_CLASS_BITS))
     {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_STRING_SETTER set");
-      return;
+      return -1;
     }
-
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    int bits = POOL_MIN_SIZE_CLASS_BITS;
+    while (((size_t)1 << bits) < length)
     {
-      return;
+      bits++;
     }
+    return bits - POOL_MIN_SIZE_CLASS_BITS;
+  }
 
-    if (!info[2]->IsString() && !info[2]->IsNullOrUndefined())
+  void *AllocateImpl(size_t length, bool zeroed)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    void *data = nullptr;
+    if (length <= ARENA_MAX_ALLOCATION)
     {
-      LogError("3rd argument needs to be a string or undefined!");
-      return;
+      data = AllocateFromArena(length);
+      if (zeroed)
+      {
+        memset(data, 0, length);
+      }
     }
-
-    if (info[2]->IsNullOrUndefined())
+    else if (GetSizeClass(length) >= 0)
     {
-      // Send over as empty.
-      ACTOR_STRING_SETTER(actor_id, field_id, "");
+      int size_class = GetSizeClass(length);
+      size_t class_size = (size_t)1 << (size_class + POOL_MIN_SIZE_CLASS_BITS);
+      std::vector<void *> &pool = pools_[size_class];
+      if (!pool.empty())
+      {
+        data = pool.back();
+        pool.pop_back();
+        stats_.pooledBytes -= class_size;
+        stats_.pooledAllocations++;
+        if (zeroed)
+        {
+          memset(data, 0, length);
+        }
+      }
+      else
+      {
+        data = zeroed ? calloc(1, class_size) : malloc(class_size);
+      }
+    }
+#ifdef __linux__
+    else if (huge_pages_ && length >= HUGE_PAGE_SIZE)
+    {
+      // Fresh mappings are already zeroed.
+      size_t mapped = RoundUp(length, HUGE_PAGE_SIZE);
+      data = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (data == MAP_FAILED)
+      {
+        return nullptr;
+      }
+      madvise(data, mapped, MADV_HUGEPAGE);
+      stats_.hugePageBytes += mapped;
+      stats_.hugePageAllocations++;
     }
+#endif
     else
     {
-      String::Utf8Value value(info.GetIsolate(), info[2]);
-      ACTOR_STRING_SETTER(actor_id, field_id, *value);
+      data = zeroed ? calloc(1, length) : malloc(length);
     }
+
+    if (data == nullptr)
+    {
+      return nullptr;
+    }
+    stats_.allocations++;
+    stats_.liveBytes += length;
+    stats_.peakLiveBytes = std::max(stats_.peakLiveBytes, stats_.liveBytes);
+    return data;
   }
 
-  static void GetActorVector3V8Callback(const FunctionCallbackInfo<Value> &info)
+  void *AllocateFromArena(size_t length)
   {
-    if (ACTOR_VECTOR3_GETTER == nullptr)
+    size_t size = sizeof(ArenaHeader) + RoundUp(std::max<size_t>(length, 1), 16);
+    if (current_chunk_ == nullptr || current_chunk_->used + size > ARENA_CHUNK_SIZE)
     {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_VECTOR3_GETTER set");
-      return;
+      if (current_chunk_ != nullptr && current_chunk_->live == 0)
+      {
+        RecycleChunk(current_chunk_);
+      }
+      // Chunks that still have live buffers are recycled once those are freed.
+      current_chunk_ = TakeFreeChunk();
     }
+    ArenaHeader *header = (ArenaHeader *)(current_chunk_->data + current_chunk_->used);
+    header->chunk = current_chunk_;
+    current_chunk_->used += size;
+    current_chunk_->live++;
+    stats_.arenaAllocations++;
+    return header + 1;
+  }
 
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+  ArenaChunk *TakeFreeChunk()
+  {
+    if (free_chunks_.empty())
     {
-      return;
+      stats_.arenaBytes += sizeof(ArenaChunk);
+      return new ArenaChunk;
     }
+    ArenaChunk *chunk = free_chunks_.back();
+    free_chunks_.pop_back();
+    return chunk;
+  }
 
-    Local<Context> context = info.GetIsolate()->GetCurrentContext();
-    Local<Value> out_val = info[2];
-    if (out_val.IsEmpty() || !out_val->IsObject())
+  void RecycleChunk(ArenaChunk *chunk)
+  {
+    if (free_chunks_.size() < ARENA_MAX_FREE_CHUNKS)
     {
-      LogError("GetActorVector3V8Callback: Third argument must be an object");
-      return;
+      chunk->used = 0;
+      free_chunks_.push_back(chunk);
     }
+    else
+    {
+      stats_.arenaBytes -= sizeof(ArenaChunk);
+      delete chunk;
+    }
+  }
 
-    float xout = 0.0;
-    float yout = 0.0;
-    float zout = 0.0;
-    ACTOR_VECTOR3_GETTER(actor_id, field_id, &xout, &yout, &zout);
+  const bool huge_pages_;
+  std::mutex mutex_;
+  ArenaChunk *current_chunk_;
+  std::vector<ArenaChunk *> free_chunks_;
+  std::vector<void *> pools_[POOL_MAX_SIZE_CLASS_BITS - POOL_MIN_SIZE_CLASS_BITS + 1];
+  BrainArrayBufferStatistics stats_;
+};
 
-    Local<Object> out_obj = out_val->ToObject(context).ToLocalChecked();
-    out_obj->Set(String::NewFromUtf8(info.GetIsolate(), "x"), Number::New(info.GetIsolate(), xout));
-    out_obj->Set(String::NewFromUtf8(info.GetIsolate(), "y"), Number::New(info.GetIsolate(), yout));
-    out_obj->Set(String::NewFromUtf8(info.GetIsolate(), "z"), Number::New(info.GetIsolate(), zout));
-  }
+// Per-brain settings for the isolate it runs in. Brains with anything but the
+// defaults get an isolate of their own.
+struct BrainIsolateOptions
+{
+  // 0 means V8's default limit.
+  int max_heap_mb = 0;
+  int max_heap_growths = 0;
+  int array_buffer_allocator = BRAIN_ARRAY_BUFFERS_DEFAULT;
+  // The microtask queue and policy belong to the isolate, so a budget that
+  // defers microtasks needs one of its own.
+  double task_budget_ms = 0;
+
+  bool IsDefault() const { return max_heap_mb == 0 && array_buffer_allocator == BRAIN_ARRAY_BUFFERS_DEFAULT && task_budget_ms == 0; }
+};
 
-  static void SetActorVector3V8Callback(const FunctionCallbackInfo<Value> &info)
+// An isolate that one or more brains create their contexts in. Disposed when
+// the last brain using it goes away.
+class BrainIsolate
+{
+public:
+  BrainIsolate(std::shared_ptr<BrainSnapshot> snapshot, const intptr_t *external_references, const BrainIsolateOptions &options = BrainIsolateOptions(),
+               bool shared = false)
+      : isolate_(nullptr), snapshot_(snapshot), shared_(shared), pooled_allocator_(nullptr), max_heap_mb_(options.max_heap_mb), max_heap_growths_(options.max_heap_growths), heap_growths_(0),
+        initial_heap_limit_(0), near_heap_limit_count_(0), heap_limit_terminations_(0), terminated_for_heap_(false),
+        gc_phase_(GcPhase::kOther), gc_stats_(), used_before_gc_(0), gc_freed_bytes_(0), cpu_profiler_(nullptr)
   {
-    if (ACTOR_VECTOR3_SETTER == nullptr)
+    if (options.array_buffer_allocator == BRAIN_ARRAY_BUFFERS_DEFAULT)
     {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_VECTOR3_SETTER set");
-      return;
+      create_params_.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
     }
-
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    else
     {
-      return;
+      pooled_allocator_ = new PooledArrayBufferAllocator(options.array_buffer_allocator == BRAIN_ARRAY_BUFFERS_POOLED_HUGE_PAGES);
+      create_params_.array_buffer_allocator = pooled_allocator_;
     }
-
-    Local<Context> context = info.GetIsolate()->GetCurrentContext();
-    Maybe<double> x = info[2]->NumberValue(context);
-    if (x.IsNothing())
+    if (snapshot_)
     {
-      LogError("3rd argument needs to be a number!");
-      return;
+      create_params_.snapshot_blob = &snapshot_->blob;
+      create_params_.external_references = external_references;
     }
-    Maybe<double> y = info[3]->NumberValue(context);
-    if (y.IsNothing())
+    if (max_heap_mb_ > 0)
     {
-      LogError("4th argument needs to be a number!");
-      return;
+      create_params_.constraints.set_max_old_space_size(max_heap_mb_);
     }
-    Maybe<double> z = info[4]->NumberValue(context);
-    if (z.IsNothing())
+    isolate_ = Isolate::New(create_params_);
+    isolate_->SetData(BRAIN_ISOLATE_DATA_SLOT, this);
+    const GCType paused_gc_types = GCType(kGCTypeScavenge | kGCTypeMarkSweepCompact);
+    isolate_->AddGCPrologueCallback(GcPrologueCallback, this, paused_gc_types);
+    isolate_->AddGCEpilogueCallback(GcEpilogueCallback, this, paused_gc_types);
+    if (max_heap_mb_ > 0)
     {
-      LogError("5th argument needs to be a number!");
-      return;
+      isolate_->AddNearHeapLimitCallback(NearHeapLimitCallback, this);
     }
 
-    ACTOR_VECTOR3_SETTER(actor_id, field_id, (float)x.FromJust(), (float)y.FromJust(), (float)z.FromJust());
+    Locker locker(isolate_);
+    Isolate::Scope isolate_scope(isolate_);
+    HandleScope handle_scope(isolate_);
+    const char *components[] = {"x", "y", "z", "w"};
+    for (int i = 0; i < 4; i++)
+    {
+      component_keys_[i].Set(isolate_, String::NewFromUtf8(isolate_, components[i], NewStringType::kInternalized).ToLocalChecked());
+    }
   }
 
-  static void GetActorFloatV8Callback(const FunctionCallbackInfo<Value> &info)
+  ~BrainIsolate()
   {
-    if (ACTOR_FLOAT_GETTER == nullptr)
     {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_FLOAT_GETTER set");
-      return;
+      Locker locker(isolate_);
+      if (cpu_profiler_ != nullptr)
+      {
+        // Stopped first, so the sampler thread is gone before the isolate.
+        Isolate::Scope isolate_scope(isolate_);
+        HandleScope handle_scope(isolate_);
+        StopProfiling([](const CpuProfile *) {});
+        LogError("A brain's isolate was disposed while being profiled, so its profile is discarded. Stop profiling before resetting or deleting the brain.");
+      }
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+      uncached_modules_.clear();
+#endif
     }
+    isolate_->Dispose();
+    delete create_params_.array_buffer_allocator;
+  }
 
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+  Isolate *GetIsolate() { return isolate_; }
+
+  // The snapshot that new contexts in this isolate are deserialized from.
+  const std::shared_ptr<BrainSnapshot> &GetSnapshot() const { return snapshot_; }
+
+  // Whether it came from the shared pool, so other brains may run in it.
+  bool IsShared() const { return shared_; }
+
+  // "x", "y", "z" and "w", for vector and quaternion objects.
+  Local<String> GetComponentKey(int index) { return component_keys_[index].Get(isolate_); }
+
+  // Null for isolates that brains do not run in.
+  static BrainIsolate *FromIsolate(Isolate *isolate) { return (BrainIsolate *)isolate->GetData(BRAIN_ISOLATE_DATA_SLOT); }
+
+  bool HasHeapLimit() const { return max_heap_mb_ > 0; }
+
+  // Null unless the brain asked for one.
+  PooledArrayBufferAllocator *GetPooledAllocator() { return pooled_allocator_; }
+
+  // Call these with the isolate locked and entered. Returns false if the
+  // isolate is already being profiled.
+  bool StartProfiling(int sampling_interval_us)
+  {
+    if (cpu_profiler_ != nullptr)
     {
-      return;
+      return false;
     }
-
-    float value_out = false;
-    ACTOR_FLOAT_GETTER(actor_id, field_id, &value_out);
-    info.GetReturnValue().Set(value_out);
+    cpu_profiler_ = CpuProfiler::New(isolate_);
+    cpu_profiler_->SetSamplingInterval(sampling_interval_us);
+    cpu_profiler_->StartProfiling(GetProfileTitle(), true);
+    return true;
   }
 
-  static void SetActorFloatV8Callback(const FunctionCallbackInfo<Value> &info)
+  // Hands the profile to use_profile, which must be done with it by the time
+  // it returns, since the profile goes with the profiler. Returns false if the
+  // isolate was not being profiled.
+  bool StopProfiling(const std::function<void(const CpuProfile *)> &use_profile)
   {
-    if (ACTOR_FLOAT_SETTER == nullptr)
+    if (cpu_profiler_ == nullptr)
     {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_FLOAT_SETTER set");
-      return;
+      return false;
     }
-
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    CpuProfile *profile = cpu_profiler_->StopProfiling(GetProfileTitle());
+    if (profile != nullptr)
     {
-      return;
+      use_profile(profile);
+      profile->Delete();
     }
+    cpu_profiler_->Dispose();
+    cpu_profiler_ = nullptr;
+    return profile != nullptr;
+  }
 
-    Local<Context> context = info.GetIsolate()->GetCurrentContext();
-    Maybe<double> value = info[2]->NumberValue(context);
-
-    if (value.IsNothing())
+  // Call with the isolate locked, once a terminated script has unwound.
+  void RecoverFromTermination()
+  {
+    isolate_->CancelTerminateExecution();
+    if (terminated_for_heap_)
     {
-      LogError("3rd argument needs to be a float!");
-      return;
+      // Back down to the initial limit, or what is in use if more.
+      isolate_->RemoveNearHeapLimitCallback(NearHeapLimitCallback, initial_heap_limit_);
+      isolate_->AddNearHeapLimitCallback(NearHeapLimitCallback, this);
+      heap_growths_ = 0;
+      terminated_for_heap_ = false;
     }
+  }
 
-    ACTOR_FLOAT_SETTER(actor_id, field_id, (float)value.FromJust());
+  // Assumes the isolate is locked.
+  void GetHeapStatistics(BrainHeapStatistics *stats_out)
+  {
+    HeapStatistics stats;
+    isolate_->GetHeapStatistics(&stats);
+    stats_out->totalHeapSize = stats.total_heap_size();
+    stats_out->usedHeapSize = stats.used_heap_size();
+    stats_out->heapSizeLimit = stats.heap_size_limit();
+    stats_out->mallocedMemory = stats.malloced_memory();
+    stats_out->externalMemory = isolate_->AdjustAmountOfExternalAllocatedMemory(0);
+    stats_out->nearHeapLimitCount = near_heap_limit_count_;
+    stats_out->heapLimitTerminations = heap_limit_terminations_;
   }
 
-  static void GetActorQuaternionV8Callback(const FunctionCallbackInfo<Value> &info)
+  enum class GcPhase
   {
-    if (ACTOR_QUATERNION_GETTER == nullptr)
-    {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_QUATERNION_GETTER set");
-      return;
-    }
+    kOther,
+    kUpdate,
+    kIdle
+  };
 
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+  // GC pauses during the scope's lifetime count towards its phase.
+  class GcPhaseScope
+  {
+  public:
+    GcPhaseScope(BrainIsolate *brain_isolate, GcPhase phase) : brain_isolate_(brain_isolate), saved_phase_(brain_isolate->gc_phase_)
     {
-      return;
+      brain_isolate_->gc_phase_ = phase;
     }
+    ~GcPhaseScope() { brain_isolate_->gc_phase_ = saved_phase_; }
 
-    Local<Context> context = info.GetIsolate()->GetCurrentContext();
-    Local<Value> out_val = info[2];
-    if (out_val.IsEmpty() || !out_val->IsObject())
-    {
-      LogError("GetActorQuaternionV8Callback: Third argument must be an object");
-      return;
-    }
+  private:
+    BrainIsolate *brain_isolate_;
+    GcPhase saved_phase_;
+  };
+
+  const BrainGcStatistics &GetGcStatistics() const { return gc_stats_; }
+  void ResetGcStatistics() { gc_stats_ = BrainGcStatistics(); }
 
-    float xout = 0.0;
-    float yout = 0.0;
-    float zout = 0.0;
-    float wout = 0.0;
-    ACTOR_QUATERNION_GETTER(actor_id, field_id, &xout, &yout, &zout, &wout);
+  // Bytes freed by all collections so far, for telling how much was allocated
+  // across a span with collections in it.
+  long long GetGcFreedBytes() const { return gc_freed_bytes_; }
 
-    Local<Object> out_obj = out_val->ToObject(context).ToLocalChecked();
-    out_obj->Set(String::NewFromUtf8(info.GetIsolate(), "x"), Number::New(info.GetIsolate(), xout));
-    out_obj->Set(String::NewFromUtf8(info.GetIsolate(), "y"), Number::New(info.GetIsolate(), yout));
-    out_obj->Set(String::NewFromUtf8(info.GetIsolate(), "z"), Number::New(info.GetIsolate(), zout));
-    out_obj->Set(String::NewFromUtf8(info.GetIsolate(), "w"), Number::New(info.GetIsolate(), wout));
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+  // Modules that missed the code cache get their entries written again after
+  // a tick, so they also cover functions that were lazily compiled meanwhile.
+  // Assumes the isolate is locked.
+  void AddUncachedModule(const std::string &cache_key, Local<UnboundModuleScript> script)
+  {
+    uncached_modules_.emplace_back(cache_key, Global<UnboundModuleScript>(isolate_, script));
   }
 
-  static void SetActorQuaternionV8Callback(const FunctionCallbackInfo<Value> &info)
+  void StoreUncachedModules()
   {
-    if (ACTOR_QUATERNION_SETTER == nullptr)
+    if (uncached_modules_.empty())
     {
-      // TODO ideally we'd cause a V8 exception throw
-      LogError("No ACTOR_QUATERNION_SETTER set");
       return;
     }
-
-    TEMP_ACTOR_ID actor_id;
-    ACTOR_FIELD_ID field_id;
-    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    HandleScope handle_scope(isolate_);
+    for (auto &entry : uncached_modules_)
     {
-      return;
+      CODE_CACHE.Store(entry.first, ScriptCompiler::CreateCodeCache(entry.second.Get(isolate_)));
     }
+    uncached_modules_.clear();
+  }
+#endif
 
-    Local<Context> context = info.GetIsolate()->GetCurrentContext();
-    Maybe<double> x = info[2]->NumberValue(context);
-    if (x.IsNothing())
+private:
+  Local<String> GetProfileTitle()
+  {
+    return String::NewFromUtf8(isolate_, "brain", NewStringType::kInternalized).ToLocalChecked();
+  }
+
+  static void GcPrologueCallback(Isolate *isolate, GCType type, GCCallbackFlags flags, void *data)
+  {
+    (void)type;
+    (void)flags;
+    BrainIsolate *self = (BrainIsolate *)data;
+    HeapStatistics stats;
+    isolate->GetHeapStatistics(&stats);
+    self->used_before_gc_ = stats.used_heap_size();
+    self->gc_start_ = std::chrono::steady_clock::now();
+  }
+
+  static void GcEpilogueCallback(Isolate *isolate, GCType type, GCCallbackFlags flags, void *data)
+  {
+    (void)flags;
+    BrainIsolate *self = (BrainIsolate *)data;
+    double ms = MillisecondsSince(self->gc_start_);
+    if (BRAIN_TRACER.IsEnabled())
     {
-      LogError("3rd argument needs to be a number!");
-      return;
+      BRAIN_TRACER.Record("gc", type == kGCTypeScavenge ? "Scavenge" : "MarkSweepCompact", nullptr, self->gc_start_, std::chrono::steady_clock::now());
     }
-    Maybe<double> y = info[3]->NumberValue(context);
-    if (y.IsNothing())
+    HeapStatistics stats;
+    isolate->GetHeapStatistics(&stats);
+    self->gc_freed_bytes_ += (long long)self->used_before_gc_ - (long long)stats.used_heap_size();
+
+    BrainGcStatistics &gc_stats = self->gc_stats_;
+    switch (self->gc_phase_)
     {
-      LogError("4th argument needs to be a number!");
-      return;
+    case GcPhase::kUpdate:
+      gc_stats.pausesInUpdate++;
+      gc_stats.pauseMsInUpdate += ms;
+      gc_stats.maxPauseMsInUpdate = std::max(gc_stats.maxPauseMsInUpdate, ms);
+      break;
+    case GcPhase::kIdle:
+      gc_stats.pausesInIdle++;
+      gc_stats.pauseMsInIdle += ms;
+      break;
+    case GcPhase::kOther:
+      gc_stats.otherPauses++;
+      gc_stats.otherPauseMs += ms;
+      break;
     }
-    Maybe<double> z = info[4]->NumberValue(context);
-    if (z.IsNothing())
+  }
+
+  static size_t NearHeapLimitCallback(void *data, size_t current_heap_limit, size_t initial_heap_limit)
+  {
+    BrainIsolate *self = (BrainIsolate *)data;
+    self->initial_heap_limit_ = initial_heap_limit;
+    self->near_heap_limit_count_++;
+    std::ostringstream msg;
+    if (self->heap_growths_ < self->max_heap_growths_)
     {
-      LogError("5th argument needs to be a number!");
-      return;
+      self->heap_growths_++;
+      size_t new_limit = current_heap_limit + current_heap_limit / 2;
+      msg << "Brain heap is near its limit of " << (current_heap_limit >> 20) << " MB. Growing it to " << (new_limit >> 20) << " MB.";
+      LogError(msg);
+      return new_limit;
     }
-    Maybe<double> w = info[5]->NumberValue(context);
-    if (z.IsNothing())
+
+    msg << "Brain heap is near its limit of " << (current_heap_limit >> 20) << " MB. Terminating the running script.";
+    LogError(msg);
+    self->heap_limit_terminations_++;
+    self->terminated_for_heap_ = true;
+    self->isolate_->TerminateExecution();
+    // V8 aborts if the limit is not raised, so leave some room to unwind.
+    return current_heap_limit + initial_heap_limit / 4;
+  }
+
+  Isolate::CreateParams create_params_;
+  Isolate *isolate_;
+  std::shared_ptr<BrainSnapshot> snapshot_;
+  bool shared_;
+  Eternal<String> component_keys_[4];
+  // Owned through create_params_, like the default one.
+  PooledArrayBufferAllocator *pooled_allocator_;
+
+  int max_heap_mb_;
+  int max_heap_growths_;
+  int heap_growths_;
+  size_t initial_heap_limit_;
+  int near_heap_limit_count_;
+  int heap_limit_terminations_;
+  bool terminated_for_heap_;
+
+  GcPhase gc_phase_;
+  BrainGcStatistics gc_stats_;
+  std::chrono::steady_clock::time_point gc_start_;
+  size_t used_before_gc_;
+  long long gc_freed_bytes_;
+
+  CpuProfiler *cpu_profiler_;
+
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+  std::vector<std::pair<std::string, Global<UnboundModuleScript>>> uncached_modules_;
+#endif
+};
+
+// 0 means every brain gets its own isolate.
+int SHARED_BRAIN_ISOLATE_POOL_SIZE = 0;
+std::vector<std::shared_ptr<BrainIsolate>> SHARED_BRAIN_ISOLATES;
+// Guards both, since brains can be reset from any thread.
+std::mutex SHARED_BRAIN_ISOLATES_MUTEX;
+
+// Terminated scripts have no exception to log, and leave the isolate to be
+// recovered before it can run anything else. Calls made from a script pass
+// recover as false, so the termination still unwinds that script, and
+// whoever called it recovers.
+static void LogCallFailure(const char *prefix, Isolate *isolate, TryCatch *try_catch, bool recover = true)
+{
+  if (try_catch->HasTerminated())
+  {
+    std::ostringstream msg;
+    msg << prefix << "Script was terminated.";
+    LogError(msg);
+    BrainIsolate *brain_isolate = BrainIsolate::FromIsolate(isolate);
+    if (brain_isolate != nullptr && recover)
     {
-      LogError("6th argument needs to be a number!");
-      return;
+      brain_isolate->RecoverFromTermination();
     }
+    return;
+  }
+  LogException(prefix, isolate, try_catch);
+}
+
+// Terminates scripts that run past their deadline. One thread watches every
+// brain, started once the first deadline is armed.
+class BrainWatchdog
+{
+public:
+  BrainWatchdog() : next_id_(1), stopping_(false) {}
 
-    ACTOR_QUATERNION_SETTER(actor_id, field_id, (float)x.FromJust(), (float)y.FromJust(), (float)z.FromJust(), (float)w.FromJust());
+  ~BrainWatchdog()
+  {
+    Stop();
   }
 
-  // Short-cut for non-performance-sensitive functions, like using Unity's Physics.Raycast.
-  // Which services are available should be agreed upon between the host and the JS code.
-  static void CallServiceV8Callback(const FunctionCallbackInfo<Value> &info)
+  // Arming it again starts a new thread.
+  void Stop()
   {
-    if (CALL_SERVICE_FUNCTION == nullptr)
     {
-      LogError("Scripts wanted to use callService, but no call-service-function was set (via SetCallServiceFunction).");
-      return;
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable())
+    {
+      thread_.join();
     }
+    stopping_ = false;
+  }
 
-    VoosBrain *brain = GetThis(info);
-    String::Utf8Value serviceName(info.GetIsolate(), info[0]);
+  // Returns the id to disarm it with.
+  uint64_t Arm(Isolate *isolate, std::chrono::steady_clock::time_point deadline)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable())
+    {
+      thread_ = std::thread([this]() { WatchLoop(); });
+    }
+    uint64_t id = next_id_++;
+    deadlines_[id] = Deadline{isolate, deadline, false};
+    cv_.notify_all();
+    return id;
+  }
 
-    if (serviceName.length() > MAX_GUID_LENGTH)
+  // Returns true if the deadline passed and the isolate was told to terminate.
+  // Either way, it will not be anymore.
+  bool Disarm(uint64_t id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = deadlines_.find(id);
+    if (it == deadlines_.end())
     {
-      return;
+      return false;
     }
+    bool fired = it->second.fired;
+    deadlines_.erase(it);
+    return fired;
+  }
 
-    MaybeLocal<String> maybeArgsJson = JSON::Stringify(brain->GetReusableContext(), info[1]);
+private:
+  struct Deadline
+  {
+    Isolate *isolate;
+    std::chrono::steady_clock::time_point time;
+    bool fired;
+  };
 
-    if (maybeArgsJson.IsEmpty())
+  void WatchLoop()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_)
     {
-      std::ostringstream err;
-      err << "Could not JSON-nify arguments when trying to call service '" << *serviceName << "'. Returning nothing.";
-      LogError(err);
-      return;
+      auto now = std::chrono::steady_clock::now();
+      auto next = std::chrono::steady_clock::time_point::max();
+      for (auto &entry : deadlines_)
+      {
+        Deadline &deadline = entry.second;
+        if (deadline.fired)
+        {
+          continue;
+        }
+        if (deadline.time <= now)
+        {
+          // Safe from any thread.
+          deadline.isolate->TerminateExecution();
+          deadline.fired = true;
+        }
+        else
+        {
+          next = std::min(next, deadline.time);
+        }
+      }
+      if (next == std::chrono::steady_clock::time_point::max())
+      {
+        cv_.wait(lock);
+      }
+      else
+      {
+        cv_.wait_until(lock, next);
+      }
     }
+  }
 
-    String::Utf8Value argsJson(info.GetIsolate(), maybeArgsJson.ToLocalChecked());
-    if (argsJson.length() > MAX_JSON_LENGTH)
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<uint64_t, Deadline> deadlines_;
+  uint64_t next_id_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+BrainWatchdog BRAIN_WATCHDOG;
+
+// Holds a script run to a time budget, if there is one. Once disarmed, a
+// termination the script never got to is cancelled, so it can't hit the next
+// script instead. Cancelling one already recovered from does nothing.
+class BudgetScope
+{
+public:
+  BudgetScope(Isolate *isolate, double budget_ms) : isolate_(isolate), id_(0), fired_(false)
+  {
+    if (budget_ms > 0)
     {
-      return;
+      auto budget = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(budget_ms));
+      id_ = BRAIN_WATCHDOG.Arm(isolate, std::chrono::steady_clock::now() + budget);
     }
-    CallService(*serviceName, *argsJson, brain);
+  }
 
-    if (brain->last_service_call_result.IsEmpty())
+  ~BudgetScope()
+  {
+    Disarm();
+  }
+
+  // Returns true if the deadline passed.
+  bool Disarm()
+  {
+    if (id_ != 0)
     {
-      std::ostringstream err;
-      err << "Failed to capture result of service '" << *serviceName << "'. See prior errors for details. Input args json: " << *argsJson;
-      LogError(err);
-      return;
+      fired_ = BRAIN_WATCHDOG.Disarm(id_);
+      id_ = 0;
+      if (fired_)
+      {
+        isolate_->CancelTerminateExecution();
+      }
     }
+    return fired_;
+  }
 
-    info.GetReturnValue().Set(brain->last_service_call_result.ToLocalChecked());
+private:
+  Isolate *isolate_;
+  uint64_t id_;
+  bool fired_;
+};
+
+static void WriteCpuProfileNodeJson(std::ostream &out, const CpuProfileNode *node)
+{
+  // DevTools counts lines and columns from 0, V8 from 1.
+  out << "{\"id\":" << node->GetNodeId() << ",\"callFrame\":{\"functionName\":";
+  WriteJsonString(out, node->GetFunctionNameStr());
+  out << ",\"scriptId\":\"" << node->GetScriptId() << "\",\"url\":";
+  WriteJsonString(out, node->GetScriptResourceNameStr());
+  out << ",\"lineNumber\":" << node->GetLineNumber() - 1 << ",\"columnNumber\":" << node->GetColumnNumber() - 1
+      << "},\"hitCount\":" << node->GetHitCount() << ",\"children\":[";
+  for (int i = 0; i < node->GetChildrenCount(); i++)
+  {
+    out << (i > 0 ? "," : "") << node->GetChild(i)->GetNodeId();
+  }
+  out << "]}";
+  for (int i = 0; i < node->GetChildrenCount(); i++)
+  {
+    out << ",";
+    WriteCpuProfileNodeJson(out, node->GetChild(i));
   }
+}
 
-  static void GetModuleV8Callback(const FunctionCallbackInfo<Value> &info)
+// Chrome DevTools' .cpuprofile format. Times are in microseconds.
+static void WriteCpuProfileJson(std::ostream &out, const CpuProfile *profile)
+{
+  out << "{\"nodes\":[";
+  WriteCpuProfileNodeJson(out, profile->GetTopDownRoot());
+  out << "],\"startTime\":" << profile->GetStartTime() << ",\"endTime\":" << profile->GetEndTime() << ",\"samples\":[";
+  for (int i = 0; i < profile->GetSamplesCount(); i++)
   {
-    VoosBrain *brain = GetThis(info);
-    String::Utf8Value module_id(info.GetIsolate(), info[0]);
-    if (module_id.length() > MAX_GUID_LENGTH)
+    out << (i > 0 ? "," : "") << profile->GetSample(i)->GetNodeId();
+  }
+  out << "],\"timeDeltas\":[";
+  int64_t last_timestamp = profile->GetStartTime();
+  for (int i = 0; i < profile->GetSamplesCount(); i++)
+  {
+    int64_t timestamp = profile->GetSampleTimestamp(i);
+    out << (i > 0 ? "," : "") << timestamp - last_timestamp;
+    last_timestamp = timestamp;
+  }
+  out << "]}";
+}
+
+// Isolates are only shared between brains using the same snapshot (or none),
+// since a snapshot's default context is what Context::New deserializes. Brains
+// with their own isolate options always get their own isolate.
+static std::shared_ptr<BrainIsolate> AcquireBrainIsolate(std::shared_ptr<BrainSnapshot> snapshot, const intptr_t *external_references,
+                                                         const BrainIsolateOptions &options)
+{
+  // Dropped isolates are disposed after the lock is released.
+  std::vector<std::shared_ptr<BrainIsolate>> dropped;
+  std::unique_lock<std::mutex> lock(SHARED_BRAIN_ISOLATES_MUTEX);
+  if (SHARED_BRAIN_ISOLATE_POOL_SIZE <= 0 || !options.IsDefault())
+  {
+    lock.unlock();
+    return std::make_shared<BrainIsolate>(snapshot, external_references, options);
+  }
+
+  // Drop idle isolates for other snapshots. The pool holds one reference.
+  auto idle_end = std::partition(SHARED_BRAIN_ISOLATES.begin(), SHARED_BRAIN_ISOLATES.end(),
+                                 [&snapshot](const std::shared_ptr<BrainIsolate> &candidate) {
+                                   return candidate.use_count() > 1 || candidate->GetSnapshot() == snapshot;
+                                 });
+  std::move(idle_end, SHARED_BRAIN_ISOLATES.end(), std::back_inserter(dropped));
+  SHARED_BRAIN_ISOLATES.erase(idle_end, SHARED_BRAIN_ISOLATES.end());
+
+  std::shared_ptr<BrainIsolate> least_used;
+  int num_matching = 0;
+  for (const auto &candidate : SHARED_BRAIN_ISOLATES)
+  {
+    if (candidate->GetSnapshot() != snapshot)
     {
-      return;
+      continue;
+    }
+    num_matching++;
+    if (!least_used || candidate.use_count() < least_used.use_count())
+    {
+      least_used = candidate;
     }
-    info.GetReturnValue().Set(brain->GetModuleNamespaceObject(*module_id));
   }
 
-  void SetField(Local<Object> obj, std::string key_string, Local<Value> value)
+  if (least_used && (num_matching >= SHARED_BRAIN_ISOLATE_POOL_SIZE || least_used.use_count() == 1))
   {
-    Local<String> key = String::NewFromUtf8(GetIsolate(), key_string.c_str(), NewStringType::kNormal).ToLocalChecked();
-    obj->Set(key, value);
+    return least_used;
   }
 
-  float GetFloatField(Local<Object> obj, std::string key_string)
+  std::shared_ptr<BrainIsolate> created = std::make_shared<BrainIsolate>(snapshot, external_references, options, true);
+  SHARED_BRAIN_ISOLATES.push_back(created);
+  return created;
+}
+
+// Binary tick channel.
+
+// Requests and responses are an 8 byte header (magic, schema version) and then
+// one value per schema field, in schema order, with no padding. Values are in
+// the host's byte order.
+const uint32_t BINARY_TICK_MAGIC = 0x534F4F56; // "VOOS"
+const size_t MAX_BINARY_SCHEMA_FIELDS = 256;
+
+enum class BinaryFieldType
+{
+  Bool,         // 1 byte, 0 or 1
+  Int32,        // 4 bytes
+  Float32,      // 4 bytes
+  Float64,      // 8 bytes
+  String,       // uint32 byte count, then UTF-8
+  Vector3,      // 3 floats, as {x, y, z}
+  Quaternion,   // 4 floats, as {x, y, z, w}
+  Float32Array, // uint32 element count, then floats, as a Float32Array
+};
+
+struct BinaryField
+{
+  std::string name;
+  BinaryFieldType type;
+};
+
+class BinarySchema
+{
+public:
+  BinarySchema() : version(0) {}
+
+  // Specs list name:type pairs, like "hp:f32,alive:bool,name:str,pos:vec3".
+  // Types are bool, i32, f32, f64, str, vec3, quat and f32[].
+  bool Parse(const char *spec_in, uint32_t version_in)
   {
-    Local<String> key = String::NewFromUtf8(GetIsolate(), key_string.c_str(), NewStringType::kNormal).ToLocalChecked();
-    // TODO get rid of 'Checked' calls
-    return (float)obj->Get(key)->NumberValue(GetIsolate()->GetCurrentContext()).ToChecked();
+    fields.clear();
+    spec = spec_in;
+    version = version_in;
+
+    std::istringstream entries(spec);
+    std::string entry;
+    while (std::getline(entries, entry, ','))
+    {
+      size_t colon = entry.find(':');
+      if (colon == std::string::npos || colon == 0)
+      {
+        std::ostringstream errs;
+        errs << "Bad binary schema entry '" << entry << "'. Expected name:type.";
+        LogError(errs);
+        return false;
+      }
+      BinaryField field;
+      field.name = entry.substr(0, colon);
+      if (!ParseType(entry.substr(colon + 1), &field.type))
+      {
+        std::ostringstream errs;
+        errs << "Unknown binary schema type in '" << entry << "'.";
+        LogError(errs);
+        return false;
+      }
+      fields.push_back(field);
+    }
+
+    if (fields.size() > MAX_BINARY_SCHEMA_FIELDS)
+    {
+      LogError("Too many fields in binary schema.");
+      return false;
+    }
+    return true;
   }
 
-  // This should be waaaayyy faster than Context::New(...).
-  Local<Context> GetReusableContext()
+  // Total number of components if every field is a fixed number of numbers,
+  // otherwise -1.
+  int NumericComponentCount() const
   {
-    return Local<Context>::New(isolate_, reusable_context_);
+    int count = 0;
+    for (const BinaryField &field : fields)
+    {
+      int components = NumericComponentCount(field.type);
+      if (components < 0)
+      {
+        return -1;
+      }
+      count += components;
+    }
+    return count;
   }
 
-  // Everything in this block is fairly cheap. Even doing it 100x doesn't affect timings much.
-  // Assumes the isolate has a context active.
-  bool CompileBrainJavascript(const char *javascriptSource)
+  static int NumericComponentCount(BinaryFieldType type)
   {
-    TryCatch try_catch(isolate_);
+    switch (type)
+    {
+    case BinaryFieldType::Bool:
+    case BinaryFieldType::Int32:
+    case BinaryFieldType::Float32:
+    case BinaryFieldType::Float64:
+      return 1;
+    case BinaryFieldType::Vector3:
+      return 3;
+    case BinaryFieldType::Quaternion:
+      return 4;
+    default:
+      return -1;
+    }
+  }
 
-    Local<String> source =
-        String::NewFromUtf8(isolate_, javascriptSource, NewStringType::kNormal).ToLocalChecked();
+  std::string spec;
+  uint32_t version;
+  std::vector<BinaryField> fields;
 
-    MaybeLocal<Script> compiled = Script::Compile(isolate_->GetCurrentContext(), source);
-    if (compiled.IsEmpty())
+private:
+  static bool ParseType(const std::string &name, BinaryFieldType *type_out)
+  {
+    static const std::pair<const char *, BinaryFieldType> TYPES[] = {
+        {"bool", BinaryFieldType::Bool},
+        {"i32", BinaryFieldType::Int32},
+        {"f32", BinaryFieldType::Float32},
+        {"f64", BinaryFieldType::Float64},
+        {"str", BinaryFieldType::String},
+        {"vec3", BinaryFieldType::Vector3},
+        {"quat", BinaryFieldType::Quaternion},
+        {"f32[]", BinaryFieldType::Float32Array},
+    };
+    for (const auto &type : TYPES)
     {
-      LogException("Error while compiling brain JS: ", isolate_, &try_catch);
-      return false;
+      if (name == type.first)
+      {
+        *type_out = type.second;
+        return true;
+      }
     }
+    return false;
+  }
+};
 
-    MaybeLocal<Value> result = compiled.ToLocalChecked()->Run(isolate_->GetCurrentContext());
-    if (try_catch.HasCaught())
+class BinaryReader
+{
+public:
+  BinaryReader(const char *data, size_t length) : data_(data), length_(length), offset_(0) {}
+
+  // Returns null if there are not enough bytes left.
+  const char *Take(size_t size)
+  {
+    if (length_ - offset_ < size)
     {
-      LogException("Exception caught while running brain JS: ", isolate_, &try_catch);
-      return false;
+      return nullptr;
     }
+    const char *start = data_ + offset_;
+    offset_ += size;
+    return start;
+  }
 
+  template <typename T>
+  bool Read(T *value_out)
+  {
+    const char *bytes = Take(sizeof(T));
+    if (bytes == nullptr)
+    {
+      return false;
+    }
+    memcpy(value_out, bytes, sizeof(T));
     return true;
   }
 
-  Isolate *GetIsolate() { return isolate_; }
+  size_t Remaining() const { return length_ - offset_; }
 
-  Isolate::CreateParams create_params;
-  Isolate *isolate_;
-  Global<Context> reusable_context_;
-  Global<Function> reusable_update_agent_function_;
-  Global<Function> reusable_post_message_flush_function_;
-  std::map<std::string, Global<Value>> module_namespaces_by_id;
+private:
+  const char *data_;
+  size_t length_;
+  size_t offset_;
+};
 
-  MaybeLocal<Value> last_service_call_result;
+template <typename T>
+static void AppendBinary(std::vector<char> *out, const T &value)
+{
+  const char *bytes = reinterpret_cast<const char *>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(T));
+}
+
+// Typed services.
+
+struct TypedService
+{
+  std::string name;
+  BinarySchema args_schema;
+  BinarySchema result_schema;
+  TypedServiceFunction function;
 };
 
-// TODO move this into a class.
-std::map<std::string, std::unique_ptr<VoosBrain>> BRAIN_BY_UID;
+typedef std::map<std::string, std::shared_ptr<const TypedService>> TypedServiceMap;
 
-// Keeps an isolate around so you don't have to create a new one each time you want to run some JS.
-class ReusableContext
+// Registered by the host, and looked up from any brain thread on every
+// callVoosService. Never changed in place: changes swap in a new map, so
+// lookups just load the current one.
+std::shared_ptr<const TypedServiceMap> TYPED_SERVICES = std::make_shared<TypedServiceMap>();
+// Serializes changes.
+std::mutex TYPED_SERVICES_MUTEX;
+
+static std::shared_ptr<const TypedService> FindTypedService(const char *serviceName)
 {
-public:
-  ReusableContext() : isolate_(nullptr)
+  std::shared_ptr<const TypedServiceMap> services = std::atomic_load(&TYPED_SERVICES);
+  if (services->empty())
   {
-    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
-    isolate_ = Isolate::New(create_params);
+    return nullptr;
+  }
+  auto it = services->find(serviceName);
+  return it == services->end() ? nullptr : it->second;
+}
 
-    // Create the context
-    Isolate::Scope isolate_scope(isolate_);
-    // Create a stack-allocated handle scope.
-    HandleScope handle_scope(isolate_);
+// Applies change to a copy of the registry, and swaps it in. Returns what
+// change returned.
+static bool ChangeTypedServices(const std::function<bool(TypedServiceMap *)> &change)
+{
+  std::lock_guard<std::mutex> lock(TYPED_SERVICES_MUTEX);
+  std::shared_ptr<TypedServiceMap> services = std::make_shared<TypedServiceMap>(*std::atomic_load(&TYPED_SERVICES));
+  bool result = change(services.get());
+  std::atomic_store(&TYPED_SERVICES, std::shared_ptr<const TypedServiceMap>(std::move(services)));
+  return result;
+}
 
-    Local<ObjectTemplate> global_template = ObjectTemplate::New(isolate_);
-    SetupGlobalTemplate(isolate_, global_template);
+// Per thread, grown as needed.
+static thread_local std::vector<char> TypedServiceArgsBuffer;
+static thread_local std::vector<char> TypedServiceResultBuffer;
+const size_t INITIAL_TYPED_SERVICE_RESULT_SIZE = 1024;
 
-    Local<Context> context = Context::New(isolate_, nullptr, global_template);
-    reusableContext_.Reset(isolate_, context);
+// Batched module loading.
+
+static ScriptOrigin MakeModuleOrigin(Isolate *isolate, const char *moduleUid)
+{
+  return ScriptOrigin(String::NewFromUtf8(isolate, moduleUid, NewStringType::kNormal).ToLocalChecked(),
+                      Integer::New(isolate, 0),
+                      Integer::New(isolate, 0),
+                      Boolean::New(isolate, false),
+                      Local<Integer>(),
+                      Local<Value>(),
+                      Local<Boolean>(),
+                      Boolean::New(isolate, false),
+                      Boolean::New(isolate, true));
+}
+
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+// Isolates for compiling modules off brain threads, kept between batches.
+class ScratchIsolates
+{
+public:
+  Isolate *Acquire()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty())
+    {
+      Isolate *isolate = free_.back();
+      free_.pop_back();
+      return isolate;
+    }
+    if (!allocator_)
+    {
+      allocator_.reset(ArrayBuffer::Allocator::NewDefaultAllocator());
+    }
+    Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = allocator_.get();
+    return Isolate::New(create_params);
   }
 
-  Isolate *GetIsolate() { return isolate_; }
+  void Release(Isolate *isolate)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(isolate);
+  }
 
-  void Evaluate(const char *javascriptSource)
+  // Only once no batch is running.
+  void Clear()
   {
-    Isolate::Scope isolate_scope(isolate_);
-    HandleScope handle_scope(isolate_);
-    auto context = GetReusableContext();
-    Context::Scope context_scope(context);
-    CompileAndRun(javascriptSource);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (Isolate *isolate : free_)
+    {
+      isolate->Dispose();
+    }
+    free_.clear();
+    allocator_.reset();
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<Isolate *> free_;
+  std::unique_ptr<ArrayBuffer::Allocator> allocator_;
+};
+
+static ScratchIsolates SCRATCH_ISOLATES;
+#endif
+
+// A brain's modules can only be compiled on the thread holding its isolate,
+// so background threads compile them in scratch isolates, just for the code
+// caches. The brain then compiles them from those, which only deserializes
+// them, and instantiates and evaluates them in order. Modules already in the
+// code cache are left to the brain. Without module code caches (V8 before
+// 6.9) or a spare core, there is no background work, and modules are simply
+// compiled when they are loaded.
+class ModuleBatch
+{
+public:
+  ModuleBatch(int count, const char **module_uids, const char **module_sources)
+      : caches(count), results(count, false), num_loaded(0), compiled_(count, false), next_job_(0)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      uids.push_back(module_uids[i]);
+      sources.push_back(module_sources[i]);
+    }
+  }
+
+  ~ModuleBatch()
+  {
+    Wait();
+  }
+
+  void Start()
+  {
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+    // Leave a core for the brain's thread. Without a spare one, compiling in
+    // the background only adds work.
+    int num_threads = std::min((int)std::thread::hardware_concurrency() - 1, (int)uids.size());
+    for (int i = 0; i < num_threads; i++)
+    {
+      threads_.emplace_back(&ModuleBatch::CompileLoop, this);
+    }
+    if (num_threads > 0)
+    {
+      return;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(mutex_);
+    compiled_.assign(compiled_.size(), true);
+  }
+
+  void Wait()
+  {
+    for (auto &thread : threads_)
+    {
+      thread.join();
+    }
+    threads_.clear();
+  }
+
+  // Whether the background work for module i is done. Its cache may still be
+  // empty, if it failed to compile or was already in the code cache.
+  bool IsCompiled(size_t i)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return compiled_[i];
+  }
+
+  void WaitUntilCompiled(size_t i)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    compiled_changed_.wait(lock, [this, i]() { return compiled_[i]; });
+  }
+
+  std::vector<std::string> uids;
+  std::vector<std::string> sources;
+  std::vector<std::vector<uint8_t>> caches;
+  std::vector<bool> results;
+  // Modules are loaded in order, so this is also the next one to load.
+  size_t num_loaded;
+
+private:
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+  void CompileLoop()
+  {
+    Isolate *isolate = SCRATCH_ISOLATES.Acquire();
+    {
+      Locker locker(isolate);
+      Isolate::Scope isolate_scope(isolate);
+      HandleScope handle_scope(isolate);
+      Context::Scope context_scope(Context::New(isolate));
+
+      size_t i;
+      while ((i = next_job_++) < uids.size())
+      {
+        CompileJob(isolate, i);
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          compiled_[i] = true;
+        }
+        compiled_changed_.notify_all();
+      }
+    }
+    SCRATCH_ISOLATES.Release(isolate);
+  }
+
+  void CompileJob(Isolate *isolate, size_t i)
+  {
+    std::string cache_key = CODE_CACHE.GetKey(sources[i].c_str());
+    if (CODE_CACHE.Contains(cache_key))
+    {
+      return;
+    }
+    HandleScope module_scope(isolate);
+    // Errors are logged when the brain compiles it for real.
+    TryCatch try_catch(isolate);
+    Local<String> source_string;
+    Local<Module> module;
+    if (!String::NewFromUtf8(isolate, sources[i].c_str(), NewStringType::kNormal).ToLocal(&source_string))
+    {
+      return;
+    }
+    ScriptCompiler::Source source(source_string, MakeModuleOrigin(isolate, uids[i].c_str()));
+    if (!ScriptCompiler::CompileModule(isolate, &source).ToLocal(&module))
+    {
+      return;
+    }
+    std::unique_ptr<ScriptCompiler::CachedData> cache(ScriptCompiler::CreateCodeCache(module->GetUnboundModuleScript()));
+    if (cache)
+    {
+      caches[i].assign(cache->data, cache->data + cache->length);
+      CODE_CACHE.Store(cache_key, cache.release());
+    }
+  }
+#endif
+
+  std::mutex mutex_;
+  std::condition_variable compiled_changed_;
+  std::vector<bool> compiled_;
+  std::atomic<size_t> next_job_;
+  std::vector<std::thread> threads_;
+};
+
+// Actor field tables.
+
+// Host memory holding one field for every actor, as a struct-of-arrays block,
+// seen by JS as a typed array on the actorFields global.
+struct ActorFieldTable
+{
+  ActorFieldTable() : data(nullptr), type(ACTOR_FIELD_FLOAT32), components(0), num_actors(0), dirty(nullptr) {}
+
+  size_t GetElementSize() const
+  {
+    return type == ACTOR_FIELD_UINT8 ? 1 : 4;
+  }
+
+  size_t GetStride() const { return GetElementSize() * components; }
+  size_t GetByteLength() const { return GetStride() * num_actors; }
+
+  char *data;
+  ActorFieldType type;
+  int components;
+  int num_actors;
+  // Optional, one byte per actor. Set to 1 for actors whose values changed
+  // during a frame. Only the host clears them.
+  uint8_t *dirty;
+  // The values from the start of the current frame, to find what changed.
+  // Empty outside of frames.
+  std::vector<char> values_at_frame_start;
+  Global<ArrayBuffer> buffer;
+};
+
+#if V8_IN_UNITY_METRICS
+// The natives bound in brain contexts, in binding order.
+enum class BrainBinding
+{
+  kGetModule,
+  kCallService,
+  kCallServiceAsync,
+  kGetActorBoolean,
+  kSetActorBoolean,
+  kGetActorVector3,
+  kSetActorVector3,
+  kGetActorQuaternion,
+  kSetActorQuaternion,
+  kGetActorString,
+  kSetActorString,
+  kGetActorFloat,
+  kSetActorFloat,
+  kGetActorBooleanBatch,
+  kSetActorBooleanBatch,
+  kGetActorVector3Batch,
+  kSetActorVector3Batch,
+  kGetActorQuaternionBatch,
+  kSetActorQuaternionBatch,
+  kGetActorFloatBatch,
+  kSetActorFloatBatch,
+  kCount
+};
+
+static const char *BRAIN_BINDING_NAMES[] = {
+    "getVoosModule",
+    "callVoosService",
+    "callVoosServiceAsync",
+    "getActorBoolean",
+    "setActorBoolean",
+    "getActorVector3",
+    "setActorVector3",
+    "getActorQuaternion",
+    "setActorQuaternion",
+    "getActorString",
+    "setActorString",
+    "getActorFloat",
+    "setActorFloat",
+    "getActorBooleanBatch",
+    "setActorBooleanBatch",
+    "getActorVector3Batch",
+    "setActorVector3Batch",
+    "getActorQuaternionBatch",
+    "setActorQuaternionBatch",
+    "getActorFloatBatch",
+    "setActorFloatBatch",
+};
+
+// Index of the highest set bit. The value must not be 0.
+static int HighestBitIndex(unsigned long long value)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse64(&index, value);
+  return (int)index;
+#else
+  return 63 - __builtin_clzll(value);
+#endif
+}
+
+// Only written and read with the brain's isolate locked.
+struct CallbackMetrics
+{
+  long long count = 0;
+  long long total_ns = 0;
+  long long max_ns = 0;
+  long long buckets[V8_IN_UNITY_METRICS_BUCKETS] = {};
+
+  void Record(long long ns)
+  {
+    count++;
+    total_ns += ns;
+    max_ns = std::max(max_ns, ns);
+    int bucket = ns > 0 ? std::min(HighestBitIndex((unsigned long long)ns), V8_IN_UNITY_METRICS_BUCKETS - 1) : 0;
+    buckets[bucket]++;
+  }
+};
+
+// Records the time until it goes out of scope.
+class ScopedCallbackMetric
+{
+public:
+  explicit ScopedCallbackMetric(CallbackMetrics *metrics) : metrics_(metrics), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedCallbackMetric()
+  {
+    metrics_->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
+  }
+
+private:
+  CallbackMetrics *metrics_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#define BRAIN_BINDING_METRIC(brain, binding) ScopedCallbackMetric binding_metric(&(brain)->binding_metrics_[(int)BrainBinding::binding])
+#define BRAIN_SERVICE_METRIC(metrics) ScopedCallbackMetric service_metric(metrics)
+#else
+#define BRAIN_BINDING_METRIC(brain, binding)
+#define BRAIN_SERVICE_METRIC(metrics)
+#endif
+
+class VoosBrain : public ServiceUser
+{
+public:
+  // TODO create these using a factory method instead, to better handle ctor errors.
+
+  bool valid;
+
+  // If a snapshot is given, it must have been created from the same brain JS.
+  // The time budget also applies to running the brain JS.
+  VoosBrain(const char *javascript, std::shared_ptr<BrainSnapshot> snapshot = nullptr, const BrainIsolateOptions &isolate_options = BrainIsolateOptions(),
+            double time_budget_ms = 0)
+      : valid(false), isolate_(nullptr), lazy_modules_(false), gc_pacing_(false), allocated_bytes_per_tick_(0), time_budget_ms_(time_budget_ms),
+        task_budget_ms_(0), microtasks_pending_(false), task_stats_(), snapshot_(snapshot), has_binary_schemas_(false),
+        result_buffer_(nullptr), result_buffer_capacity_(0)
+  {
+    memset(&host_callbacks_, 0, sizeof(host_callbacks_));
+    brain_isolate_ = AcquireBrainIsolate(snapshot_, GetExternalReferences(), isolate_options);
+    isolate_ = brain_isolate_->GetIsolate();
+
+    // Create the context
+    Locker locker(isolate_);
+    Isolate::Scope isolate_scope(isolate_);
+    // Create a stack-allocated handle scope.
+    HandleScope handle_scope(isolate_);
+
+    Local<Context> context;
+    if (snapshot_)
+    {
+      // The snapshot's default context already has our functions bound and
+      // the brain JS run.
+      context = Context::New(isolate_);
+    }
+    else
+    {
+      Local<ObjectTemplate> global_template = ObjectTemplate::New(isolate_);
+      SetupBrainGlobalTemplate(isolate_, global_template, this);
+      context = Context::New(isolate_, nullptr, global_template);
+    }
+    reusable_context_.Reset(isolate_, context);
+    context->SetAlignedPointerInEmbedderData(BRAIN_EMBEDDER_DATA_INDEX, this);
+
+    // Compile source and pull out the functions we expect.
+    Context::Scope context_scope(context);
+
+    // Keep brains that share an isolate from reaching into each other.
+    context->SetSecurityToken(Object::New(isolate_));
+
+    BudgetScope budget(isolate_, time_budget_ms_);
+    if (snapshot_)
+    {
+      if (!RestoreSnapshotModules(context))
+      {
+        valid = false;
+        return;
+      }
+    }
+    // Compile and evaluate the JS
+    else if (!CompileBrainJavascript(isolate_, javascript, &uncached_brain_script_))
+    {
+      valid = false;
+      return;
+    }
+    else if (!uncached_brain_script_.IsEmpty())
+    {
+      brain_script_cache_key_ = CODE_CACHE.GetKey(javascript);
+    }
+
+    // Fetch out the functions we need to call
+    if (!GetReusableFunctionReference(GetIsolate(), &context, "updateAgent", &reusable_update_agent_function_))
+    {
+      LogError("Could not find updateAgent function in brain JS! Brain JS:");
+      LogError(javascript);
+      valid = false;
+      return;
+    }
+
+    // This one is optional.
+    GetReusableFunctionReference(GetIsolate(), &context, "postMessageFlush", &reusable_post_message_flush_function_);
+
+    valid = true;
+  }
+
+  ~VoosBrain()
+  {
+    // IMPORTANT: If reset's are not called, we will crash soon after.
+    // Probably because we must reset before disposing the isolate?
+
+    Locker locker(isolate_);
+    reusable_context_.Reset();
+    reusable_update_agent_function_.Reset();
+    reusable_post_message_flush_function_.Reset();
+    uncached_brain_script_.Reset();
+    for (auto &entry : agent_states_)
+    {
+      entry.second.Reset();
+    }
+    delta_state_handler_.Reset();
+    delta_touched_keys_.Reset();
+    pending_result_json_.Reset();
+    for (auto &entry : actor_field_tables_)
+    {
+      entry.second.buffer.Reset();
+    }
+    actor_fields_object_.Reset();
+    for (auto &call : async_service_calls_)
+    {
+      call.resolver.Reset();
+    }
+    for (auto &service_result : service_results_)
+    {
+      service_result.resolver.Reset();
+    }
+    for (auto &entry : typed_service_keys_)
+    {
+      for (auto *keys : {&entry.second.args_keys, &entry.second.result_keys})
+      {
+        for (auto &key : *keys)
+        {
+          key.Reset();
+        }
+      }
+    }
+    for (auto *keys : {&request_keys_, &response_keys_})
+    {
+      for (auto &key : *keys)
+      {
+        key.Reset();
+      }
+    }
+    for (auto &entry : module_namespaces_by_id)
+    {
+      entry.second.Reset();
+    }
+    module_namespaces_by_id.clear();
+    for (auto &entry : modules_by_id_)
+    {
+      entry.second.Reset();
+    }
+    modules_by_id_.clear();
+
+    // If the isolate is shared, let V8 know there is garbage to collect. It
+    // is disposed along with brain_isolate_ once no brain uses it anymore.
+    {
+      Isolate::Scope isolate_scope(isolate_);
+      isolate_->ContextDisposedNotification();
+    }
+  }
+
+  // Every native function the brain JS can see. The external references must
+  // list all of these, so snapshots can be deserialized. Snapshots are made
+  // without a brain, since its pointer can't be serialized.
+  static void SetupBrainGlobalTemplate(Isolate *isolate, Local<ObjectTemplate> global_template, VoosBrain *brain)
+  {
+    SetupGlobalTemplate(isolate, global_template);
+    Local<Value> data = brain != nullptr ? Local<Value>(External::New(isolate, brain)) : Local<Value>();
+    BindFunction(isolate, global_template, "getVoosModule", GetModuleV8Callback, data);
+    BindFunction(isolate, global_template, "callVoosService", CallServiceV8Callback, data);
+    BindFunction(isolate, global_template, "callVoosServiceAsync", CallServiceAsyncV8Callback, data);
+    BindFunction(isolate, global_template, "getActorBoolean", GetActorBooleanV8Callback, data);
+    BindFunction(isolate, global_template, "setActorBoolean", SetActorBooleanV8Callback, data);
+    BindFunction(isolate, global_template, "getActorVector3", GetActorVector3V8Callback, data);
+    BindFunction(isolate, global_template, "setActorVector3", SetActorVector3V8Callback, data);
+    BindFunction(isolate, global_template, "getActorQuaternion", GetActorQuaternionV8Callback, data);
+    BindFunction(isolate, global_template, "setActorQuaternion", SetActorQuaternionV8Callback, data);
+    BindFunction(isolate, global_template, "getActorString", GetActorStringV8Callback, data);
+    BindFunction(isolate, global_template, "setActorString", SetActorStringV8Callback, data);
+    BindFunction(isolate, global_template, "getActorFloat", GetActorFloatV8Callback, data);
+    BindFunction(isolate, global_template, "setActorFloat", SetActorFloatV8Callback, data);
+    BindFunction(isolate, global_template, "getActorBooleanBatch", GetActorBooleanBatchV8Callback, data);
+    BindFunction(isolate, global_template, "setActorBooleanBatch", SetActorBooleanBatchV8Callback, data);
+    BindFunction(isolate, global_template, "getActorVector3Batch", GetActorVector3BatchV8Callback, data);
+    BindFunction(isolate, global_template, "setActorVector3Batch", SetActorVector3BatchV8Callback, data);
+    BindFunction(isolate, global_template, "getActorQuaternionBatch", GetActorQuaternionBatchV8Callback, data);
+    BindFunction(isolate, global_template, "setActorQuaternionBatch", SetActorQuaternionBatchV8Callback, data);
+    BindFunction(isolate, global_template, "getActorFloatBatch", GetActorFloatBatchV8Callback, data);
+    BindFunction(isolate, global_template, "setActorFloatBatch", SetActorFloatBatchV8Callback, data);
+  }
+
+  static const intptr_t *GetExternalReferences()
+  {
+    static const intptr_t references[] = {
+        (intptr_t)LogV8Callback,
+        (intptr_t)LogErrorV8Callback,
+        (intptr_t)FortyTwoV8Callback,
+        (intptr_t)ThirteenV8Callback,
+        (intptr_t)LookUpIntV8Callback,
+        (intptr_t)GetModuleV8Callback,
+        (intptr_t)CallServiceV8Callback,
+        (intptr_t)CallServiceAsyncV8Callback,
+        (intptr_t)GetActorBooleanV8Callback,
+        (intptr_t)SetActorBooleanV8Callback,
+        (intptr_t)GetActorVector3V8Callback,
+        (intptr_t)SetActorVector3V8Callback,
+        (intptr_t)GetActorQuaternionV8Callback,
+        (intptr_t)SetActorQuaternionV8Callback,
+        (intptr_t)GetActorStringV8Callback,
+        (intptr_t)SetActorStringV8Callback,
+        (intptr_t)GetActorFloatV8Callback,
+        (intptr_t)SetActorFloatV8Callback,
+        (intptr_t)GetActorBooleanBatchV8Callback,
+        (intptr_t)SetActorBooleanBatchV8Callback,
+        (intptr_t)GetActorVector3BatchV8Callback,
+        (intptr_t)SetActorVector3BatchV8Callback,
+        (intptr_t)GetActorQuaternionBatchV8Callback,
+        (intptr_t)SetActorQuaternionBatchV8Callback,
+        (intptr_t)GetActorFloatBatchV8Callback,
+        (intptr_t)SetActorFloatBatchV8Callback,
+        (intptr_t)DeltaStateGetTrap,
+        (intptr_t)DeltaStateSetTrap,
+        (intptr_t)DeltaStateDeleteTrap,
+        0};
+    return references;
+  }
+
+  // Runs the brain JS and evaluates the given modules in a fresh isolate, and
+  // serializes the result. Returns null on failure.
+  static std::shared_ptr<BrainSnapshot> CreateSnapshot(const char *javascript, int num_modules, const char **module_uids, const char **module_sources)
+  {
+    std::shared_ptr<BrainSnapshot> snapshot = std::make_shared<BrainSnapshot>();
+    snapshot->javascript = javascript;
+
+    SnapshotCreator creator(GetExternalReferences());
+    Isolate *isolate = creator.GetIsolate();
+    {
+      HandleScope handle_scope(isolate);
+      Local<ObjectTemplate> global_template = ObjectTemplate::New(isolate);
+      SetupBrainGlobalTemplate(isolate, global_template, nullptr);
+      Local<Context> context = Context::New(isolate, nullptr, global_template);
+      Context::Scope context_scope(context);
+
+      if (!CompileBrainJavascript(isolate, javascript))
+      {
+        return nullptr;
+      }
+
+      // Module records cannot be serialized by V8, so modules are only
+      // validated here and get evaluated again on each deserialized brain.
+      // They still skip the brain JS, and hit the code cache if enabled.
+      for (int i = 0; i < num_modules; i++)
+      {
+        if (!IsStringValid(module_uids[i], MAX_GUID_LENGTH) || !IsStringValid(module_sources[i], MAX_JAVASCRIPT_SOURCE_LENGTH))
+        {
+          return nullptr;
+        }
+        Local<Module> module;
+        if (!CompileModule(isolate, module_uids[i], module_sources[i], &module))
+        {
+          return nullptr;
+        }
+        snapshot->modules.push_back(std::make_pair(std::string(module_uids[i]), std::string(module_sources[i])));
+      }
+
+      creator.SetDefaultContext(context);
+    }
+
+    // Keep compiled functions, so new brains don't need to lazily compile them again.
+    snapshot->blob = creator.CreateBlob(SnapshotCreator::FunctionCodeHandling::kKeep);
+    if (snapshot->blob.data == nullptr)
+    {
+      LogError("Failed to create brain snapshot blob.");
+      return nullptr;
+    }
+    return snapshot;
+  }
+
+  // Imports resolve to modules already set on the same brain, by module UID.
+  // "./uid" and "uid.js" work too. Importers share the one instance, so a
+  // library is only compiled and evaluated once per brain.
+  static MaybeLocal<Module> ModuleResolveCallback(Local<Context> context,
+                                                  Local<String> specifier,
+                                                  Local<Module> referrer)
+  {
+    Isolate *isolate = context->GetIsolate();
+    VoosBrain *brain = GetBrain(context);
+    String::Utf8Value specifier_utf8(isolate, specifier);
+    std::string module_uid = *specifier_utf8 != nullptr ? *specifier_utf8 : "";
+
+    auto it = brain->FindModule(module_uid);
+    if (it == brain->modules_by_id_.end())
+    {
+      std::ostringstream err;
+      err << "Cannot import '" << module_uid << "'. Modules must be set before the modules that import them.";
+      isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, err.str().c_str(), NewStringType::kNormal).ToLocalChecked()));
+      return MaybeLocal<Module>();
+    }
+    return it->second.Get(isolate);
+  }
+
+  std::map<std::string, Global<Module>>::iterator FindModule(std::string module_uid)
+  {
+    auto it = modules_by_id_.find(module_uid);
+    if (it != modules_by_id_.end())
+    {
+      return it;
+    }
+    const std::string dot_slash = "./";
+    const std::string extension = ".js";
+    if (module_uid.compare(0, dot_slash.size(), dot_slash) == 0)
+    {
+      module_uid = module_uid.substr(dot_slash.size());
+    }
+    if (module_uid.size() > extension.size() && module_uid.compare(module_uid.size() - extension.size(), extension.size(), extension) == 0)
+    {
+      module_uid = module_uid.substr(0, module_uid.size() - extension.size());
+    }
+    return modules_by_id_.find(module_uid);
+  }
+
+  bool SetModule(const char *moduleUid, const char *javascriptSource, const std::vector<uint8_t> *precompiled_cache = nullptr)
+  {
+    if (!IsStringValid(moduleUid, MAX_GUID_LENGTH) || !IsStringValid(javascriptSource, MAX_JAVASCRIPT_SOURCE_LENGTH))
+    {
+      return false;
+    }
+
+    if (!valid)
+    {
+      LogError("SetModule called on invalid brain");
+      return false;
+    }
+
+    size_t source_length = 0;
+    uint64_t source_hash = HashSource(javascriptSource, &source_length);
+
+    Locker locker(GetIsolate());
+    // Module records belong to whoever holds the isolate lock.
+    auto existing = module_records_.find(moduleUid);
+    if (existing != module_records_.end() && existing->second.source_hash == source_hash && existing->second.source == javascriptSource)
+    {
+      existing->second.stats.skippedReloads++;
+      return true;
+    }
+
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    Local<Context> context = GetReusableContext();
+    Context::Scope context_scope(context);
+    // Module top levels, this one's and its dependents', run like a tick.
+    BudgetScope budget(GetIsolate(), time_budget_ms_);
+
+    if (!LoadModuleRecord(context, moduleUid, javascriptSource, precompiled_cache))
+    {
+      return false;
+    }
+    module_records_[moduleUid].stats.loads++;
+
+    ReloadDependents(context, moduleUid);
+    return true;
+  }
+
+  bool GetModuleLoadStats(const char *moduleUid, ModuleLoadStats *stats_out)
+  {
+    Locker locker(GetIsolate());
+    auto it = module_records_.find(moduleUid);
+    if (it == module_records_.end())
+    {
+      return false;
+    }
+    *stats_out = it->second.stats;
+    return true;
+  }
+
+  bool RemoveModule(const char *moduleUid)
+  {
+    Locker locker(GetIsolate());
+    InstantiateLazyImporters({moduleUid});
+    if (!RemoveModuleLocked(moduleUid))
+    {
+      return false;
+    }
+    StartReclaimingModules();
+    return true;
+  }
+
+  int RetainModules(const std::set<std::string> &module_uids)
+  {
+    Locker locker(GetIsolate());
+    std::set<std::string> to_remove;
+    for (const auto &entry : module_records_)
+    {
+      if (module_uids.count(entry.first) == 0)
+      {
+        to_remove.insert(entry.first);
+      }
+    }
+    if (to_remove.empty())
+    {
+      return 0;
+    }
+    InstantiateLazyImporters(to_remove);
+    for (const std::string &module_uid : to_remove)
+    {
+      RemoveModuleLocked(module_uid);
+    }
+    StartReclaimingModules();
+    return (int)to_remove.size();
+  }
+
+  // Lazy modules only resolve their imports when instantiated, so the ones
+  // importing modules about to be removed are instantiated first, to keep
+  // them. Errors are logged, and left for getVoosModule to report again.
+  // Assumes the isolate is locked.
+  void InstantiateLazyImporters(const std::set<std::string> &removed_uids)
+  {
+    if (!lazy_modules_)
+    {
+      return;
+    }
+    Isolate *isolate = GetIsolate();
+    Isolate::Scope isolate_scope(isolate);
+    HandleScope handle_scope(isolate);
+    Local<Context> context = GetReusableContext();
+    Context::Scope context_scope(context);
+    for (const auto &entry : module_records_)
+    {
+      const std::set<std::string> &imports = entry.second.imports;
+      bool imports_removed = std::any_of(imports.begin(), imports.end(),
+                                         [&removed_uids](const std::string &uid) { return removed_uids.count(uid) > 0; });
+      auto module_it = modules_by_id_.find(entry.first);
+      if (removed_uids.count(entry.first) > 0 || !imports_removed || module_it == modules_by_id_.end())
+      {
+        continue;
+      }
+      Local<Module> module = module_it->second.Get(isolate);
+      if (module->GetStatus() != Module::kUninstantiated)
+      {
+        continue;
+      }
+      TryCatch try_catch(isolate);
+      if (module->InstantiateModule(context, ModuleResolveCallback).IsNothing())
+      {
+        std::ostringstream err;
+        err << "Exception caught while instantiating lazy module '" << entry.first << "': ";
+        LogException(err.str().c_str(), isolate, &try_catch);
+      }
+    }
+  }
+
+  // Removed modules are garbage once no importer holds them. This starts
+  // incremental marking, rather than blocking for a full collection like
+  // CollectGarbage does.
+  void StartReclaimingModules()
+  {
+    GetIsolate()->MemoryPressureNotification(MemoryPressureLevel::kModerate);
+  }
+
+  // Returns the bytes freed. If the isolate is shared, other brains' garbage counts too.
+  long long CollectGarbage()
+  {
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HeapStatistics before;
+    GetIsolate()->GetHeapStatistics(&before);
+    GetIsolate()->LowMemoryNotification();
+    HeapStatistics after;
+    GetIsolate()->GetHeapStatistics(&after);
+    return (long long)before.used_heap_size() - (long long)after.used_heap_size();
+  }
+
+  bool IdleCollect(double budget_ms)
+  {
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    BrainIsolate::GcPhaseScope gc_phase(brain_isolate_.get(), BrainIsolate::GcPhase::kIdle);
+    double deadline = V8_GLOBAL_STATE.platform->MonotonicallyIncreasingTime() + budget_ms / 1000;
+    // V8 sizes both its idle tasks and its incremental steps to the deadline.
+    platform::RunIdleTasks(V8_GLOBAL_STATE.platform, GetIsolate(), budget_ms / 1000);
+    double remaining_s = deadline - V8_GLOBAL_STATE.platform->MonotonicallyIncreasingTime();
+    bool done = remaining_s > 0 && GetIsolate()->IdleNotificationDeadline(deadline);
+    if (!gc_pacing_ || allocated_bytes_per_tick_ <= 0)
+    {
+      return done;
+    }
+    // Not done while the next ticks would fill the young generation, as V8
+    // may still schedule the scavenge for idle time.
+    return done && GetYoungGenerationAvailable() > allocated_bytes_per_tick_ * GC_PACING_TICKS_AHEAD;
+  }
+
+  void SetGcPacing(bool enabled)
+  {
+    gc_pacing_ = enabled;
+    allocated_bytes_per_tick_ = 0;
+  }
+
+  bool GetGcPacing() const { return gc_pacing_; }
+
+  void GetGcStatistics(BrainGcStatistics *stats_out)
+  {
+    Locker locker(GetIsolate());
+    *stats_out = brain_isolate_->GetGcStatistics();
+    stats_out->allocatedBytesPerTick = allocated_bytes_per_tick_;
+  }
+
+  void ResetGcStatistics()
+  {
+    Locker locker(GetIsolate());
+    brain_isolate_->ResetGcStatistics();
+  }
+
+  // Null unless the brain has a pooled allocator.
+  PooledArrayBufferAllocator *GetPooledAllocator() { return brain_isolate_->GetPooledAllocator(); }
+
+  void GetHeapStatistics(BrainHeapStatistics *stats_out)
+  {
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    brain_isolate_->GetHeapStatistics(stats_out);
+  }
+
+  size_t GetYoungGenerationAvailable()
+  {
+    for (size_t i = 0; i < GetIsolate()->NumberOfHeapSpaces(); i++)
+    {
+      HeapSpaceStatistics stats;
+      GetIsolate()->GetHeapSpaceStatistics(&stats, i);
+      if (strcmp(stats.space_name(), "new_space") == 0)
+      {
+        return stats.space_available_size();
+      }
+    }
+    return 0;
+  }
+
+  int GetHeapSpaceStatistics(BrainHeapSpaceStatistics *spaces_out, int max_spaces)
+  {
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    int count = std::min((int)GetIsolate()->NumberOfHeapSpaces(), max_spaces);
+    for (int i = 0; i < count; i++)
+    {
+      HeapSpaceStatistics stats;
+      GetIsolate()->GetHeapSpaceStatistics(&stats, i);
+      spaces_out[i].name = stats.space_name();
+      spaces_out[i].spaceSize = stats.space_size();
+      spaces_out[i].usedSize = stats.space_used_size();
+      spaces_out[i].availableSize = stats.space_available_size();
+      spaces_out[i].physicalSize = stats.physical_space_size();
+    }
+    return count;
+  }
+
+  void SetLazyModules(bool lazy)
+  {
+    lazy_modules_ = lazy;
+  }
+
+  bool GetLazyModules() const { return lazy_modules_; }
+
+  void SetTimeBudget(double budget_ms)
+  {
+    time_budget_ms_ = budget_ms;
+  }
+
+  double GetTimeBudget() const { return time_budget_ms_; }
+
+  void SetTaskBudget(double budget_ms)
+  {
+    task_budget_ms_ = budget_ms;
+  }
+
+  double GetTaskBudget() const { return task_budget_ms_; }
+
+  // A brain in a shared isolate runs without its budget until it is reset
+  // into an isolate of its own, so its deferred jobs can't run in another
+  // brain's tick.
+  double GetEffectiveTaskBudget() const { return brain_isolate_->IsShared() ? 0 : task_budget_ms_; }
+
+  bool StartProfiling(int sampling_interval_us)
+  {
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    if (!brain_isolate_->StartProfiling(sampling_interval_us))
+    {
+      LogError("StartBrainProfiling: the brain's isolate is already being profiled.");
+      return false;
+    }
+    return true;
+  }
+
+  bool StopProfiling(std::ostream &profile_json_out)
+  {
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    if (!brain_isolate_->StopProfiling([&](const CpuProfile *profile) { WriteCpuProfileJson(profile_json_out, profile); }))
+    {
+      LogError("StopBrainProfiling: the brain is not being profiled.");
+      return false;
+    }
+    return true;
+  }
+
+#if V8_IN_UNITY_METRICS
+  int GetMetrics(BrainMetric *metrics_out, int max_metrics)
+  {
+    // Snapshot under the lock that ticks hold while recording, and format
+    // outside it.
+    CallbackMetrics bindings[(int)BrainBinding::kCount];
+    std::vector<std::pair<std::string, CallbackMetrics>> services;
+    {
+      Locker locker(GetIsolate());
+      std::copy(std::begin(binding_metrics_), std::end(binding_metrics_), bindings);
+      for (const auto &entry : service_metrics_)
+      {
+        if (entry.second.count > 0)
+        {
+          services.push_back(entry);
+        }
+      }
+    }
+    int count = 0;
+    for (int i = 0; i < (int)BrainBinding::kCount && count < max_metrics; i++)
+    {
+      if (bindings[i].count > 0)
+      {
+        CopyMetric(BRAIN_BINDING_NAMES[i], BRAIN_METRIC_BINDING, bindings[i], &metrics_out[count++]);
+      }
+    }
+    for (auto it = services.begin(); it != services.end() && count < max_metrics; ++it)
+    {
+      CopyMetric(it->first.c_str(), BRAIN_METRIC_SERVICE, it->second, &metrics_out[count++]);
+    }
+    return count;
+  }
+
+  // Service entries are zeroed rather than erased, since callers cache them.
+  void ResetMetrics()
+  {
+    Locker locker(GetIsolate());
+    for (CallbackMetrics &metrics : binding_metrics_)
+    {
+      metrics = CallbackMetrics();
+    }
+    for (auto &entry : service_metrics_)
+    {
+      entry.second = CallbackMetrics();
+    }
+  }
+
+  // Finds a sync service's metrics by the V8 hash of its name, so calls
+  // don't build a std::string to look them up.
+  CallbackMetrics *FindServiceMetrics(Local<Value> name, const char *name_utf8)
+  {
+    int hash = name->IsString() ? name.As<String>()->GetIdentityHash() : 0;
+    auto range = service_metrics_by_hash_.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+      if (it->second->first == name_utf8)
+      {
+        return &it->second->second;
+      }
+    }
+    auto entry = service_metrics_.emplace(name_utf8, CallbackMetrics()).first;
+    service_metrics_by_hash_.emplace(hash, entry);
+    return &entry->second;
+  }
+
+  static void CopyMetric(const char *name, int kind, const CallbackMetrics &metrics, BrainMetric *metric_out)
+  {
+    snprintf(metric_out->name, sizeof(metric_out->name), "%s", name);
+    metric_out->kind = kind;
+    metric_out->count = metrics.count;
+    metric_out->totalNs = metrics.total_ns;
+    metric_out->maxNs = metrics.max_ns;
+    std::copy(std::begin(metrics.buckets), std::end(metrics.buckets), metric_out->buckets);
+  }
+#endif
+
+  void GetTaskStatistics(BrainTaskStatistics *stats_out)
+  {
+    Locker locker(GetIsolate());
+    *stats_out = task_stats_;
+  }
+
+  bool StartModulesBatch(int count, const char **module_uids, const char **module_sources)
+  {
+    if (module_batch_)
+    {
+      LogError("StartModulesBatch called while another batch is still loading.");
+      return false;
+    }
+    module_batch_.reset(new ModuleBatch(count, module_uids, module_sources));
+    module_batch_->Start();
+    return true;
+  }
+
+  // Loads compiled modules in order, for up to budget_ms, but at least one if
+  // it is compiled. With wait, waits for modules still compiling instead of
+  // stopping at them. Returns how many modules are still not loaded, or -1 if
+  // there is no batch. The batch is done once that reaches 0.
+  int PollModulesBatch(double budget_ms, bool *results_out, bool wait = false)
+  {
+    if (!module_batch_)
+    {
+      return -1;
+    }
+    ModuleBatch &batch = *module_batch_;
+    auto start = std::chrono::steady_clock::now();
+    while (batch.num_loaded < batch.uids.size())
+    {
+      if (wait)
+      {
+        batch.WaitUntilCompiled(batch.num_loaded);
+      }
+      else if (!batch.IsCompiled(batch.num_loaded))
+      {
+        break;
+      }
+      size_t i = batch.num_loaded++;
+      batch.results[i] = SetModule(batch.uids[i].c_str(), batch.sources[i].c_str(), &batch.caches[i]);
+      if (MillisecondsSince(start) >= budget_ms)
+      {
+        break;
+      }
+    }
+
+    if (results_out != nullptr)
+    {
+      std::copy(batch.results.begin(), batch.results.end(), results_out);
+    }
+    int num_remaining = (int)(batch.uids.size() - batch.num_loaded);
+    if (num_remaining == 0)
+    {
+      module_batch_.reset();
+    }
+    return num_remaining;
+  }
+
+  // Assumes the isolate is locked.
+  bool RemoveModuleLocked(const std::string &module_uid)
+  {
+    bool removed = false;
+    auto module_it = modules_by_id_.find(module_uid);
+    if (module_it != modules_by_id_.end())
+    {
+      module_it->second.Reset();
+      modules_by_id_.erase(module_it);
+      removed = true;
+    }
+    auto namespace_it = module_namespaces_by_id.find(module_uid);
+    if (namespace_it != module_namespaces_by_id.end())
+    {
+      namespace_it->second.Reset();
+      module_namespaces_by_id.erase(namespace_it);
+      removed = true;
+    }
+    // Importers keep it in their imports, so they are reloaded if it comes back.
+    removed = module_records_.erase(module_uid) > 0 || removed;
+    return removed;
+  }
+
+  // Loads the module and makes it the one that getVoosModule and imports see.
+  // Assumes the context is entered.
+  bool LoadModuleRecord(Local<Context> context, const std::string &module_uid, const std::string &source, const std::vector<uint8_t> *precompiled_cache = nullptr)
+  {
+    Local<Module> module;
+    ModuleLoadStats timings;
+    memset(&timings, 0, sizeof(timings));
+    if (lazy_modules_)
+    {
+      auto start = std::chrono::steady_clock::now();
+      if (!CompileModule(isolate_, module_uid.c_str(), source.c_str(), &module, precompiled_cache))
+      {
+        return false;
+      }
+      timings.compileMs = MillisecondsSince(start);
+    }
+    else if (!LoadModule(isolate_, context, module_uid.c_str(), source.c_str(), &module, &timings, precompiled_cache))
+    {
+      return false;
+    }
+
+    // Modules that imported an older version keep using that one until they
+    // are loaded again.
+    modules_by_id_[module_uid].Reset(isolate_, module);
+    if (lazy_modules_)
+    {
+      // Evaluated on first use.
+      auto it = module_namespaces_by_id.find(module_uid);
+      if (it != module_namespaces_by_id.end())
+      {
+        it->second.Reset();
+        module_namespaces_by_id.erase(it);
+      }
+    }
+    else
+    {
+      module_namespaces_by_id[module_uid].Reset(isolate_, module->GetModuleNamespace());
+    }
+
+    ModuleRecord &record = module_records_[module_uid];
+    record.source = source;
+    size_t source_length = 0;
+    record.source_hash = HashSource(source.c_str(), &source_length);
+    record.stats.compileMs = timings.compileMs;
+    record.stats.instantiateMs = timings.instantiateMs;
+    record.stats.evaluateMs = timings.evaluateMs;
+    record.imports.clear();
+    for (int i = 0; i < module->GetModuleRequestsLength(); i++)
+    {
+      String::Utf8Value specifier(isolate_, module->GetModuleRequest(i));
+      auto it = *specifier != nullptr ? FindModule(*specifier) : modules_by_id_.end();
+      if (it != modules_by_id_.end())
+      {
+        record.imports.insert(it->first);
+      }
+    }
+    return true;
+  }
+
+  // Loads every module that imports the changed one, directly or not, after
+  // the modules it imports.
+  void ReloadDependents(Local<Context> context, const std::string &changed_uid)
+  {
+    std::set<std::string> dependents;
+    std::vector<std::string> to_visit = {changed_uid};
+    while (!to_visit.empty())
+    {
+      std::string uid = to_visit.back();
+      to_visit.pop_back();
+      for (const auto &entry : module_records_)
+      {
+        if (entry.second.imports.count(uid) > 0 && dependents.insert(entry.first).second)
+        {
+          to_visit.push_back(entry.first);
+        }
+      }
+    }
+
+    while (!dependents.empty())
+    {
+      auto ready = std::find_if(dependents.begin(), dependents.end(), [&](const std::string &uid) {
+        for (const std::string &import : module_records_[uid].imports)
+        {
+          if (dependents.count(import) > 0)
+          {
+            return false;
+          }
+        }
+        return true;
+      });
+      if (ready == dependents.end())
+      {
+        LogError("Module imports form a cycle. Not reloading the rest of the dependents.");
+        return;
+      }
+
+      std::string uid = *ready;
+      dependents.erase(ready);
+      // Copied, since loading replaces the record.
+      std::string source = module_records_[uid].source;
+      if (!LoadModuleRecord(context, uid, source))
+      {
+        std::ostringstream err;
+        err << "Could not reload module '" << uid << "' after '" << changed_uid << "' changed. It keeps using the old version.";
+        LogError(err);
+        continue;
+      }
+      module_records_[uid].stats.dependencyReloads++;
+    }
+  }
+
+  // A precompiled cache, from a module batch, is used instead of the code cache.
+  static bool CompileModule(Isolate *isolate, const char *moduleUid, const char *javascriptSource, Local<Module> *module_out,
+                            const std::vector<uint8_t> *precompiled_cache = nullptr)
+  {
+    TryCatch try_catch(isolate);
+
+    Local<String> sourceString =
+        String::NewFromUtf8(isolate, javascriptSource, NewStringType::kNormal).ToLocalChecked();
+
+    ScriptOrigin origin = MakeModuleOrigin(isolate, moduleUid);
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+    std::string cache_key;
+    ScriptCompiler::CachedData *cached_data = nullptr;
+    if (precompiled_cache != nullptr && !precompiled_cache->empty())
+    {
+      cached_data = new ScriptCompiler::CachedData(precompiled_cache->data(), (int)precompiled_cache->size(), ScriptCompiler::CachedData::BufferNotOwned);
+    }
+    else
+    {
+      cache_key = CODE_CACHE.GetKey(javascriptSource);
+      cached_data = CODE_CACHE.Load(cache_key);
+    }
+    ScriptCompiler::Source source(sourceString, origin, cached_data);
+    MaybeLocal<Module> compiledModule = ScriptCompiler::CompileModule(isolate, &source,
+                                                                      cached_data ? ScriptCompiler::kConsumeCodeCache : ScriptCompiler::kNoCompileOptions);
+#else
+    (void)precompiled_cache;
+    ScriptCompiler::Source source(sourceString, origin);
+    MaybeLocal<Module> compiledModule = ScriptCompiler::CompileModule(isolate, &source);
+#endif
+    if (compiledModule.IsEmpty())
+    {
+      LogException("Error while compiling module JS: ", isolate, &try_catch);
+      return false;
+    }
+
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+    if (!cache_key.empty() && !CODE_CACHE.CheckConsumed(cache_key, source.GetCachedData()))
+    {
+      Local<UnboundModuleScript> unbound = compiledModule.ToLocalChecked()->GetUnboundModuleScript();
+      CODE_CACHE.Store(cache_key, ScriptCompiler::CreateCodeCache(unbound));
+      BrainIsolate *brain_isolate = BrainIsolate::FromIsolate(isolate);
+      if (brain_isolate != nullptr)
+      {
+        brain_isolate->AddUncachedModule(cache_key, unbound);
+      }
+    }
+#endif
+
+    *module_out = compiledModule.ToLocalChecked();
+    return true;
+  }
+
+  // Compiles, instantiates and evaluates a module. Assumes the context is entered.
+  // Fills in the timings of timings_out, if given.
+  static bool LoadModule(Isolate *isolate, Local<Context> context, const char *moduleUid, const char *javascriptSource, Local<Module> *module_out,
+                         ModuleLoadStats *timings_out = nullptr, const std::vector<uint8_t> *precompiled_cache = nullptr)
+  {
+    auto start = std::chrono::steady_clock::now();
+    Local<Module> compiledModule;
+    if (!CompileModule(isolate, moduleUid, javascriptSource, &compiledModule, precompiled_cache))
+    {
+      return false;
+    }
+    double compile_ms = MillisecondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    TryCatch try_catch(isolate);
+    Maybe<bool> instantiateResult = compiledModule->InstantiateModule(context, ModuleResolveCallback);
+    if (instantiateResult.IsNothing())
+    {
+      LogException("Exception caught while instantiating module JS: ", isolate, &try_catch);
+      return false;
+    }
+    double instantiate_ms = MillisecondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    if (compiledModule->Evaluate(context).IsEmpty())
+    {
+      LogCallFailure("Exception caught while evaluating module JS: ", isolate, &try_catch);
+      return false;
+    }
+
+    if (timings_out != nullptr)
+    {
+      timings_out->compileMs = compile_ms;
+      timings_out->instantiateMs = instantiate_ms;
+      timings_out->evaluateMs = MillisecondsSince(start);
+    }
+
+    *module_out = compiledModule;
+    return true;
+  }
+
+  // Safe to call from any thread, as long as the brain is not reset meanwhile.
+  bool UpdateAgentJson(const char *state_json_string, BYTE_ARRAY bytes_in, int length_in, const std::function<void(const char *)> &report_result_json)
+  {
+    if (!valid)
+    {
+      LogError("UpdateAgent called on invalid brain");
+      return false;
+    }
+
+    // Brains sharing an isolate take turns.
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    Local<Context> context = GetReusableContext();
+    Context::Scope context_scope(context);
+
+    Local<String> result_json;
+    if (!TickJson(context, state_json_string, bytes_in, length_in, report_result_json ? &result_json : nullptr))
+    {
+      return false;
+    }
+
+    if (report_result_json)
+    {
+      String::Utf8Value json_value(GetIsolate(), result_json);
+      if (json_value.length() > MAX_JSON_LENGTH)
+      {
+        LogError("JSON result too large. Not reporting to caller.");
+        return false;
+      }
+      else
+      {
+        TraceScope trace("phase", "report");
+        report_result_json(*json_value);
+      }
+    }
+
+    return true;
+  }
+
+  // Like UpdateAgentJson, but writes the result into the registered result
+  // buffer instead of reporting a copy. Returns the result size, 0 on failure,
+  // or minus the needed size if the result does not fit. In that case the
+  // result is kept for TakePendingResult.
+  int UpdateAgentJsonToBuffer(const char *state_json_string, BYTE_ARRAY bytes_in, int length_in)
+  {
+    if (!valid)
+    {
+      LogError("UpdateAgent called on invalid brain");
+      return 0;
+    }
+
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    Local<Context> context = GetReusableContext();
+    Context::Scope context_scope(context);
+
+    Local<String> result_json;
+    if (!TickJson(context, state_json_string, bytes_in, length_in, &result_json))
+    {
+      return 0;
+    }
+    pending_result_json_.Reset(GetIsolate(), result_json);
+    int size = TakePendingResult();
+    // Its -1 for failure would read as a needed size here.
+    return size != -1 ? size : 0;
+  }
+
+  // Returns the result size, minus the needed size if it still does not fit,
+  // or -1 on failure.
+  int TakePendingResult()
+  {
+    Locker locker(GetIsolate());
+    if (pending_result_json_.IsEmpty())
+    {
+      LogError("No pending result to take.");
+      return -1;
+    }
+
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    Local<String> result_json = pending_result_json_.Get(GetIsolate());
+
+    // Every UTF-16 unit takes at most 3 bytes, so short enough strings are
+    // written without measuring them first.
+    int capacity = result_buffer_ != nullptr ? result_buffer_capacity_ : 0;
+    if ((size_t)result_json->Length() * 3 > (size_t)capacity)
+    {
+#if V8_IN_UNITY_UTF8_TAKES_ISOLATE
+      int size = result_json->Utf8Length(GetIsolate());
+#else
+      int size = result_json->Utf8Length();
+#endif
+      if (size > (int)MAX_JSON_LENGTH)
+      {
+        LogError("JSON result too large. Not reporting to caller.");
+        pending_result_json_.Reset();
+        return -1;
+      }
+      if (size > capacity)
+      {
+        return -size;
+      }
+    }
+
+    const int options = String::NO_NULL_TERMINATION | String::REPLACE_INVALID_UTF8;
+#if V8_IN_UNITY_UTF8_TAKES_ISOLATE
+    int size = result_json->WriteUtf8(GetIsolate(), result_buffer_, capacity, nullptr, options);
+#else
+    int size = result_json->WriteUtf8(result_buffer_, capacity, nullptr, options);
+#endif
+    pending_result_json_.Reset();
+    return size;
+  }
+
+  // The buffer must stay alive until it is replaced, or the brain is gone.
+  void SetResultBuffer(char *buffer, int capacity)
+  {
+    result_buffer_ = buffer;
+    result_buffer_capacity_ = buffer != nullptr ? std::max(0, capacity) : 0;
+  }
+
+  char *GetResultBuffer() const { return result_buffer_; }
+  int GetResultBufferCapacity() const { return result_buffer_capacity_; }
+
+  // Like UpdateAgentJson, but the state comes and goes through the binary
+  // schemas. Returns the response size, 0 on failure, or minus the needed size
+  // if the response does not fit. In that case it is kept for
+  // TakeBinaryResponse.
+  int UpdateAgentBinary(const char *request, int request_length, BYTE_ARRAY bytes_in, int length_in, char *response, int response_capacity)
+  {
+    if (!valid)
+    {
+      LogError("UpdateAgentBinary called on invalid brain");
+      return 0;
+    }
+    if (!has_binary_schemas_)
+    {
+      LogError("UpdateAgentBinary called before SetBinaryTickSchemas");
+      return 0;
+    }
+
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    Local<Context> context = GetReusableContext();
+    Context::Scope context_scope(context);
+
+    Local<Object> state_obj;
+    if (!DecodeBinaryRequest(context, request, request_length, &state_obj))
+    {
+      return 0;
+    }
+
+    Local<ArrayBuffer> array_buffer_in = ArrayBuffer::New(GetIsolate(), bytes_in, length_in, ArrayBufferCreationMode::kExternalized);
+    if (!CallUpdateAgent(context, state_obj, array_buffer_in))
+    {
+      return 0;
+    }
+
+    pending_binary_response_.clear();
+    if (!EncodeBinaryResponse(context, state_obj, &pending_binary_response_))
+    {
+      pending_binary_response_.clear();
+      return 0;
+    }
+    return TakeBinaryResponse(response, response_capacity);
+  }
+
+  // Exposes host memory to JS as actorFields[name], a typed array with
+  // components values per actor. Registering the same memory again keeps the
+  // existing view. Registering different memory detaches the old view, so JS
+  // can never touch memory the host has moved on from.
+  bool SetActorFieldTable(const char *name, char *data, ActorFieldType type, int components, int num_actors, uint8_t *dirty)
+  {
+    if (type != ACTOR_FIELD_FLOAT32 && type != ACTOR_FIELD_INT32 && type != ACTOR_FIELD_UINT8)
+    {
+      LogError("Unknown actor field table type.");
+      return false;
+    }
+    if (components < 1 || components > MAX_ACTOR_FIELD_COMPONENTS || num_actors < 0 || (data == nullptr && num_actors > 0))
+    {
+      LogError("Bad actor field table layout.");
+      return false;
+    }
+
+    ActorFieldTable layout;
+    layout.data = data;
+    layout.type = type;
+    layout.components = components;
+    layout.num_actors = num_actors;
+    if (layout.GetByteLength() > MAX_BUFFER_SIZE)
+    {
+      LogError("Actor field table was too big. Doing nothing.");
+      return false;
+    }
+
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    Local<Context> context = GetReusableContext();
+    Context::Scope context_scope(context);
+
+    ActorFieldTable &table = actor_field_tables_[name];
+    table.dirty = dirty;
+    if (!table.buffer.IsEmpty() && table.data == data && table.type == type && table.components == components && table.num_actors == num_actors)
+    {
+      return true;
+    }
+
+    if (!table.buffer.IsEmpty())
+    {
+      V8_IN_UNITY_DETACH_ARRAY_BUFFER(table.buffer.Get(GetIsolate()));
+    }
+    table.data = data;
+    table.type = type;
+    table.components = components;
+    table.num_actors = num_actors;
+    table.values_at_frame_start.clear();
+
+    size_t length = (size_t)components * num_actors;
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(GetIsolate(), data, table.GetByteLength(), ArrayBufferCreationMode::kExternalized);
+    Local<TypedArray> view;
+    switch (type)
+    {
+    case ACTOR_FIELD_FLOAT32:
+      view = Float32Array::New(buffer, 0, length);
+      break;
+    case ACTOR_FIELD_INT32:
+      view = Int32Array::New(buffer, 0, length);
+      break;
+    case ACTOR_FIELD_UINT8:
+      view = Uint8Array::New(buffer, 0, length);
+      break;
+    }
+    table.buffer.Reset(GetIsolate(), buffer);
+
+    Local<String> key = String::NewFromUtf8(GetIsolate(), name, NewStringType::kInternalized).ToLocalChecked();
+    return GetActorFieldsObject(context)->Set(context, key, view).FromMaybe(false);
+  }
+
+  bool RemoveActorFieldTable(const char *name)
+  {
+    auto it = actor_field_tables_.find(name);
+    if (it == actor_field_tables_.end())
+    {
+      return false;
+    }
+
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    Local<Context> context = GetReusableContext();
+    Context::Scope context_scope(context);
+
+    V8_IN_UNITY_DETACH_ARRAY_BUFFER(it->second.buffer.Get(GetIsolate()));
+    it->second.buffer.Reset();
+    actor_field_tables_.erase(it);
+    Local<String> key = String::NewFromUtf8(GetIsolate(), name, NewStringType::kInternalized).ToLocalChecked();
+    return GetActorFieldsObject(context)->Delete(context, key).FromMaybe(false);
+  }
+
+  // Snapshots the tables that have dirty flags, once for all of a frame's ticks.
+  void BeginActorFieldFrame()
+  {
+    Locker locker(GetIsolate());
+    for (auto &entry : actor_field_tables_)
+    {
+      ActorFieldTable &table = entry.second;
+      if (table.dirty != nullptr)
+      {
+        table.values_at_frame_start.assign(table.data, table.data + table.GetByteLength());
+      }
+    }
+  }
+
+  // Flags the actors that changed since BeginActorFieldFrame. Tables that
+  // were registered with different memory meanwhile are skipped.
+  void EndActorFieldFrame()
+  {
+    Locker locker(GetIsolate());
+    for (auto &entry : actor_field_tables_)
+    {
+      ActorFieldTable &table = entry.second;
+      if (table.dirty != nullptr && table.values_at_frame_start.size() == table.GetByteLength())
+      {
+        size_t stride = table.GetStride();
+        for (int i = 0; i < table.num_actors; i++)
+        {
+          if (memcmp(table.data + i * stride, table.values_at_frame_start.data() + i * stride, stride) != 0)
+          {
+            table.dirty[i] = 1;
+          }
+        }
+      }
+      table.values_at_frame_start.clear();
+    }
+  }
+
+  // For carrying the tables over to a reset brain.
+  void CopyActorFieldTablesTo(VoosBrain *other) const
+  {
+    for (const auto &entry : actor_field_tables_)
+    {
+      const ActorFieldTable &table = entry.second;
+      other->SetActorFieldTable(entry.first.c_str(), table.data, table.type, table.components, table.num_actors, table.dirty);
+    }
+  }
+
+  // A null response means the registered result buffer.
+  int TakeBinaryResponse(char *response, int response_capacity)
+  {
+    if (pending_binary_response_.empty())
+    {
+      LogError("No binary response to take.");
+      return 0;
+    }
+    if (response == nullptr)
+    {
+      response = result_buffer_;
+      response_capacity = result_buffer_capacity_;
+    }
+    int size = (int)pending_binary_response_.size();
+    if (response == nullptr || size > response_capacity)
+    {
+      return -size;
+    }
+    memcpy(response, pending_binary_response_.data(), size);
+    pending_binary_response_.clear();
+    return size;
+  }
+
+  bool SetBinaryTickSchemas(const char *request_spec, uint32_t request_version, const char *response_spec, uint32_t response_version)
+  {
+    BinarySchema request_schema, response_schema;
+    if (!request_schema.Parse(request_spec, request_version) || !response_schema.Parse(response_spec, response_version))
+    {
+      return false;
+    }
+
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    request_schema_ = request_schema;
+    response_schema_ = response_schema;
+    has_binary_schemas_ = true;
+    MakeBinaryKeys(request_schema_, &request_keys_);
+    MakeBinaryKeys(response_schema_, &response_keys_);
+    return true;
+  }
+
+  bool HasBinaryTickSchemas() const { return has_binary_schemas_; }
+  const BinarySchema &GetBinaryRequestSchema() const { return request_schema_; }
+  const BinarySchema &GetBinaryResponseSchema() const { return response_schema_; }
+
+  // Ticks the agent's persistent state, after merging in the given JSON merge
+  // patch (RFC 7386). Reports a merge patch of just the top-level fields JS
+  // touched. Object fields count as touched as soon as they are read, since
+  // they may have been changed in place.
+  bool UpdateAgentDelta(const char *agent_uid, const char *patch_json, BYTE_ARRAY bytes_in, int length_in, const std::function<void(const char *)> &report_patch_json)
+  {
+    if (!valid)
+    {
+      LogError("UpdateAgentDelta called on invalid brain");
+      return false;
+    }
+
+    Locker locker(GetIsolate());
+    Isolate::Scope isolate_scope(GetIsolate());
+    HandleScope handle_scope(GetIsolate());
+    Local<Context> context = GetReusableContext();
+    Context::Scope context_scope(context);
+    Isolate *isolate = GetIsolate();
+
+    Local<Value> patch;
+    Local<String> patch_string = String::NewFromUtf8(isolate, patch_json, NewStringType::kNormal).ToLocalChecked();
+    if (!JSON::Parse(context, patch_string).ToLocal(&patch) || !patch->IsObject() || patch->IsArray())
+    {
+      std::ostringstream oss;
+      oss << "Agent state patch must be a JSON object:\n";
+      oss << patch_json;
+      LogError(oss.str().c_str());
+      return false;
+    }
+
+    Global<Object> &persistent_state = agent_states_[agent_uid];
+    if (persistent_state.IsEmpty())
+    {
+      persistent_state.Reset(isolate, Object::New(isolate));
+    }
+    Local<Object> state = persistent_state.Get(isolate);
+    if (!ApplyMergePatch(context, state, patch.As<Object>()))
+    {
+      LogError("Could not apply agent state patch.");
+      return false;
+    }
+
+    if (delta_state_handler_.IsEmpty())
+    {
+      if (!CreateDeltaStateHandler(context))
+      {
+        return false;
+      }
+    }
+    Local<v8::Set> touched_keys = delta_touched_keys_.Get(isolate);
+    touched_keys->Clear();
+
+    Local<Proxy> tracked_state;
+    if (!Proxy::New(context, state, delta_state_handler_.Get(isolate)).ToLocal(&tracked_state))
+    {
+      LogError("Could not wrap agent state.");
+      return false;
+    }
+
+    Local<ArrayBuffer> array_buffer_in = ArrayBuffer::New(isolate, bytes_in, length_in, ArrayBufferCreationMode::kExternalized);
+    if (!CallUpdateAgent(context, tracked_state, array_buffer_in))
+    {
+      return false;
+    }
+
+    if (report_patch_json)
+    {
+      // Fields JS deleted come out as null, as merge patches want.
+      Local<Object> changes = Object::New(isolate);
+      Local<Array> keys = touched_keys->AsArray();
+      for (uint32_t i = 0; i < keys->Length(); i++)
+      {
+        Local<Value> key = keys->Get(context, i).ToLocalChecked();
+        Local<Value> value = Null(isolate);
+        if (state->HasOwnProperty(context, key.As<Name>()).FromMaybe(false) && !state->Get(context, key).ToLocal(&value))
+        {
+          return false;
+        }
+        if (changes->Set(context, key, value).IsNothing())
+        {
+          return false;
+        }
+      }
+      touched_keys->Clear();
+
+      MaybeLocal<String> maybe_string = JSON::Stringify(context, changes);
+      if (maybe_string.IsEmpty())
+      {
+        LogError("Could not JSON::Stringify agent state changes! Not reporting to caller.");
+        return false;
+      }
+      String::Utf8Value json_value(isolate, maybe_string.ToLocalChecked());
+      if (json_value.length() > MAX_JSON_LENGTH)
+      {
+        LogError("JSON result too large. Not reporting to caller.");
+        return false;
+      }
+      report_patch_json(*json_value);
+    }
+    return true;
+  }
+
+  // Drops the agent's persistent state. Returns false if it had none.
+  bool ForgetAgentState(const char *agent_uid)
+  {
+    auto it = agent_states_.find(agent_uid);
+    if (it == agent_states_.end())
+    {
+      return false;
+    }
+    Locker locker(GetIsolate());
+    it->second.Reset();
+    agent_states_.erase(it);
+    return true;
+  }
+
+  Isolate *GetIsolate() { return isolate_; }
+
+  // Null entries fall back to the global callbacks.
+  void SetHostCallbacks(const BrainHostCallbacks &callbacks)
+  {
+    host_callbacks_ = callbacks;
+  }
+
+  const BrainHostCallbacks &GetHostCallbacks() const { return host_callbacks_; }
+
+  void HandleServiceResult(CSHARP_STRING resultJson)
+  {
+    Local<String> json_v8string = String::NewFromUtf8(GetIsolate(), resultJson, NewStringType::kNormal).ToLocalChecked();
+    last_service_call_result = JSON::Parse(GetReusableContext(), json_v8string);
+
+    if (last_service_call_result.IsEmpty())
+    {
+      std::ostringstream err;
+      err << "Could not parse service result json: " << resultJson;
+      LogError(err);
+    }
+  }
+
+private:
+  // Parses the JSON state, ticks it, and stringifies it into result_json_out
+  // unless that is null.
+  bool TickJson(Local<Context> context, const char *state_json_string, BYTE_ARRAY bytes_in, int length_in, Local<String> *result_json_out)
+  {
+    BrainIsolate::GcPhaseScope gc_phase(brain_isolate_.get(), BrainIsolate::GcPhase::kUpdate);
+    // Create an object to hold input/output vars.
+
+    MaybeLocal<Value> maybe_state_obj;
+    {
+      TraceScope trace("phase", "parse");
+      Local<String> json_v8string = String::NewFromUtf8(GetIsolate(), state_json_string, NewStringType::kNormal).ToLocalChecked();
+      maybe_state_obj = JSON::Parse(context, json_v8string);
+    }
+
+    Local<ArrayBuffer> array_buffer_in;
+    {
+      TraceScope trace("phase", "createArrayBuffer");
+      array_buffer_in = ArrayBuffer::New(GetIsolate(), bytes_in, length_in, ArrayBufferCreationMode::kExternalized);
+    }
+
+    if (maybe_state_obj.IsEmpty())
+    {
+      std::ostringstream oss;
+      oss << "Failed to JSON-parse state:\n";
+      oss << state_json_string;
+      LogError(oss.str().c_str());
+      return false;
+    }
+    Local<Value> state_obj = maybe_state_obj.ToLocalChecked();
+
+    if (!CallUpdateAgent(context, state_obj, array_buffer_in))
+    {
+      return false;
+    }
+
+    if (result_json_out != nullptr)
+    {
+      // Pull out the JSON state and stringify.
+      TraceScope trace("phase", "stringify");
+      if (!JSON::Stringify(context, state_obj).ToLocal(result_json_out))
+      {
+        LogError("Could not JSON::Stringify object returned by JS! Not reporting to caller.");
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Runs updateAgent on the state, then any promise jobs, then postMessageFlush.
+  bool CallUpdateAgent(Local<Context> context, Local<Value> state_obj, Local<ArrayBuffer> array_buffer_in)
+  {
+    BrainIsolate::GcPhaseScope gc_phase(brain_isolate_.get(), BrainIsolate::GcPhase::kUpdate);
+    long long used_before = gc_pacing_ ? GetUsedHeapSize() : 0;
+    long long freed_before = brain_isolate_->GetGcFreedBytes();
+    if (brain_isolate_->GetPooledAllocator() != nullptr)
+    {
+      brain_isolate_->GetPooledAllocator()->BeginTick();
+    }
+
+    double time_budget_ms = time_budget_ms_;
+    auto tick_start = std::chrono::steady_clock::now();
+    BudgetScope budget(GetIsolate(), time_budget_ms);
+
+    bool ok = CallUpdateAgentFunctions(context, state_obj, array_buffer_in);
+    if (!ok)
+    {
+      AbandonServiceCalls(context);
+    }
+
+    if (budget.Disarm())
+    {
+      std::ostringstream msg;
+      msg << "Brain exceeded its time budget: {\"budgetMs\":" << time_budget_ms << ",\"elapsedMs\":" << MillisecondsSince(tick_start)
+          << ",\"terminated\":" << (ok ? "false" : "true") << "}";
+      LogError(msg);
+    }
+
+    if (gc_pacing_)
+    {
+      long long allocated = GetUsedHeapSize() - used_before + brain_isolate_->GetGcFreedBytes() - freed_before;
+      allocated_bytes_per_tick_ += (std::max(0LL, allocated) - allocated_bytes_per_tick_) * GC_PACING_AVERAGE_WEIGHT;
+    }
+    return ok;
+  }
+
+  long long GetUsedHeapSize()
+  {
+    HeapStatistics stats;
+    GetIsolate()->GetHeapStatistics(&stats);
+    return stats.used_heap_size();
+  }
+
+  bool CallUpdateAgentFunctions(Local<Context> context, Local<Value> state_obj, Local<ArrayBuffer> array_buffer_in)
+  {
+    // Set on every tick, since brains with and without a budget can take
+    // turns in an isolate of their own across resets.
+    MicrotasksPolicy policy = GetEffectiveTaskBudget() > 0 ? MicrotasksPolicy::kExplicit : MicrotasksPolicy::kAuto;
+    if (GetIsolate()->GetMicrotasksPolicy() != policy)
+    {
+      GetIsolate()->SetMicrotasksPolicy(policy);
+    }
+
+    TryCatch try_catch(GetIsolate());
+    const int argc = 2;
+    Local<Value> argv[argc] = {state_obj, array_buffer_in};
+    Local<Function> update_agent_function = Local<Function>::New(GetIsolate(), reusable_update_agent_function_);
+    Local<Value> result;
+    {
+      TraceScope trace("phase", "updateAgent");
+      if (!update_agent_function->Call(context, context->Global(), argc, argv).ToLocal(&result))
+      {
+        LogCallFailure("Error while calling updateAgent: ", GetIsolate(), &try_catch);
+        return false;
+      }
+    }
+    microtasks_pending_ = true;
+
+    {
+      TraceScope trace("phase", "runTasks");
+      if (!RunTasks(context, &try_catch))
+      {
+        return false;
+      }
+    }
+
+    if (!reusable_post_message_flush_function_.IsEmpty())
+    {
+      TraceScope trace("phase", "postMessageFlush");
+      Local<Function> post_flush_function = Local<Function>::New(GetIsolate(), reusable_post_message_flush_function_);
+      if (!post_flush_function->Call(context, context->Global(), argc, argv).ToLocal(&result))
+      {
+        LogCallFailure("Error while calling postMessageFlush: ", GetIsolate(), &try_catch);
+        return false;
+      }
+    }
+
+    if (!uncached_brain_script_.IsEmpty())
+    {
+      // Refresh the cache now that updateAgent has run, so it also covers
+      // everything that got lazily compiled along the way.
+      CODE_CACHE.Store(brain_script_cache_key_, ScriptCompiler::CreateCodeCache(Local<UnboundScript>::New(isolate_, uncached_brain_script_)));
+      uncached_brain_script_.Reset();
+    }
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+    brain_isolate_->StoreUncachedModules();
+#endif
+
+    return true;
+  }
+
+  // Runs platform tasks, microtask checkpoints and async service rounds until
+  // there are none left, or the task budget is spent. Whatever is left carries
+  // over to the next tick.
+  bool RunTasks(Local<Context> context, TryCatch *try_catch)
+  {
+    auto start = std::chrono::steady_clock::now();
+    double budget_ms = GetEffectiveTaskBudget();
+    BrainTaskStatistics stats = BrainTaskStatistics();
+    int rounds = 0;
+    while (budget_ms <= 0 || MillisecondsSince(start) < budget_ms)
+    {
+      if (platform::PumpMessageLoop(V8_GLOBAL_STATE.platform, GetIsolate()))
+      {
+        stats.platformTasks++;
+        microtasks_pending_ = true;
+        if (try_catch->HasCaught())
+        {
+          LogCallFailure("Exception caught while pumping message loop: ", GetIsolate(), try_catch);
+          return false;
+        }
+      }
+      else if (microtasks_pending_)
+      {
+        GetIsolate()->RunMicrotasks();
+        stats.microtaskCheckpoints++;
+        microtasks_pending_ = false;
+      }
+      else if (!service_results_.empty())
+      {
+        // Settling promises from here does not run their jobs by itself.
+        TraceScope trace("service", "settleServiceResults");
+        SettleServiceResults(context, budget_ms > 0 ? SERVICE_RESULTS_PER_CHECKPOINT : service_results_.size());
+        microtasks_pending_ = true;
+      }
+      else if (!async_service_calls_.empty() && rounds < MAX_ASYNC_SERVICE_ROUNDS)
+      {
+        TraceScope trace("service", "sendAsyncServiceCalls");
+        SendAsyncServiceCalls();
+        rounds++;
+      }
+      else
+      {
+        break;
+      }
+      if (try_catch->HasTerminated())
+      {
+        LogCallFailure("Error while settling async service calls: ", GetIsolate(), try_catch);
+        return false;
+      }
+    }
+
+    stats.deferredServiceResults = (int)service_results_.size();
+    stats.deferredServiceCalls = (int)async_service_calls_.size();
+    stats.deferredTasks = stats.deferredServiceResults + stats.deferredServiceCalls + (microtasks_pending_ ? 1 : 0);
+    stats.taskMs = MillisecondsSince(start);
+    task_stats_ = stats;
+    return true;
+  }
+
+  // Sends the queued async service calls to the host as one batch. Their
+  // results wait in service_results_ to be settled.
+  void SendAsyncServiceCalls()
+  {
+    std::vector<AsyncServiceCall> calls;
+    calls.swap(async_service_calls_);
+
+    std::vector<const char *> service_names;
+    std::vector<const char *> args_jsons;
+    service_names.reserve(calls.size());
+    args_jsons.reserve(calls.size());
+    for (const auto &call : calls)
+    {
+      service_names.push_back(call.service_name.c_str());
+      args_jsons.push_back(call.args_json.c_str());
+    }
+
+    ServiceBatchResults results(calls.size());
+    CallServicesBatchFunction callServicesBatch = PickCallback(host_callbacks_.callServicesBatch, CALL_SERVICES_BATCH_FUNCTION);
+    CallServiceFunction callService = PickCallback(host_callbacks_.callService, CALL_SERVICE_FUNCTION);
+    CallServicesBatch(callServicesBatch, callService, service_names, args_jsons, &results);
+
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+      service_results_.emplace_back();
+      ServiceResult &service_result = service_results_.back();
+      service_result.service_name = std::move(calls[i].service_name);
+      service_result.resolver = std::move(calls[i].resolver);
+      service_result.reported = results.reported[i];
+      service_result.result_json = std::move(results.results[i]);
+    }
+  }
+
+  // After a failed tick, so the calls it made are not sent or settled during
+  // the next one. Their promises are rejected, and the rejection handlers run
+  // right away, as part of the failed tick.
+  void AbandonServiceCalls(Local<Context> context)
+  {
+    if (async_service_calls_.empty() && service_results_.empty())
+    {
+      return;
+    }
+    HandleScope handle_scope(GetIsolate());
+    TryCatch try_catch(GetIsolate());
+    for (AsyncServiceCall &call : async_service_calls_)
+    {
+      std::ostringstream err;
+      err << "Host service '" << call.service_name << "' was not called, because its tick failed.";
+      RejectWithError(context, Local<Promise::Resolver>::New(GetIsolate(), call.resolver), err.str().c_str());
+      call.resolver.Reset();
+    }
+    async_service_calls_.clear();
+    for (ServiceResult &service_result : service_results_)
+    {
+      std::ostringstream err;
+      err << "The result of host service '" << service_result.service_name << "' was dropped, because its tick failed.";
+      RejectWithError(context, Local<Promise::Resolver>::New(GetIsolate(), service_result.resolver), err.str().c_str());
+      service_result.resolver.Reset();
+    }
+    service_results_.clear();
+
+    GetIsolate()->RunMicrotasks();
+    microtasks_pending_ = false;
+    if (try_catch.HasCaught() || try_catch.HasTerminated())
+    {
+      LogCallFailure("Exception caught while rejecting the service calls of a failed tick: ", GetIsolate(), &try_catch);
+    }
+  }
+
+  // Settles the promises of up to max_count service results, oldest first.
+  void SettleServiceResults(Local<Context> context, size_t max_count)
+  {
+    HandleScope handle_scope(GetIsolate());
+    for (size_t i = 0; i < max_count && !service_results_.empty(); i++)
+    {
+      ServiceResult service_result = std::move(service_results_.front());
+      service_results_.pop_front();
+      Local<Promise::Resolver> resolver = Local<Promise::Resolver>::New(GetIsolate(), service_result.resolver);
+      service_result.resolver.Reset();
+
+      if (!service_result.reported)
+      {
+        std::ostringstream err;
+        err << "Host service '" << service_result.service_name << "' never reported back results.";
+        RejectWithError(context, resolver, err.str().c_str());
+        continue;
+      }
+
+      Local<String> json_v8string;
+      Local<Value> result;
+      if (!String::NewFromUtf8(GetIsolate(), service_result.result_json.c_str(), NewStringType::kNormal).ToLocal(&json_v8string) ||
+          !JSON::Parse(context, json_v8string).ToLocal(&result))
+      {
+        std::ostringstream err;
+        err << "Could not parse result json of service '" << service_result.service_name << "': " << service_result.result_json;
+        LogError(err);
+        RejectWithError(context, resolver, err.str().c_str());
+        continue;
+      }
+      resolver->Resolve(context, result).FromMaybe(false);
+    }
+  }
+
+  static void RejectWithError(Local<Context> context, Local<Promise::Resolver> resolver, const char *message)
+  {
+    Isolate *isolate = context->GetIsolate();
+    Local<String> message_string = String::NewFromUtf8(isolate, message, NewStringType::kNormal).ToLocalChecked();
+    resolver->Reject(context, Exception::Error(message_string)).FromMaybe(false);
+  }
+
+  // RFC 7386: nulls delete, objects merge recursively, anything else replaces.
+  static bool ApplyMergePatch(Local<Context> context, Local<Object> target, Local<Object> patch)
+  {
+    Isolate *isolate = context->GetIsolate();
+    Local<Array> keys;
+    if (!patch->GetOwnPropertyNames(context).ToLocal(&keys))
+    {
+      return false;
+    }
+    for (uint32_t i = 0; i < keys->Length(); i++)
+    {
+      Local<Value> key, value;
+      if (!keys->Get(context, i).ToLocal(&key) || !patch->Get(context, key).ToLocal(&value))
+      {
+        return false;
+      }
+
+      if (value->IsNull())
+      {
+        if (target->Delete(context, key).IsNothing())
+        {
+          return false;
+        }
+      }
+      else if (value->IsObject() && !value->IsArray())
+      {
+        Local<Value> existing;
+        if (!target->Get(context, key).ToLocal(&existing))
+        {
+          return false;
+        }
+        if (!existing->IsObject() || existing->IsArray())
+        {
+          existing = Object::New(isolate);
+          if (target->Set(context, key, existing).IsNothing())
+          {
+            return false;
+          }
+        }
+        if (!ApplyMergePatch(context, existing.As<Object>(), value.As<Object>()))
+        {
+          return false;
+        }
+      }
+      else if (target->Set(context, key, value).IsNothing())
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // A Proxy handler that records which top-level keys get touched, into
+  // delta_touched_keys_.
+  bool CreateDeltaStateHandler(Local<Context> context)
+  {
+    Isolate *isolate = GetIsolate();
+    Local<v8::Set> touched_keys = v8::Set::New(isolate);
+    Local<Object> handler = Object::New(isolate);
+    const std::pair<const char *, FunctionCallback> traps[] = {
+        {"get", DeltaStateGetTrap},
+        {"set", DeltaStateSetTrap},
+        {"deleteProperty", DeltaStateDeleteTrap},
+    };
+    for (const auto &trap : traps)
+    {
+      Local<Function> function;
+      if (!Function::New(context, trap.second, touched_keys).ToLocal(&function) ||
+          handler->Set(context, String::NewFromUtf8(isolate, trap.first, NewStringType::kInternalized).ToLocalChecked(), function).IsNothing())
+      {
+        LogError("Could not create agent state proxy handler.");
+        return false;
+      }
+    }
+    delta_state_handler_.Reset(isolate, handler);
+    delta_touched_keys_.Reset(isolate, touched_keys);
+    return true;
+  }
+
+  static bool MarkDeltaKeyTouched(const FunctionCallbackInfo<Value> &info, Local<Value> key)
+  {
+    // Symbols never make it into JSON anyway.
+    if (!key->IsString())
+    {
+      return false;
+    }
+    return !info.Data().As<v8::Set>()->Add(info.GetIsolate()->GetCurrentContext(), key).IsEmpty();
+  }
+
+  // get(target, key, receiver)
+  static void DeltaStateGetTrap(const FunctionCallbackInfo<Value> &info)
+  {
+    Local<Context> context = info.GetIsolate()->GetCurrentContext();
+    Local<Value> value;
+    if (!info[0].As<Object>()->Get(context, info[1]).ToLocal(&value))
+    {
+      return;
+    }
+    if (value->IsObject())
+    {
+      MarkDeltaKeyTouched(info, info[1]);
+    }
+    info.GetReturnValue().Set(value);
+  }
+
+  // set(target, key, value, receiver)
+  static void DeltaStateSetTrap(const FunctionCallbackInfo<Value> &info)
+  {
+    Local<Context> context = info.GetIsolate()->GetCurrentContext();
+    Maybe<bool> result = info[0].As<Object>()->Set(context, info[1], info[2]);
+    if (result.IsNothing())
+    {
+      return;
+    }
+    MarkDeltaKeyTouched(info, info[1]);
+    info.GetReturnValue().Set(result.FromJust());
+  }
+
+  // deleteProperty(target, key)
+  static void DeltaStateDeleteTrap(const FunctionCallbackInfo<Value> &info)
+  {
+    Local<Context> context = info.GetIsolate()->GetCurrentContext();
+    Maybe<bool> result = info[0].As<Object>()->Delete(context, info[1]);
+    if (result.IsNothing())
+    {
+      return;
+    }
+    MarkDeltaKeyTouched(info, info[1]);
+    info.GetReturnValue().Set(result.FromJust());
+  }
+
+
+  Local<Object> GetActorFieldsObject(Local<Context> context)
+  {
+    if (actor_fields_object_.IsEmpty())
+    {
+      Local<Object> fields = Object::New(GetIsolate());
+      context->Global()->Set(context, String::NewFromUtf8(GetIsolate(), "actorFields", NewStringType::kInternalized).ToLocalChecked(), fields).FromJust();
+      actor_fields_object_.Reset(GetIsolate(), fields);
+    }
+    return actor_fields_object_.Get(GetIsolate());
+  }
+
+  void MakeBinaryKeys(const BinarySchema &schema, std::vector<Global<String>> *keys_out)
+  {
+    for (auto &key : *keys_out)
+    {
+      key.Reset();
+    }
+    keys_out->clear();
+    for (const BinaryField &field : schema.fields)
+    {
+      keys_out->emplace_back(GetIsolate(), String::NewFromUtf8(GetIsolate(), field.name.c_str(), NewStringType::kInternalized).ToLocalChecked());
+    }
+  }
+
+  bool DecodeBinaryRequest(Local<Context> context, const char *request, int request_length, Local<Object> *state_out)
+  {
+    BinaryReader reader(request, request_length);
+    uint32_t magic = 0, version = 0;
+    if (!reader.Read(&magic) || !reader.Read(&version) || magic != BINARY_TICK_MAGIC)
+    {
+      LogError("Binary request has a bad header.");
+      return false;
+    }
+    if (version != request_schema_.version)
+    {
+      std::ostringstream errs;
+      errs << "Binary request has schema version " << version << ", but the brain expects " << request_schema_.version << ".";
+      LogError(errs);
+      return false;
+    }
+
+    Isolate *isolate = GetIsolate();
+    Local<Object> state = Object::New(isolate);
+    for (size_t i = 0; i < request_schema_.fields.size(); i++)
+    {
+      const BinaryField &field = request_schema_.fields[i];
+      Local<Value> value;
+      if (!ReadBinaryValue(context, field.type, &reader, &value))
+      {
+        std::ostringstream errs;
+        errs << "Binary request is truncated, at field '" << field.name << "'.";
+        LogError(errs);
+        return false;
+      }
+      if (state->Set(context, request_keys_[i].Get(isolate), value).IsNothing())
+      {
+        return false;
+      }
+    }
+
+    if (reader.Remaining() != 0)
+    {
+      LogError("Binary request is longer than its schema.");
+      return false;
+    }
+    *state_out = state;
+    return true;
+  }
+
+  bool ReadBinaryValue(Local<Context> context, BinaryFieldType type, BinaryReader *reader, Local<Value> *value_out)
+  {
+    Isolate *isolate = GetIsolate();
+    switch (type)
+    {
+    case BinaryFieldType::Bool:
+    {
+      uint8_t value;
+      if (!reader->Read(&value))
+      {
+        return false;
+      }
+      *value_out = Boolean::New(isolate, value != 0);
+      return true;
+    }
+    case BinaryFieldType::Int32:
+    {
+      int32_t value;
+      if (!reader->Read(&value))
+      {
+        return false;
+      }
+      *value_out = Integer::New(isolate, value);
+      return true;
+    }
+    case BinaryFieldType::Float32:
+    {
+      float value;
+      if (!reader->Read(&value))
+      {
+        return false;
+      }
+      *value_out = Number::New(isolate, value);
+      return true;
+    }
+    case BinaryFieldType::Float64:
+    {
+      double value;
+      if (!reader->Read(&value))
+      {
+        return false;
+      }
+      *value_out = Number::New(isolate, value);
+      return true;
+    }
+    case BinaryFieldType::String:
+    {
+      uint32_t length;
+      const char *bytes;
+      if (!reader->Read(&length) || (bytes = reader->Take(length)) == nullptr)
+      {
+        return false;
+      }
+      Local<String> value;
+      if (!String::NewFromUtf8(isolate, bytes, NewStringType::kNormal, (int)length).ToLocal(&value))
+      {
+        return false;
+      }
+      *value_out = value;
+      return true;
+    }
+    case BinaryFieldType::Vector3:
+    case BinaryFieldType::Quaternion:
+    {
+      int num_components = type == BinaryFieldType::Vector3 ? 3 : 4;
+      Local<Object> value = Object::New(isolate);
+      for (int i = 0; i < num_components; i++)
+      {
+        float component;
+        if (!reader->Read(&component) ||
+            value->Set(context, brain_isolate_->GetComponentKey(i), Number::New(isolate, component)).IsNothing())
+        {
+          return false;
+        }
+      }
+      *value_out = value;
+      return true;
+    }
+    case BinaryFieldType::Float32Array:
+    {
+      uint32_t count;
+      if (!reader->Read(&count) || count > reader->Remaining() / sizeof(float))
+      {
+        return false;
+      }
+      Local<ArrayBuffer> buffer = ArrayBuffer::New(isolate, count * sizeof(float));
+      memcpy(buffer->GetContents().Data(), reader->Take(count * sizeof(float)), count * sizeof(float));
+      *value_out = Float32Array::New(buffer, 0, count);
+      return true;
+    }
+    }
+    return false;
+  }
+
+  bool EncodeBinaryResponse(Local<Context> context, Local<Object> state, std::vector<char> *out)
+  {
+    AppendBinary(out, BINARY_TICK_MAGIC);
+    AppendBinary(out, response_schema_.version);
+
+    Isolate *isolate = GetIsolate();
+    TryCatch try_catch(isolate);
+    for (size_t i = 0; i < response_schema_.fields.size(); i++)
+    {
+      Local<Value> value;
+      if (!state->Get(context, response_keys_[i].Get(isolate)).ToLocal(&value) ||
+          !WriteBinaryValue(context, response_schema_.fields[i].type, value, out))
+      {
+        std::ostringstream errs;
+        errs << "Could not encode binary response field '" << response_schema_.fields[i].name << "': ";
+        LogException(errs.str().c_str(), isolate, &try_catch);
+        return false;
+      }
+    }
+
+    if (out->size() > MAX_BUFFER_SIZE)
+    {
+      LogError("Binary response too large. Not reporting to caller.");
+      return false;
+    }
+    return true;
+  }
+
+  // Missing values are written as zeroes, like a default-constructed struct.
+  bool WriteBinaryValue(Local<Context> context, BinaryFieldType type, Local<Value> value, std::vector<char> *out)
+  {
+    Isolate *isolate = GetIsolate();
+    switch (type)
+    {
+    case BinaryFieldType::Bool:
+    {
+      Maybe<bool> b = value->BooleanValue(context);
+      AppendBinary(out, (uint8_t)(b.FromMaybe(false) ? 1 : 0));
+      return b.IsJust();
+    }
+    case BinaryFieldType::Int32:
+    {
+      Maybe<int32_t> n = value->Int32Value(context);
+      AppendBinary(out, n.FromMaybe(0));
+      return n.IsJust();
+    }
+    case BinaryFieldType::Float32:
+    {
+      Maybe<double> n = value->NumberValue(context);
+      AppendBinary(out, (float)n.FromMaybe(0));
+      return n.IsJust();
+    }
+    case BinaryFieldType::Float64:
+    {
+      Maybe<double> n = value->NumberValue(context);
+      AppendBinary(out, n.FromMaybe(0));
+      return n.IsJust();
+    }
+    case BinaryFieldType::String:
+    {
+      if (value->IsNullOrUndefined())
+      {
+        AppendBinary(out, (uint32_t)0);
+        return true;
+      }
+      String::Utf8Value utf8(isolate, value);
+      if (*utf8 == nullptr)
+      {
+        return false;
+      }
+      AppendBinary(out, (uint32_t)utf8.length());
+      out->insert(out->end(), *utf8, *utf8 + utf8.length());
+      return true;
+    }
+    case BinaryFieldType::Vector3:
+    case BinaryFieldType::Quaternion:
+    {
+      int num_components = type == BinaryFieldType::Vector3 ? 3 : 4;
+      for (int i = 0; i < num_components; i++)
+      {
+        double component = 0;
+        if (value->IsObject())
+        {
+          Local<Value> component_value;
+          if (!value.As<Object>()->Get(context, brain_isolate_->GetComponentKey(i)).ToLocal(&component_value) ||
+              !component_value->NumberValue(context).To(&component))
+          {
+            return false;
+          }
+        }
+        AppendBinary(out, (float)component);
+      }
+      return true;
+    }
+    case BinaryFieldType::Float32Array:
+    {
+      if (value->IsFloat32Array())
+      {
+        Local<Float32Array> array = value.As<Float32Array>();
+        size_t start = out->size();
+        AppendBinary(out, (uint32_t)array->Length());
+        out->resize(start + sizeof(uint32_t) + array->ByteLength());
+        array->CopyContents(out->data() + start + sizeof(uint32_t), array->ByteLength());
+        return true;
+      }
+      if (value->IsArray())
+      {
+        Local<Array> array = value.As<Array>();
+        AppendBinary(out, (uint32_t)array->Length());
+        for (uint32_t i = 0; i < array->Length(); i++)
+        {
+          Local<Value> element;
+          double number = 0;
+          if (!array->Get(context, i).ToLocal(&element) || !element->NumberValue(context).To(&number))
+          {
+            return false;
+          }
+          AppendBinary(out, (float)number);
+        }
+        return true;
+      }
+      AppendBinary(out, (uint32_t)0);
+      return true;
+    }
+    }
+    return false;
+  }
+
+  // Empty for unknown modules, and lazy modules that fail to evaluate.
+  Local<Value> GetModuleNamespaceObject(const char *module_id)
+  {
+    auto it = module_namespaces_by_id.find(module_id);
+    if (it != module_namespaces_by_id.end())
+    {
+      return it->second.Get(GetIsolate());
+    }
+
+    auto module_it = modules_by_id_.find(module_id);
+    if (module_it == modules_by_id_.end())
+    {
+      return Local<Value>();
+    }
+    Local<Module> module = module_it->second.Get(GetIsolate());
+    if (!EvaluateLazyModule(module_id, module))
+    {
+      return Local<Value>();
+    }
+    Local<Value> module_namespace = module->GetModuleNamespace();
+    module_namespaces_by_id[module_id].Reset(GetIsolate(), module_namespace);
+    return module_namespace;
+  }
+
+  // Imports may already have been instantiated, or evaluated, by a module
+  // that imports them. Only called from scripts, through getVoosModule.
+  bool EvaluateLazyModule(const char *module_id, Local<Module> module)
+  {
+    Isolate *isolate = GetIsolate();
+    Local<Context> context = GetReusableContext();
+    TryCatch try_catch(isolate);
+    ModuleLoadStats &stats = module_records_[module_id].stats;
+
+    if (module->GetStatus() == Module::kUninstantiated)
+    {
+      auto start = std::chrono::steady_clock::now();
+      if (module->InstantiateModule(context, ModuleResolveCallback).IsNothing())
+      {
+        std::ostringstream err;
+        err << "Exception caught while instantiating lazy module '" << module_id << "': ";
+        LogCallFailure(err.str().c_str(), isolate, &try_catch, false);
+        return false;
+      }
+      stats.instantiateMs = MillisecondsSince(start);
+    }
+
+    if (module->GetStatus() == Module::kInstantiated)
+    {
+      auto start = std::chrono::steady_clock::now();
+      if (module->Evaluate(context).IsEmpty())
+      {
+        std::ostringstream err;
+        err << "Exception caught while evaluating lazy module '" << module_id << "': ";
+        LogCallFailure(err.str().c_str(), isolate, &try_catch, false);
+        return false;
+      }
+      stats.evaluateMs = MillisecondsSince(start);
+    }
+
+    if (module->GetStatus() != Module::kEvaluated)
+    {
+      std::ostringstream err;
+      err << "Lazy module '" << module_id << "' failed to evaluate earlier.";
+      LogError(err);
+      return false;
+    }
+    return true;
+  }
+
+  // Natives bound by the brain carry it as their data. Those deserialized
+  // from a snapshot can't, so they find it through the current context.
+  static VoosBrain *GetThis(const FunctionCallbackInfo<Value> &info)
+  {
+    Local<Value> data = info.Data();
+    if (data->IsExternal())
+    {
+      return (VoosBrain *)data.As<External>()->Value();
+    }
+    return GetBrain(info.GetIsolate()->GetCurrentContext());
+  }
+
+  static VoosBrain *GetBrain(Local<Context> context)
+  {
+    return (VoosBrain *)context->GetAlignedPointerFromEmbedderData(BRAIN_EMBEDDER_DATA_INDEX);
+  }
+
+  static bool ExtractActorAccessorCommon(TEMP_ACTOR_ID *actor_id_out, ACTOR_FIELD_ID *field_id_out, const FunctionCallbackInfo<Value> &info)
+  {
+    if (info.Length() < 2)
+    {
+      LogError("Not enough args for actor accessor. Need at least 2.");
+      return false;
+    }
+
+    uint32_t actor_id;
+    if (!ArgToUint32(info, 0, &actor_id))
+    {
+      LogError("Invalid actor id argument given for actor accessor. Need a number.");
+      return false;
+    }
+    *actor_id_out = actor_id;
+
+    uint32_t field_id;
+    if (!ArgToUint32(info, 1, &field_id))
+    {
+      LogError("Invalid field id argument given for actor accessor. Need a number.");
+      return false;
+    }
+
+    *field_id_out = field_id;
+    return true;
+  }
+
+  // The accessors are hot, so plain numbers skip the context and conversions.
+  static bool ArgToUint32(const FunctionCallbackInfo<Value> &info, int index, uint32_t *value_out)
+  {
+    Local<Value> arg = info[index];
+    if (arg->IsUint32())
+    {
+      *value_out = arg.As<Uint32>()->Value();
+      return true;
+    }
+    return arg->Uint32Value(info.GetIsolate()->GetCurrentContext()).To(value_out);
+  }
+
+  static bool ArgToNumber(const FunctionCallbackInfo<Value> &info, int index, double *value_out)
+  {
+    Local<Value> arg = info[index];
+    if (arg->IsNumber())
+    {
+      *value_out = arg.As<Number>()->Value();
+      return true;
+    }
+    return arg->NumberValue(info.GetIsolate()->GetCurrentContext()).To(value_out);
+  }
+
+  // Vector and quaternion getters write into their third argument: either a
+  // Float32Array, at the offset given as the fourth argument if any, or an
+  // object's x/y/z/w properties. The Float32Array needs no JS allocations.
+  static void WriteComponentsToOutParam(VoosBrain *brain, const FunctionCallbackInfo<Value> &info, const char *callback_name, const float *components, int num_components)
+  {
+    Local<Value> out_val = info[2];
+    if (out_val->IsFloat32Array())
+    {
+      Local<Float32Array> out_array = out_val.As<Float32Array>();
+      uint32_t offset = 0;
+      if (info.Length() > 3 && !ArgToUint32(info, 3, &offset))
+      {
+        std::ostringstream errs;
+        errs << callback_name << ": Fourth argument must be an offset into the Float32Array";
+        LogError(errs);
+        return;
+      }
+      if ((size_t)offset + num_components > out_array->Length())
+      {
+        std::ostringstream errs;
+        errs << callback_name << ": Float32Array is too short";
+        LogError(errs);
+        return;
+      }
+      memcpy((float *)GetTypedArrayData(out_array) + offset, components, num_components * sizeof(float));
+      return;
+    }
+
+    if (!out_val->IsObject())
+    {
+      std::ostringstream errs;
+      errs << callback_name << ": Third argument must be an object or a Float32Array";
+      LogError(errs);
+      return;
+    }
+
+    Isolate *isolate = info.GetIsolate();
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> out_obj = out_val.As<Object>();
+    BrainIsolate *brain_isolate = brain->brain_isolate_.get();
+    for (int i = 0; i < num_components; i++)
+    {
+      // Number::New gives back a small integer instead of a heap number when it can.
+      if (out_obj->Set(context, brain_isolate->GetComponentKey(i), Number::New(isolate, components[i])).IsNothing())
+      {
+        return;
+      }
+    }
+  }
+
+  // Reads num_components numbers, starting at the third argument.
+  static bool ReadComponentArgs(const FunctionCallbackInfo<Value> &info, float *components_out, int num_components)
+  {
+    static const char *ORDINALS[] = {"3rd", "4th", "5th", "6th"};
+    for (int i = 0; i < num_components; i++)
+    {
+      double component;
+      if (!ArgToNumber(info, 2 + i, &component))
+      {
+        std::ostringstream errs;
+        errs << ORDINALS[i] << " argument needs to be a number!";
+        LogError(errs);
+        return false;
+      }
+      components_out[i] = (float)component;
+    }
+    return true;
+  }
+
+  static void GetActorBooleanV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorBoolean);
+    ActorBooleanGetter getter = PickCallback(brain->host_callbacks_.getActorBoolean, ACTOR_BOOLEAN_GETTER);
+    if (getter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_BOOLEAN_GETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    bool value_out = false;
+    getter(actor_id, field_id, &value_out);
+    info.GetReturnValue().Set(value_out);
+  }
+
+  static void SetActorBooleanV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorBoolean);
+    ActorBooleanSetter setter = PickCallback(brain->host_callbacks_.setActorBoolean, ACTOR_BOOLEAN_SETTER);
+    if (setter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_BOOLEAN_SETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    Local<Context> context = info.GetIsolate()->GetCurrentContext();
+    Maybe<bool> value = info[2]->BooleanValue(context);
+
+    if (value.IsNothing())
+    {
+      LogError("3rd argument needs to be a boolean!");
+      return;
+    }
+
+    setter(actor_id, field_id, value.FromJust());
+  }
+
+  static void GetActorStringV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorString);
+    ActorStringGetter getter = PickCallback(brain->host_callbacks_.getActorString, ACTOR_STRING_GETTER);
+    if (getter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_STRING_GETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    if (GetActorStringBuffer.empty())
+    {
+      GetActorStringBuffer.resize(MAX_ACTOR_STRING_LENGTH);
+    }
+
+    // Clear it, to avoid using old values. To be safe.
+    GetActorStringBuffer[0] = '\0';
+
+    getter(actor_id, field_id, GetActorStringBuffer.data(), (int)GetActorStringBuffer.size());
+    Local<String> val = String::NewFromUtf8(info.GetIsolate(), GetActorStringBuffer.data());
+    String::Utf8Value value(info.GetIsolate(), val);
+    info.GetReturnValue().Set(val);
+
+    // Clear this, to avoid any possibility of V8 referencing the buffer.
+    GetActorStringBuffer[0] = '\0';
+  }
+
+  static void SetActorStringV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorString);
+    ActorStringSetter setter = PickCallback(brain->host_callbacks_.setActorString, ACTOR_STRING_SETTER);
+    if (setter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_STRING_SETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    if (!info[2]->IsString() && !info[2]->IsNullOrUndefined())
+    {
+      LogError("3rd argument needs to be a string or undefined!");
+      return;
+    }
+
+    if (info[2]->IsNullOrUndefined())
+    {
+      // Send over as empty.
+      setter(actor_id, field_id, "");
+    }
+    else
+    {
+      String::Utf8Value value(info.GetIsolate(), info[2]);
+      setter(actor_id, field_id, *value);
+    }
+  }
+
+  static void GetActorVector3V8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorVector3);
+    ActorVector3Getter getter = PickCallback(brain->host_callbacks_.getActorVector3, ACTOR_VECTOR3_GETTER);
+    if (getter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_VECTOR3_GETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    float components[3] = {};
+    getter(actor_id, field_id, &components[0], &components[1], &components[2]);
+    WriteComponentsToOutParam(brain, info, "GetActorVector3V8Callback", components, 3);
+  }
+
+  static void SetActorVector3V8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorVector3);
+    ActorVector3Setter setter = PickCallback(brain->host_callbacks_.setActorVector3, ACTOR_VECTOR3_SETTER);
+    if (setter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_VECTOR3_SETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    float components[3];
+    if (!ReadComponentArgs(info, components, 3))
+    {
+      return;
+    }
+
+    setter(actor_id, field_id, components[0], components[1], components[2]);
+  }
+
+  static void GetActorFloatV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorFloat);
+    ActorFloatGetter getter = PickCallback(brain->host_callbacks_.getActorFloat, ACTOR_FLOAT_GETTER);
+    if (getter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_FLOAT_GETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    float value_out = false;
+    getter(actor_id, field_id, &value_out);
+    info.GetReturnValue().Set(value_out);
+  }
+
+  static void SetActorFloatV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorFloat);
+    ActorFloatSetter setter = PickCallback(brain->host_callbacks_.setActorFloat, ACTOR_FLOAT_SETTER);
+    if (setter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_FLOAT_SETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    double value;
+    if (!ArgToNumber(info, 2, &value))
+    {
+      LogError("3rd argument needs to be a float!");
+      return;
+    }
+
+    setter(actor_id, field_id, (float)value);
+  }
+
+  static void GetActorQuaternionV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorQuaternion);
+    ActorQuaternionGetter getter = PickCallback(brain->host_callbacks_.getActorQuaternion, ACTOR_QUATERNION_GETTER);
+    if (getter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_QUATERNION_GETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    float components[4] = {};
+    getter(actor_id, field_id, &components[0], &components[1], &components[2], &components[3]);
+    WriteComponentsToOutParam(brain, info, "GetActorQuaternionV8Callback", components, 4);
+  }
+
+  static void SetActorQuaternionV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorQuaternion);
+    ActorQuaternionSetter setter = PickCallback(brain->host_callbacks_.setActorQuaternion, ACTOR_QUATERNION_SETTER);
+    if (setter == nullptr)
+    {
+      // TODO ideally we'd cause a V8 exception throw
+      LogError("No ACTOR_QUATERNION_SETTER set");
+      return;
+    }
+
+    TEMP_ACTOR_ID actor_id;
+    ACTOR_FIELD_ID field_id;
+    if (!ExtractActorAccessorCommon(&actor_id, &field_id, info))
+    {
+      return;
+    }
+
+    float components[4];
+    if (!ReadComponentArgs(info, components, 4))
+    {
+      return;
+    }
+
+    setter(actor_id, field_id, components[0], components[1], components[2], components[3]);
+  }
+
+  // Batch accessors take (actorIds, fieldId, values), where actorIds is a
+  // Uint16Array and values holds num_components elements per actor. Getters
+  // fill values and return it. Without a batch host callback, these fall back
+  // to calling the single-actor callback per actor.
+  static bool ExtractBatchAccessorCommon(const FunctionCallbackInfo<Value> &info, bool byte_values, int num_components,
+                                         const TEMP_ACTOR_ID **actor_ids_out, int *count_out, ACTOR_FIELD_ID *field_id_out, void **values_out)
+  {
+    if (info.Length() < 3)
+    {
+      LogError("Not enough args for batch actor accessor. Need 3: actor IDs, field ID and values.");
+      return false;
+    }
+
+    Local<Context> context = info.GetIsolate()->GetCurrentContext();
+
+    if (!info[0]->IsUint16Array())
+    {
+      LogError("Batch actor accessors need a Uint16Array of actor IDs.");
+      return false;
+    }
+
+    Maybe<uint32_t> field_id = info[1]->Uint32Value(context);
+    if (field_id.IsNothing())
+    {
+      LogError("Invalid field id argument given for batch actor accessor. Need a number.");
+      return false;
+    }
+
+    if (byte_values ? !info[2]->IsUint8Array() : !info[2]->IsFloat32Array())
+    {
+      LogError(byte_values ? "This batch actor accessor needs a Uint8Array of values." : "This batch actor accessor needs a Float32Array of values.");
+      return false;
+    }
+
+    Local<Uint16Array> actor_ids = info[0].As<Uint16Array>();
+    Local<TypedArray> values = info[2].As<TypedArray>();
+    if (values->Length() < actor_ids->Length() * num_components)
+    {
+      LogError("Values array is too short for the number of actor IDs given to batch actor accessor.");
+      return false;
+    }
+
+    *actor_ids_out = (const TEMP_ACTOR_ID *)GetTypedArrayData(actor_ids);
+    *count_out = (int)actor_ids->Length();
+    *field_id_out = field_id.FromJust();
+    *values_out = GetTypedArrayData(values);
+    info.GetReturnValue().Set(values);
+    return true;
+  }
+
+  static char *GetTypedArrayData(Local<TypedArray> array)
+  {
+    return (char *)array->Buffer()->GetContents().Data() + array->ByteOffset();
+  }
+
+  static void GetActorBooleanBatchV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorBooleanBatch);
+    const TEMP_ACTOR_ID *actor_ids;
+    int count;
+    ACTOR_FIELD_ID field_id;
+    void *values;
+    if (!ExtractBatchAccessorCommon(info, true, 1, &actor_ids, &count, &field_id, &values))
+    {
+      return;
+    }
+    uint8_t *values_out = (uint8_t *)values;
+
+    ActorBooleanBatchGetter batch_getter = PickCallback(brain->host_callbacks_.getActorBooleanBatch, ACTOR_BOOLEAN_BATCH_GETTER);
+    if (batch_getter != nullptr)
+    {
+      batch_getter(actor_ids, count, field_id, values_out);
+      return;
+    }
+    ActorBooleanGetter getter = PickCallback(brain->host_callbacks_.getActorBoolean, ACTOR_BOOLEAN_GETTER);
+    if (getter == nullptr)
+    {
+      LogError("No ACTOR_BOOLEAN_BATCH_GETTER or ACTOR_BOOLEAN_GETTER set");
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      bool value = false;
+      getter(actor_ids[i], field_id, &value);
+      values_out[i] = value ? 1 : 0;
+    }
+  }
+
+  static void SetActorBooleanBatchV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorBooleanBatch);
+    const TEMP_ACTOR_ID *actor_ids;
+    int count;
+    ACTOR_FIELD_ID field_id;
+    void *values;
+    if (!ExtractBatchAccessorCommon(info, true, 1, &actor_ids, &count, &field_id, &values))
+    {
+      return;
+    }
+    const uint8_t *values_in = (const uint8_t *)values;
+
+    ActorBooleanBatchSetter batch_setter = PickCallback(brain->host_callbacks_.setActorBooleanBatch, ACTOR_BOOLEAN_BATCH_SETTER);
+    if (batch_setter != nullptr)
+    {
+      batch_setter(actor_ids, count, field_id, values_in);
+      return;
+    }
+    ActorBooleanSetter setter = PickCallback(brain->host_callbacks_.setActorBoolean, ACTOR_BOOLEAN_SETTER);
+    if (setter == nullptr)
+    {
+      LogError("No ACTOR_BOOLEAN_BATCH_SETTER or ACTOR_BOOLEAN_SETTER set");
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      setter(actor_ids[i], field_id, values_in[i] != 0);
+    }
+  }
+
+  static void GetActorFloatBatchV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorFloatBatch);
+    const TEMP_ACTOR_ID *actor_ids;
+    int count;
+    ACTOR_FIELD_ID field_id;
+    void *values;
+    if (!ExtractBatchAccessorCommon(info, false, 1, &actor_ids, &count, &field_id, &values))
+    {
+      return;
+    }
+    float *values_out = (float *)values;
+
+    ActorFloatBatchGetter batch_getter = PickCallback(brain->host_callbacks_.getActorFloatBatch, ACTOR_FLOAT_BATCH_GETTER);
+    if (batch_getter != nullptr)
+    {
+      batch_getter(actor_ids, count, field_id, values_out);
+      return;
+    }
+    ActorFloatGetter getter = PickCallback(brain->host_callbacks_.getActorFloat, ACTOR_FLOAT_GETTER);
+    if (getter == nullptr)
+    {
+      LogError("No ACTOR_FLOAT_BATCH_GETTER or ACTOR_FLOAT_GETTER set");
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      getter(actor_ids[i], field_id, &values_out[i]);
+    }
+  }
+
+  static void SetActorFloatBatchV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorFloatBatch);
+    const TEMP_ACTOR_ID *actor_ids;
+    int count;
+    ACTOR_FIELD_ID field_id;
+    void *values;
+    if (!ExtractBatchAccessorCommon(info, false, 1, &actor_ids, &count, &field_id, &values))
+    {
+      return;
+    }
+    const float *values_in = (const float *)values;
+
+    ActorFloatBatchSetter batch_setter = PickCallback(brain->host_callbacks_.setActorFloatBatch, ACTOR_FLOAT_BATCH_SETTER);
+    if (batch_setter != nullptr)
+    {
+      batch_setter(actor_ids, count, field_id, values_in);
+      return;
+    }
+    ActorFloatSetter setter = PickCallback(brain->host_callbacks_.setActorFloat, ACTOR_FLOAT_SETTER);
+    if (setter == nullptr)
+    {
+      LogError("No ACTOR_FLOAT_BATCH_SETTER or ACTOR_FLOAT_SETTER set");
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      setter(actor_ids[i], field_id, values_in[i]);
+    }
+  }
+
+  static void GetActorVector3BatchV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorVector3Batch);
+    const TEMP_ACTOR_ID *actor_ids;
+    int count;
+    ACTOR_FIELD_ID field_id;
+    void *values;
+    if (!ExtractBatchAccessorCommon(info, false, 3, &actor_ids, &count, &field_id, &values))
+    {
+      return;
+    }
+    float *xyz_out = (float *)values;
+
+    ActorVector3BatchGetter batch_getter = PickCallback(brain->host_callbacks_.getActorVector3Batch, ACTOR_VECTOR3_BATCH_GETTER);
+    if (batch_getter != nullptr)
+    {
+      batch_getter(actor_ids, count, field_id, xyz_out);
+      return;
+    }
+    ActorVector3Getter getter = PickCallback(brain->host_callbacks_.getActorVector3, ACTOR_VECTOR3_GETTER);
+    if (getter == nullptr)
+    {
+      LogError("No ACTOR_VECTOR3_BATCH_GETTER or ACTOR_VECTOR3_GETTER set");
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      float *xyz = xyz_out + 3 * i;
+      getter(actor_ids[i], field_id, &xyz[0], &xyz[1], &xyz[2]);
+    }
+  }
+
+  static void SetActorVector3BatchV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorVector3Batch);
+    const TEMP_ACTOR_ID *actor_ids;
+    int count;
+    ACTOR_FIELD_ID field_id;
+    void *values;
+    if (!ExtractBatchAccessorCommon(info, false, 3, &actor_ids, &count, &field_id, &values))
+    {
+      return;
+    }
+    const float *xyz_in = (const float *)values;
+
+    ActorVector3BatchSetter batch_setter = PickCallback(brain->host_callbacks_.setActorVector3Batch, ACTOR_VECTOR3_BATCH_SETTER);
+    if (batch_setter != nullptr)
+    {
+      batch_setter(actor_ids, count, field_id, xyz_in);
+      return;
+    }
+    ActorVector3Setter setter = PickCallback(brain->host_callbacks_.setActorVector3, ACTOR_VECTOR3_SETTER);
+    if (setter == nullptr)
+    {
+      LogError("No ACTOR_VECTOR3_BATCH_SETTER or ACTOR_VECTOR3_SETTER set");
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      const float *xyz = xyz_in + 3 * i;
+      setter(actor_ids[i], field_id, xyz[0], xyz[1], xyz[2]);
+    }
+  }
+
+  static void GetActorQuaternionBatchV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetActorQuaternionBatch);
+    const TEMP_ACTOR_ID *actor_ids;
+    int count;
+    ACTOR_FIELD_ID field_id;
+    void *values;
+    if (!ExtractBatchAccessorCommon(info, false, 4, &actor_ids, &count, &field_id, &values))
+    {
+      return;
+    }
+    float *xyzw_out = (float *)values;
+
+    ActorQuaternionBatchGetter batch_getter = PickCallback(brain->host_callbacks_.getActorQuaternionBatch, ACTOR_QUATERNION_BATCH_GETTER);
+    if (batch_getter != nullptr)
+    {
+      batch_getter(actor_ids, count, field_id, xyzw_out);
+      return;
+    }
+    ActorQuaternionGetter getter = PickCallback(brain->host_callbacks_.getActorQuaternion, ACTOR_QUATERNION_GETTER);
+    if (getter == nullptr)
+    {
+      LogError("No ACTOR_QUATERNION_BATCH_GETTER or ACTOR_QUATERNION_GETTER set");
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      float *xyzw = xyzw_out + 4 * i;
+      getter(actor_ids[i], field_id, &xyzw[0], &xyzw[1], &xyzw[2], &xyzw[3]);
+    }
+  }
+
+  static void SetActorQuaternionBatchV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kSetActorQuaternionBatch);
+    const TEMP_ACTOR_ID *actor_ids;
+    int count;
+    ACTOR_FIELD_ID field_id;
+    void *values;
+    if (!ExtractBatchAccessorCommon(info, false, 4, &actor_ids, &count, &field_id, &values))
+    {
+      return;
+    }
+    const float *xyzw_in = (const float *)values;
+
+    ActorQuaternionBatchSetter batch_setter = PickCallback(brain->host_callbacks_.setActorQuaternionBatch, ACTOR_QUATERNION_BATCH_SETTER);
+    if (batch_setter != nullptr)
+    {
+      batch_setter(actor_ids, count, field_id, xyzw_in);
+      return;
+    }
+    ActorQuaternionSetter setter = PickCallback(brain->host_callbacks_.setActorQuaternion, ACTOR_QUATERNION_SETTER);
+    if (setter == nullptr)
+    {
+      LogError("No ACTOR_QUATERNION_BATCH_SETTER or ACTOR_QUATERNION_SETTER set");
+      return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      const float *xyzw = xyzw_in + 4 * i;
+      setter(actor_ids[i], field_id, xyzw[0], xyzw[1], xyzw[2], xyzw[3]);
+    }
+  }
+
+  // Short-cut for non-performance-sensitive functions, like using Unity's Physics.Raycast.
+  // Which services are available should be agreed upon between the host and the JS code.
+  static void CallServiceV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kCallService);
+    String::Utf8Value serviceName(info.GetIsolate(), info[0]);
+
+    if (serviceName.length() > MAX_GUID_LENGTH)
+    {
+      return;
+    }
+
+    std::shared_ptr<const TypedService> typed_service = FindTypedService(*serviceName);
+    if (typed_service)
+    {
+      brain->CallTypedService(info, typed_service);
+      return;
+    }
+
+    CallServiceFunction callService = PickCallback(brain->host_callbacks_.callService, CALL_SERVICE_FUNCTION);
+    if (callService == nullptr)
+    {
+      LogError("Scripts wanted to use callService, but no call-service-function was set (via SetCallServiceFunction).");
+      return;
+    }
+
+    MaybeLocal<String> maybeArgsJson = JSON::Stringify(brain->GetReusableContext(), info[1]);
+
+    if (maybeArgsJson.IsEmpty())
+    {
+      std::ostringstream err;
+      err << "Could not JSON-nify arguments when trying to call service '" << *serviceName << "'. Returning nothing.";
+      LogError(err);
+      return;
+    }
+
+    String::Utf8Value argsJson(info.GetIsolate(), maybeArgsJson.ToLocalChecked());
+    if (argsJson.length() > MAX_JSON_LENGTH)
+    {
+      return;
+    }
+    {
+      BRAIN_SERVICE_METRIC(brain->FindServiceMetrics(info[0], *serviceName));
+      TraceScope trace("service", *serviceName);
+      CallService(callService, *serviceName, *argsJson, brain);
+    }
+
+    if (brain->last_service_call_result.IsEmpty())
+    {
+      std::ostringstream err;
+      err << "Failed to capture result of service '" << *serviceName << "'. See prior errors for details. Input args json: " << *argsJson;
+      LogError(err);
+      return;
+    }
+
+    info.GetReturnValue().Set(brain->last_service_call_result.ToLocalChecked());
+  }
+
+  // Remade if the service is registered again.
+  struct TypedServiceKeys
+  {
+    std::shared_ptr<const TypedService> service;
+    std::vector<Global<String>> args_keys;
+    std::vector<Global<String>> result_keys;
+#if V8_IN_UNITY_METRICS
+    CallbackMetrics *metrics = nullptr;
+#endif
+  };
+
+  void CallTypedService(const FunctionCallbackInfo<Value> &info, const std::shared_ptr<const TypedService> &service)
+  {
+    Isolate *isolate = GetIsolate();
+    Local<Context> context = GetReusableContext();
+    TypedServiceKeys &keys = GetTypedServiceKeys(service);
+
+    std::vector<char> &args = TypedServiceArgsBuffer;
+    args.clear();
+    if (!EncodeTypedServiceArgs(context, *service, keys, info[1], &args))
+    {
+      return;
+    }
+
+    std::vector<char> &result = TypedServiceResultBuffer;
+    if (result.size() < INITIAL_TYPED_SERVICE_RESULT_SIZE)
+    {
+      result.resize(INITIAL_TYPED_SERVICE_RESULT_SIZE);
+    }
+    int result_size;
+    {
+      BRAIN_SERVICE_METRIC(keys.metrics);
+      TraceScope trace("service", service->name.c_str());
+      result_size = service->function(service->name.c_str(), args.data(), (int)args.size(), result.data(), (int)result.size());
+      if (result_size > (int)result.size() && result_size <= (int)MAX_BUFFER_SIZE)
+      {
+        result.resize(result_size);
+        result_size = service->function(service->name.c_str(), args.data(), (int)args.size(), result.data(), (int)result.size());
+      }
+    }
+    if (result_size < 0 || result_size > (int)result.size())
+    {
+      std::ostringstream err;
+      err << "Typed service '" << service->name << "' failed, or returned a bad result size (" << result_size << ").";
+      LogError(err);
+      return;
+    }
+
+    // Numeric results can go straight into a caller's Float32Array.
+    int result_components = service->result_schema.NumericComponentCount();
+    if (result_components >= 0 && info.Length() > 2 && info[2]->IsFloat32Array())
+    {
+      Local<Float32Array> out = info[2].As<Float32Array>();
+      if ((int)out->Length() < result_components)
+      {
+        std::ostringstream err;
+        err << "Result array for typed service '" << service->name << "' needs " << result_components << " elements.";
+        LogError(err);
+        return;
+      }
+      float *out_data = (float *)GetTypedArrayData(out);
+      BinaryReader reader(result.data(), result_size);
+      for (const BinaryField &field : service->result_schema.fields)
+      {
+        if (!ReadNumericComponents(field.type, &reader, &out_data))
+        {
+          LogTypedServiceResultError(*service);
+          return;
+        }
+      }
+      if (reader.Remaining() != 0)
+      {
+        LogTypedServiceResultError(*service);
+        return;
+      }
+      info.GetReturnValue().Set(out);
+      return;
+    }
+
+    BinaryReader reader(result.data(), result_size);
+    Local<Object> result_obj = Object::New(isolate);
+    for (size_t i = 0; i < service->result_schema.fields.size(); i++)
+    {
+      Local<Value> value;
+      if (!ReadBinaryValue(context, service->result_schema.fields[i].type, &reader, &value) ||
+          result_obj->Set(context, keys.result_keys[i].Get(isolate), value).IsNothing())
+      {
+        LogTypedServiceResultError(*service);
+        return;
+      }
+    }
+    if (reader.Remaining() != 0)
+    {
+      LogTypedServiceResultError(*service);
+      return;
+    }
+    info.GetReturnValue().Set(result_obj);
+  }
+
+  static void LogTypedServiceResultError(const TypedService &service)
+  {
+    std::ostringstream err;
+    err << "Result of typed service '" << service.name << "' does not match its schema '" << service.result_schema.spec << "'.";
+    LogError(err);
+  }
+
+  TypedServiceKeys &GetTypedServiceKeys(const std::shared_ptr<const TypedService> &service)
+  {
+    TypedServiceKeys &keys = typed_service_keys_[service->name];
+    if (keys.service != service)
+    {
+      keys.service = service;
+      MakeBinaryKeys(service->args_schema, &keys.args_keys);
+      MakeBinaryKeys(service->result_schema, &keys.result_keys);
+#if V8_IN_UNITY_METRICS
+      keys.metrics = &service_metrics_[service->name];
+#endif
+    }
+    return keys;
+  }
+
+  bool EncodeTypedServiceArgs(Local<Context> context, const TypedService &service, const TypedServiceKeys &keys, Local<Value> args, std::vector<char> *out)
+  {
+    Isolate *isolate = GetIsolate();
+    TryCatch try_catch(isolate);
+
+    int args_components = service.args_schema.NumericComponentCount();
+    if (args_components >= 0 && (args->IsArray() || args->IsFloat32Array() || args->IsFloat64Array()))
+    {
+      uint32_t length = args->IsArray() ? args.As<Array>()->Length() : (uint32_t)args.As<TypedArray>()->Length();
+      if (length != (uint32_t)args_components)
+      {
+        std::ostringstream err;
+        err << "Typed service '" << service.name << "' takes " << args_components << " numbers, but got " << length << ".";
+        LogError(err);
+        return false;
+      }
+
+      uint32_t index = 0;
+      for (const BinaryField &field : service.args_schema.fields)
+      {
+        int components = BinarySchema::NumericComponentCount(field.type);
+        for (int i = 0; i < components; i++, index++)
+        {
+          double number = 0;
+          if (args->IsFloat32Array())
+          {
+            number = ((const float *)GetTypedArrayData(args.As<TypedArray>()))[index];
+          }
+          else if (args->IsFloat64Array())
+          {
+            number = ((const double *)GetTypedArrayData(args.As<TypedArray>()))[index];
+          }
+          else
+          {
+            Local<Value> element;
+            if (!args.As<Array>()->Get(context, index).ToLocal(&element) || !element->NumberValue(context).To(&number))
+            {
+              LogException("Could not read typed service args: ", isolate, &try_catch);
+              return false;
+            }
+          }
+          AppendNumericComponent(field.type, number, out);
+        }
+      }
+      return true;
+    }
+
+    if (!args->IsObject())
+    {
+      std::ostringstream err;
+      err << "Typed service '" << service.name << "' takes an object with '" << service.args_schema.spec << "'.";
+      LogError(err);
+      return false;
+    }
+    Local<Object> args_obj = args.As<Object>();
+    for (size_t i = 0; i < service.args_schema.fields.size(); i++)
+    {
+      Local<Value> value;
+      if (!args_obj->Get(context, keys.args_keys[i].Get(isolate)).ToLocal(&value) ||
+          !WriteBinaryValue(context, service.args_schema.fields[i].type, value, out))
+      {
+        std::ostringstream errs;
+        errs << "Could not encode arg '" << service.args_schema.fields[i].name << "' of typed service '" << service.name << "': ";
+        LogException(errs.str().c_str(), isolate, &try_catch);
+        return false;
+      }
+    }
+    if (out->size() > MAX_BUFFER_SIZE)
+    {
+      LogError("Typed service args too large.");
+      return false;
+    }
+    return true;
+  }
+
+  static void AppendNumericComponent(BinaryFieldType type, double number, std::vector<char> *out)
+  {
+    switch (type)
+    {
+    case BinaryFieldType::Bool:
+      AppendBinary(out, (uint8_t)(number != 0 ? 1 : 0));
+      break;
+    case BinaryFieldType::Int32:
+      AppendBinary(out, (int32_t)number);
+      break;
+    case BinaryFieldType::Float64:
+      AppendBinary(out, number);
+      break;
+    default:
+      AppendBinary(out, (float)number);
+      break;
+    }
+  }
+
+  // Advances out_data past the field's components.
+  static bool ReadNumericComponents(BinaryFieldType type, BinaryReader *reader, float **out_data)
+  {
+    int components = BinarySchema::NumericComponentCount(type);
+    for (int i = 0; i < components; i++)
+    {
+      bool ok;
+      switch (type)
+      {
+      case BinaryFieldType::Bool:
+      {
+        uint8_t value = 0;
+        ok = reader->Read(&value);
+        **out_data = value != 0 ? 1.0f : 0.0f;
+        break;
+      }
+      case BinaryFieldType::Int32:
+      {
+        int32_t value = 0;
+        ok = reader->Read(&value);
+        **out_data = (float)value;
+        break;
+      }
+      case BinaryFieldType::Float64:
+      {
+        double value = 0;
+        ok = reader->Read(&value);
+        **out_data = (float)value;
+        break;
+      }
+      default:
+        ok = reader->Read(*out_data);
+        break;
+      }
+      if (!ok)
+      {
+        return false;
+      }
+      (*out_data)++;
+    }
+    return true;
+  }
+
+  // Like callVoosService, but returns a promise, and lets the host handle all
+  // requests of a tick together.
+  static void CallServiceAsyncV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kCallServiceAsync);
+    Local<Context> context = brain->GetReusableContext();
+    Local<Promise::Resolver> resolver;
+    if (!Promise::Resolver::New(context).ToLocal(&resolver))
+    {
+      return;
+    }
+    info.GetReturnValue().Set(resolver->GetPromise());
+
+    String::Utf8Value serviceName(info.GetIsolate(), info[0]);
+    if (serviceName.length() == 0 || serviceName.length() > MAX_GUID_LENGTH)
+    {
+      RejectWithError(context, resolver, "callVoosServiceAsync needs a service name.");
+      return;
+    }
+
+    if (brain->async_service_calls_.size() >= MAX_ASYNC_SERVICE_CALLS)
+    {
+      std::ostringstream err;
+      err << "Too many pending async service calls. Rejecting call to '" << *serviceName << "'.";
+      RejectWithError(context, resolver, err.str().c_str());
+      return;
+    }
+
+    Local<String> argsJson;
+    if (!JSON::Stringify(context, info[1]).ToLocal(&argsJson))
+    {
+      std::ostringstream err;
+      err << "Could not JSON-nify arguments when trying to call service '" << *serviceName << "'.";
+      RejectWithError(context, resolver, err.str().c_str());
+      return;
+    }
+
+    String::Utf8Value argsJsonUtf8(info.GetIsolate(), argsJson);
+    if (argsJsonUtf8.length() > MAX_JSON_LENGTH)
+    {
+      RejectWithError(context, resolver, "Service arguments are too big.");
+      return;
+    }
+
+    brain->async_service_calls_.emplace_back();
+    AsyncServiceCall &call = brain->async_service_calls_.back();
+    call.service_name = *serviceName;
+    call.args_json = *argsJsonUtf8;
+    call.resolver.Reset(info.GetIsolate(), resolver);
+  }
+
+  static void GetModuleV8Callback(const FunctionCallbackInfo<Value> &info)
+  {
+    VoosBrain *brain = GetThis(info);
+    BRAIN_BINDING_METRIC(brain, kGetModule);
+    String::Utf8Value module_id(info.GetIsolate(), info[0]);
+    if (module_id.length() > MAX_GUID_LENGTH)
+    {
+      return;
+    }
+    Local<Value> module_namespace = brain->GetModuleNamespaceObject(*module_id);
+    if (!module_namespace.IsEmpty())
+    {
+      info.GetReturnValue().Set(module_namespace);
+    }
+  }
+
+  void SetField(Local<Object> obj, std::string key_string, Local<Value> value)
+  {
+    Local<String> key = String::NewFromUtf8(GetIsolate(), key_string.c_str(), NewStringType::kNormal).ToLocalChecked();
+    obj->Set(key, value);
+  }
+
+  float GetFloatField(Local<Object> obj, std::string key_string)
+  {
+    Local<String> key = String::NewFromUtf8(GetIsolate(), key_string.c_str(), NewStringType::kNormal).ToLocalChecked();
+    // TODO get rid of 'Checked' calls
+    return (float)obj->Get(key)->NumberValue(GetIsolate()->GetCurrentContext()).ToChecked();
+  }
+
+  // This should be waaaayyy faster than Context::New(...).
+  Local<Context> GetReusableContext()
+  {
+    return Local<Context>::New(isolate_, reusable_context_);
+  }
+
+  // Everything in this block is fairly cheap. Even doing it 100x doesn't affect timings much.
+  // Assumes the isolate has a context active.
+  // If the code cache missed, the brain script is returned through
+  // uncached_script_out, so the caller can refresh the cache after warm runs.
+  static bool CompileBrainJavascript(Isolate *isolate, const char *javascriptSource, Global<UnboundScript> *uncached_script_out = nullptr)
+  {
+    TryCatch try_catch(isolate);
+
+    Local<String> sourceString =
+        String::NewFromUtf8(isolate, javascriptSource, NewStringType::kNormal).ToLocalChecked();
+
+    std::string cache_key = CODE_CACHE.GetKey(javascriptSource);
+    ScriptCompiler::CachedData *cached_data = CODE_CACHE.Load(cache_key);
+    ScriptCompiler::Source source(sourceString, cached_data);
+    MaybeLocal<Script> compiled = ScriptCompiler::Compile(isolate->GetCurrentContext(), &source,
+                                                          cached_data ? ScriptCompiler::kConsumeCodeCache : ScriptCompiler::kNoCompileOptions);
+    if (compiled.IsEmpty())
+    {
+      LogException("Error while compiling brain JS: ", isolate, &try_catch);
+      return false;
+    }
+    bool cache_hit = CODE_CACHE.CheckConsumed(cache_key, source.GetCachedData());
+
+    if (compiled.ToLocalChecked()->Run(isolate->GetCurrentContext()).IsEmpty())
+    {
+      LogCallFailure("Exception caught while running brain JS: ", isolate, &try_catch);
+      return false;
+    }
+
+    if (!cache_hit && !cache_key.empty())
+    {
+      // Created after running, so it includes whatever the top level compiled.
+      Local<UnboundScript> unbound = compiled.ToLocalChecked()->GetUnboundScript();
+      CODE_CACHE.Store(cache_key, ScriptCompiler::CreateCodeCache(unbound));
+      if (uncached_script_out != nullptr)
+      {
+        uncached_script_out->Reset(isolate, unbound);
+      }
+    }
+
+    return true;
+  }
+
+  // Assumes the context is entered.
+  bool RestoreSnapshotModules(Local<Context> context)
+  {
+    for (const auto &entry : snapshot_->modules)
+    {
+      if (!LoadModuleRecord(context, entry.first, entry.second))
+      {
+        std::ostringstream err;
+        err << "Could not restore module '" << entry.first << "' from brain snapshot.";
+        LogError(err);
+        return false;
+      }
+      module_records_[entry.first].stats.loads++;
+    }
+    return true;
+  }
+
+  std::shared_ptr<BrainIsolate> brain_isolate_;
+  Isolate *isolate_;
+  BrainHostCallbacks host_callbacks_;
+  Global<Context> reusable_context_;
+  Global<Function> reusable_update_agent_function_;
+  Global<Function> reusable_post_message_flush_function_;
+  std::map<std::string, Global<Value>> module_namespaces_by_id;
+  // Evaluated modules, for imports.
+  std::map<std::string, Global<Module>> modules_by_id_;
+
+  struct ModuleRecord
+  {
+    ModuleRecord() : source_hash(0) { memset(&stats, 0, sizeof(stats)); }
+    std::string source;
+    uint64_t source_hash;
+    // UIDs of the modules it imports.
+    std::set<std::string> imports;
+    ModuleLoadStats stats;
+  };
+  std::map<std::string, ModuleRecord> module_records_;
+  // Set between StartModulesBatch and the poll that finishes it.
+  std::unique_ptr<ModuleBatch> module_batch_;
+  bool lazy_modules_;
+  bool gc_pacing_;
+  // A moving average, only kept up with GC pacing on.
+  double allocated_bytes_per_tick_;
+  // 0 for none.
+  double time_budget_ms_;
+  // 0 to run every task each tick.
+  double task_budget_ms_;
+  // Whether JS ran since the last microtask checkpoint.
+  bool microtasks_pending_;
+  BrainTaskStatistics task_stats_;
+  // Kept alive for as long as the isolate that was deserialized from it.
+  std::shared_ptr<BrainSnapshot> snapshot_;
+  // Set if the brain JS missed the code cache, until the first warm update.
+  Global<UnboundScript> uncached_brain_script_;
+  std::string brain_script_cache_key_;
+
+  MaybeLocal<Value> last_service_call_result;
+
+  bool has_binary_schemas_;
+  BinarySchema request_schema_;
+  BinarySchema response_schema_;
+  std::vector<Global<String>> request_keys_;
+  std::vector<Global<String>> response_keys_;
+  std::vector<char> pending_binary_response_;
+
+  // Persistent state per agent UID, for UpdateAgentDelta.
+  std::map<std::string, Global<Object>> agent_states_;
+  Global<Object> delta_state_handler_;
+  Global<v8::Set> delta_touched_keys_;
+
+  // Host-owned, for results written without copies.
+  char *result_buffer_;
+  int result_buffer_capacity_;
+  // A result that did not fit in the result buffer.
+  Global<String> pending_result_json_;
+
+  std::map<std::string, ActorFieldTable> actor_field_tables_;
+  Global<Object> actor_fields_object_;
+
+  struct AsyncServiceCall
+  {
+    std::string service_name;
+    std::string args_json;
+    Global<Promise::Resolver> resolver;
+  };
+  // Queued by callVoosServiceAsync, until the next batch goes out.
+  std::vector<AsyncServiceCall> async_service_calls_;
+
+#if V8_IN_UNITY_METRICS
+  CallbackMetrics binding_metrics_[(int)BrainBinding::kCount];
+  // Sync and typed calls, by service name. Never erased from, so callers can
+  // keep pointers to the entries.
+  std::map<std::string, CallbackMetrics> service_metrics_;
+  std::unordered_multimap<int, std::map<std::string, CallbackMetrics>::iterator> service_metrics_by_hash_;
+#endif
+
+  struct ServiceResult
+  {
+    std::string service_name;
+    Global<Promise::Resolver> resolver;
+    bool reported;
+    std::string result_json;
+  };
+  // Back from the host, and waiting for their promises to be settled.
+  std::deque<ServiceResult> service_results_;
+
+  // Field name strings per typed service.
+  std::map<std::string, TypedServiceKeys> typed_service_keys_;
+};
+
+// TODO move this into a class.
+// Shared, so a brain found by one thread stays alive while another resets or
+// deletes it. The old brain goes away once the last call using it returns.
+std::map<std::string, std::shared_ptr<VoosBrain>> BRAIN_BY_UID;
+// Guards the map itself.
+std::mutex BRAIN_BY_UID_MUTEX;
+
+// Guarded by BRAIN_BY_UID_MUTEX. Kept apart from the brains, so options can be
+// set before the brain first exists.
+std::map<std::string, BrainIsolateOptions> BRAIN_ISOLATE_OPTIONS;
+
+static std::shared_ptr<VoosBrain> FindBrain(CSHARP_STRING brainUid)
+{
+  std::lock_guard<std::mutex> lock(BRAIN_BY_UID_MUTEX);
+  auto it = BRAIN_BY_UID.find(std::string(brainUid));
+  if (it == BRAIN_BY_UID.end())
+  {
+    return nullptr;
+  }
+  return it->second;
+}
+
+static void LogUnknownBrain(CSHARP_STRING brainUid)
+{
+  std::ostringstream errs;
+  errs << "Unknown brain UID: " << brainUid;
+  LogError(errs.str().c_str());
+}
+
+// Worker threads.
+
+// A fixed set of threads that runs batches of jobs. Run returns once every
+// job in the batch is done.
+class BrainWorkerPool
+{
+public:
+  BrainWorkerPool(int num_threads) : job_(nullptr), next_job_(0), num_jobs_(0), num_done_(0), stopping_(false)
+  {
+    for (int i = 0; i < num_threads; i++)
+    {
+      threads_.emplace_back([this]() { WorkerLoop(); });
+    }
+  }
+
+  ~BrainWorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread &thread : threads_)
+    {
+      thread.join();
+    }
+  }
+
+  int GetNumThreads() const { return (int)threads_.size(); }
+
+  void Run(int num_jobs, const std::function<void(int)> &job)
+  {
+    // One batch at a time.
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ = &job;
+    next_job_ = 0;
+    num_jobs_ = num_jobs;
+    num_done_ = 0;
+    work_cv_.notify_all();
+    done_cv_.wait(lock, [this]() { return num_done_ == num_jobs_; });
+    job_ = nullptr;
+  }
+
+private:
+  void WorkerLoop()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+      work_cv_.wait(lock, [this]() { return stopping_ || (job_ != nullptr && next_job_ < num_jobs_); });
+      if (stopping_)
+      {
+        return;
+      }
+      int index = next_job_++;
+      const std::function<void(int)> *job = job_;
+      lock.unlock();
+      (*job)(index);
+      lock.lock();
+      if (++num_done_ == num_jobs_)
+      {
+        done_cv_.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex run_mutex_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(int)> *job_;
+  int next_job_;
+  int num_jobs_;
+  int num_done_;
+  bool stopping_;
+};
+
+// Replaced as a whole, so batches already running keep the pool they started on.
+std::shared_ptr<BrainWorkerPool> BRAIN_WORKER_POOL;
+std::mutex BRAIN_WORKER_POOL_MUTEX;
+
+// Keeps an isolate around so you don't have to create a new one each time you want to run some JS.
+class ReusableContext
+{
+public:
+  ReusableContext() : isolate_(nullptr)
+  {
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    isolate_ = Isolate::New(create_params);
+
+    // Create the context
+    Locker locker(isolate_);
+    Isolate::Scope isolate_scope(isolate_);
+    // Create a stack-allocated handle scope.
+    HandleScope handle_scope(isolate_);
+
+    Local<ObjectTemplate> global_template = ObjectTemplate::New(isolate_);
+    SetupGlobalTemplate(isolate_, global_template);
+
+    Local<Context> context = Context::New(isolate_, nullptr, global_template);
+    reusableContext_.Reset(isolate_, context);
+  }
+
+  Isolate *GetIsolate() { return isolate_; }
+
+  void Evaluate(const char *javascriptSource)
+  {
+    Locker locker(isolate_);
+    Isolate::Scope isolate_scope(isolate_);
+    HandleScope handle_scope(isolate_);
+    auto context = GetReusableContext();
+    Context::Scope context_scope(context);
+    CompileAndRun(javascriptSource);
+  }
+
+  ~ReusableContext()
+  {
+    {
+      Locker locker(isolate_);
+      reusableContext_.Reset();
+    }
+    isolate_->Dispose();
+    delete create_params.array_buffer_allocator;
+  }
+
+  // This should be waaaayyy faster than Context::New(...).
+  v8::Local<v8::Context> GetReusableContext()
+  {
+    return v8::Local<v8::Context>::New(isolate_, reusableContext_);
+  }
+
+  // Everything in this block is fairly cheap. Even doing it 100x doesn't affect timings much.
+  // Assumes the isolate has a context active.
+  void CompileAndRun(const char *javascriptSource)
+  {
+    Local<String> source =
+        String::NewFromUtf8(isolate_, javascriptSource, NewStringType::kNormal).ToLocalChecked();
+    // Compile the source code.
+    MaybeLocal<Script> compiled = Script::Compile(isolate_->GetCurrentContext(), source);
+    if (compiled.IsEmpty())
+    {
+      LogError("Could not compile! JS source:");
+      LogError(javascriptSource);
+      return;
+    }
+
+    TryCatch try_catch(isolate_);
+    MaybeLocal<Value> result = compiled.ToLocalChecked()->Run(GetIsolate()->GetCurrentContext());
+    if (try_catch.HasCaught())
+    {
+      LogError("Exception caught while running:");
+      String::Utf8Value message(GetIsolate(), try_catch.Message()->Get());
+      LogError(*message);
+    }
+  }
+
+private:
+  Isolate::CreateParams create_params;
+  Isolate *isolate_;
+  Global<Context> reusableContext_;
+};
+
+static ReusableContext *CONTEXT_ = nullptr;
+
+extern "C"
+{
+  void TestSort(int a[], int length)
+  {
+    std::sort(a, a + length);
+  }
+
+  void SetDebugLogFunction(StringFunction function)
+  {
+    HOST_DEBUG_LOG_FUNCTION = function;
+    // Log("Host debug log function set");
+  }
+
+  void SetErrorLogFunction(StringFunction function)
+  {
+    HOST_ERROR_LOG_FUNCTION = function;
+    // Log("Host error log function set");
+  }
+
+  int InitializeV8(const char *runtimeFilesDirectory)
+  {
+    if (!IsStringValid(runtimeFilesDirectory, MAX_FILEPATH_LENGTH))
+    {
+      return 1;
+    }
+    if (strnlen(runtimeFilesDirectory, MAX_FILEPATH_LENGTH))
+      std::cout << "Got runtime files dir of " << runtimeFilesDirectory << std::endl;
+    std::string exePath = std::string(runtimeFilesDirectory) + "/foo.exe";
+    return InitializeV8WithExecutablePath(exePath.c_str());
+  }
+
+  int InitializeV8WithExecutablePath(const char *executablePath)
+  {
+    if (!IsStringValid(executablePath, MAX_FILEPATH_LENGTH))
+    {
+      return 1;
+    }
+
+    if (V8_GLOBAL_STATE.platform != nullptr)
+    {
+      std::cout << "WARNING: InitializeV8WithExecutablePath called, but platform was already initialized! Doing nothing." << std::endl;
+      return 1;
+    }
+
+    // Initialize V8.
+    V8::InitializeICUDefaultLocation(executablePath);
+    V8::InitializeExternalStartupData(executablePath);
+    // Idle tasks, like scavenges V8 schedules ahead of a full young
+    // generation, only run in IdleCollect.
+    V8_GLOBAL_STATE.platform = platform::CreateDefaultPlatform(0, platform::IdleTaskSupport::kEnabled);
+    V8::InitializePlatform(V8_GLOBAL_STATE.platform);
+    if (V8::Initialize())
+    {
+      CONTEXT_ = new ReusableContext();
+      return 0;
+    }
+    else
+    {
+      return 1;
+    }
+  }
+
+  void Evaluate(const char *javascriptSource)
+  {
+    if (!IsStringValid(javascriptSource, MAX_JAVASCRIPT_SOURCE_LENGTH))
+    {
+      return;
+    }
+    CONTEXT_->Evaluate(javascriptSource);
+  }
+
+  int EvaluateToInteger(const char *javascriptSource)
+  {
+    if (!IsStringValid(javascriptSource, MAX_JAVASCRIPT_SOURCE_LENGTH))
+    {
+      return -1;
+    }
+
+    int rv = 0;
+
+    // Create a new Isolate and make it the current one. The allocator is shared
+    // by every call, rather than made and thrown away each time.
+    static PooledArrayBufferAllocator evaluate_allocator(false);
+    Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = &evaluate_allocator;
+    Isolate *isolate = Isolate::New(create_params);
+    {
+      Locker locker(isolate);
+      Isolate::Scope isolate_scope(isolate);
+      // Create a stack-allocated handle scope.
+      HandleScope handle_scope(isolate);
+
+      Local<ObjectTemplate> global_template = ObjectTemplate::New(isolate);
+      SetupGlobalTemplate(isolate, global_template);
+
+      Local<Context> context = Context::New(isolate, 0, global_template);
+
+      // Enter the context for compiling and running the hello world script.
+      Context::Scope context_scope(context);
+
+      // Create a string containing the JavaScript source code.
+      Local<String> source =
+          String::NewFromUtf8(isolate, javascriptSource, NewStringType::kNormal).ToLocalChecked();
+      // Compile the source code.
+      Local<Script> script = Script::Compile(context, source).ToLocalChecked();
+      // Run the script to get the result.
+      Local<Value> result = script->Run(context).ToLocalChecked();
+      rv = result->Int32Value(context).FromJust();
+    }
+    // Dispose the isolate and tear down V8.
+    isolate->Dispose();
+
+    return rv;
+  }
+
+  int DeinitializeV8()
+  {
+    if (V8_GLOBAL_STATE.platform == nullptr)
+    {
+      std::cout << "WARNING: DeinitializeV8 called before InitializeV8 called. Doing nothing." << std::endl;
+      return 1;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(BRAIN_WORKER_POOL_MUTEX);
+      BRAIN_WORKER_POOL.reset();
+    }
+    BRAIN_WATCHDOG.Stop();
+    BRAIN_BY_UID.clear();
+    {
+      std::lock_guard<std::mutex> lock(SHARED_BRAIN_ISOLATES_MUTEX);
+      SHARED_BRAIN_ISOLATES.clear();
+    }
+    std::atomic_store(&BRAIN_SNAPSHOT, std::shared_ptr<BrainSnapshot>());
+#if V8_IN_UNITY_MODULE_CODE_CACHE
+    SCRATCH_ISOLATES.Clear();
+#endif
+
+    if (V8::Dispose())
+    {
+      V8::ShutdownPlatform();
+      delete V8_GLOBAL_STATE.platform;
+      V8_GLOBAL_STATE.platform = nullptr;
+      return 0;
+    }
+    else
+    {
+      return 1;
+    }
+  }
+
+  bool SetModule(CSHARP_STRING brainUid, CSHARP_STRING moduleUid, CSHARP_STRING javascript)
+  {
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->SetModule(moduleUid, javascript);
+  }
+
+  bool RemoveModule(CSHARP_STRING brainUid, CSHARP_STRING moduleUid)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(moduleUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->RemoveModule(moduleUid);
+  }
+
+  int RetainModules(CSHARP_STRING brainUid, int count, CSHARP_STRING moduleUids[])
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || count < 0 || (count > 0 && moduleUids == nullptr))
+    {
+      return 0;
+    }
+    std::set<std::string> module_uids;
+    for (int i = 0; i < count; i++)
+    {
+      if (!IsStringValid(moduleUids[i], MAX_GUID_LENGTH))
+      {
+        return 0;
+      }
+      module_uids.insert(moduleUids[i]);
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return 0;
+    }
+    return brain->RetainModules(module_uids);
+  }
+
+  long long CollectBrainGarbage(CSHARP_STRING brainUid)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return 0;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return 0;
+    }
+    return brain->CollectGarbage();
+  }
+
+  bool SetLazyModules(CSHARP_STRING brainUid, bool lazy)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->SetLazyModules(lazy);
+    return true;
+  }
+
+  bool SetBrainTimeBudget(CSHARP_STRING brainUid, double budgetMs)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (!(budgetMs >= 0))
+    {
+      std::ostringstream msg;
+      msg << "Invalid time budget: " << budgetMs << " ms";
+      LogError(msg);
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->SetTimeBudget(budgetMs);
+    return true;
+  }
+
+  bool SetBrainTaskBudget(CSHARP_STRING brainUid, double budgetMs)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (!(budgetMs >= 0))
+    {
+      std::ostringstream msg;
+      msg << "Invalid task budget: " << budgetMs << " ms";
+      LogError(msg);
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(BRAIN_BY_UID_MUTEX);
+      BRAIN_ISOLATE_OPTIONS[brainUid].task_budget_ms = budgetMs;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->SetTaskBudget(budgetMs);
+    return true;
+  }
+
+  bool GetBrainTaskStatistics(CSHARP_STRING brainUid, BrainTaskStatistics *statsOut)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (statsOut == nullptr)
+    {
+      LogError("GetBrainTaskStatistics: statsOut is null.");
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->GetTaskStatistics(statsOut);
+    return true;
+  }
+
+  int GetBrainMetrics(CSHARP_STRING brainUid, BrainMetric metricsOut[], int maxMetrics)
+  {
+#if V8_IN_UNITY_METRICS
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return -1;
+    }
+    if (metricsOut == nullptr || maxMetrics < 0)
+    {
+      LogError("GetBrainMetrics: invalid output array.");
+      return -1;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return -1;
+    }
+    return brain->GetMetrics(metricsOut, maxMetrics);
+#else
+    (void)brainUid;
+    (void)metricsOut;
+    (void)maxMetrics;
+    LogError("GetBrainMetrics: metrics were compiled out.");
+    return -1;
+#endif
+  }
+
+  bool ResetBrainMetrics(CSHARP_STRING brainUid)
+  {
+#if V8_IN_UNITY_METRICS
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->ResetMetrics();
+    return true;
+#else
+    (void)brainUid;
+    LogError("ResetBrainMetrics: metrics were compiled out.");
+    return false;
+#endif
+  }
+
+  bool StartBrainProfiling(CSHARP_STRING brainUid, int samplingIntervalUs)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (samplingIntervalUs <= 0)
+    {
+      std::ostringstream msg;
+      msg << "Invalid sampling interval: " << samplingIntervalUs << " us";
+      LogError(msg);
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->StartProfiling(samplingIntervalUs);
+  }
+
+  bool StopBrainProfiling(CSHARP_STRING brainUid, StringFunction reportProfileJson)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    std::ostringstream profile_json;
+    if (!brain->StopProfiling(profile_json))
+    {
+      return false;
+    }
+    if (reportProfileJson != nullptr)
+    {
+      reportProfileJson(profile_json.str().c_str());
+    }
+    return true;
+  }
+
+  bool StopBrainProfilingToFile(CSHARP_STRING brainUid, CSHARP_STRING path)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(path, MAX_FILEPATH_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+    {
+      std::ostringstream msg;
+      msg << "StopBrainProfilingToFile: could not open " << path;
+      LogError(msg);
+      // Stop anyway, so profiling doesn't go on unnoticed.
+      std::ostringstream discarded;
+      brain->StopProfiling(discarded);
+      return false;
+    }
+    return brain->StopProfiling(file) && file.good();
+  }
+
+  bool StartBrainTracing(int maxEvents)
+  {
+    if (maxEvents <= 0 || maxEvents > MAX_TRACE_EVENTS)
+    {
+      std::ostringstream err;
+      err << "StartBrainTracing: maxEvents must be from 1 to " << MAX_TRACE_EVENTS << ", not " << maxEvents;
+      LogError(err);
+      return false;
+    }
+    BRAIN_TRACER.Start(maxEvents);
+    return true;
+  }
+
+  void StopBrainTracing()
+  {
+    BRAIN_TRACER.Stop();
+  }
+
+  bool DumpBrainTrace(StringFunction reportTraceJson)
+  {
+    if (reportTraceJson == nullptr)
+    {
+      LogError("DumpBrainTrace: no report function.");
+      return false;
+    }
+    std::ostringstream json;
+    BRAIN_TRACER.WriteJson(json);
+    reportTraceJson(json.str().c_str());
+    return true;
+  }
+
+  bool DumpBrainTraceToFile(CSHARP_STRING path)
+  {
+    if (!IsStringValid(path, MAX_FILEPATH_LENGTH))
+    {
+      return false;
+    }
+    std::ofstream file(path);
+    if (!file)
+    {
+      std::ostringstream msg;
+      msg << "DumpBrainTraceToFile: could not open " << path;
+      LogError(msg);
+      return false;
+    }
+    BRAIN_TRACER.WriteJson(file);
+    return file.good();
+  }
+
+  bool StartModulesBatch(CSHARP_STRING brainUid, int count, CSHARP_STRING moduleUids[], CSHARP_STRING sources[])
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || count < 0 || (count > 0 && (moduleUids == nullptr || sources == nullptr)))
+    {
+      return false;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      if (!IsStringValid(moduleUids[i], MAX_GUID_LENGTH) || !IsStringValid(sources[i], MAX_JAVASCRIPT_SOURCE_LENGTH))
+      {
+        return false;
+      }
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->StartModulesBatch(count, moduleUids, sources);
+  }
+
+  int PollModulesBatch(CSHARP_STRING brainUid, double budgetMs, bool resultsOut[])
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return -1;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return -1;
+    }
+    return brain->PollModulesBatch(budgetMs, resultsOut);
+  }
+
+  int SetModulesBatch(CSHARP_STRING brainUid, int count, CSHARP_STRING moduleUids[], CSHARP_STRING sources[], bool resultsOut[])
+  {
+    if (!StartModulesBatch(brainUid, count, moduleUids, sources))
+    {
+      return 0;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return 0;
+    }
+    std::unique_ptr<bool[]> results(new bool[count]());
+    bool *results_ptr = resultsOut != nullptr ? resultsOut : results.get();
+    brain->PollModulesBatch(std::numeric_limits<double>::infinity(), results_ptr, true);
+    return (int)std::count(results_ptr, results_ptr + count, true);
+  }
+
+  bool GetModuleLoadStats(CSHARP_STRING brainUid, CSHARP_STRING moduleUid, ModuleLoadStats *statsOut)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(moduleUid, MAX_GUID_LENGTH) || statsOut == nullptr)
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->GetModuleLoadStats(moduleUid, statsOut);
+  }
+
+  bool ResetBrain(CSHARP_STRING brainUid, CSHARP_STRING javascript)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(javascript, MAX_JAVASCRIPT_SOURCE_LENGTH))
+    {
+      return false;
+    }
+    std::string brainKey(brainUid);
+    std::shared_ptr<BrainSnapshot> snapshot = std::atomic_load(&BRAIN_SNAPSHOT);
+    if (snapshot && snapshot->javascript != javascript)
+    {
+      snapshot.reset();
+    }
+    BrainIsolateOptions isolate_options;
+    double time_budget_ms = 0;
+    {
+      std::lock_guard<std::mutex> lock(BRAIN_BY_UID_MUTEX);
+      auto options_it = BRAIN_ISOLATE_OPTIONS.find(brainKey);
+      if (options_it != BRAIN_ISOLATE_OPTIONS.end())
+      {
+        isolate_options = options_it->second;
+      }
+      auto brain_it = BRAIN_BY_UID.find(brainKey);
+      if (brain_it != BRAIN_BY_UID.end() && brain_it->second)
+      {
+        time_budget_ms = brain_it->second->GetTimeBudget();
+      }
+    }
+    std::shared_ptr<VoosBrain> brain = std::make_shared<VoosBrain>(javascript, snapshot, isolate_options, time_budget_ms);
+    if (brain->valid)
+    {
+      std::shared_ptr<VoosBrain> old_brain;
+      {
+        std::lock_guard<std::mutex> lock(BRAIN_BY_UID_MUTEX);
+        std::shared_ptr<VoosBrain> &entry = BRAIN_BY_UID[brainKey];
+        if (entry)
+        {
+          brain->SetHostCallbacks(entry->GetHostCallbacks());
+          brain->SetResultBuffer(entry->GetResultBuffer(), entry->GetResultBufferCapacity());
+          brain->SetLazyModules(entry->GetLazyModules());
+          brain->SetGcPacing(entry->GetGcPacing());
+          brain->SetTaskBudget(entry->GetTaskBudget());
+          entry->CopyActorFieldTablesTo(brain.get());
+          if (entry->HasBinaryTickSchemas())
+          {
+            const BinarySchema &request_schema = entry->GetBinaryRequestSchema();
+            const BinarySchema &response_schema = entry->GetBinaryResponseSchema();
+            brain->SetBinaryTickSchemas(request_schema.spec.c_str(), request_schema.version, response_schema.spec.c_str(), response_schema.version);
+          }
+        }
+        old_brain = std::move(entry);
+        entry = std::move(brain);
+      }
+      // Released outside the lock, since it may need to wait on its isolate.
+      // Calls still using it on other threads keep it alive until they return.
+      old_brain.reset();
+      return true;
+    }
+    else
+    {
+      std::ostringstream msg;
+      msg << "Failed to reset brain with javascript:" << std::endl;
+      PrintWithLineNumbers(msg, javascript);
+      LogError(msg.str().c_str());
+      return false;
+    }
+  }
+
+  void SetSharedBrainIsolates(int poolSize)
+  {
+    // Brains keep whatever isolate they already have until they are reset.
+    std::vector<std::shared_ptr<BrainIsolate>> dropped;
+    {
+      std::lock_guard<std::mutex> lock(SHARED_BRAIN_ISOLATES_MUTEX);
+      SHARED_BRAIN_ISOLATE_POOL_SIZE = poolSize;
+      dropped.swap(SHARED_BRAIN_ISOLATES);
+    }
+  }
+
+  long long GetTotalBrainHeapSize()
+  {
+    // Holding the brains keeps their isolates alive.
+    std::vector<std::shared_ptr<VoosBrain>> brains;
+    std::vector<Isolate *> isolates;
+    {
+      std::lock_guard<std::mutex> lock(BRAIN_BY_UID_MUTEX);
+      for (const auto &entry : BRAIN_BY_UID)
+      {
+        brains.push_back(entry.second);
+        isolates.push_back(entry.second->GetIsolate());
+      }
+    }
+    std::sort(isolates.begin(), isolates.end());
+    isolates.erase(std::unique(isolates.begin(), isolates.end()), isolates.end());
+
+    long long total = 0;
+    for (Isolate *isolate : isolates)
+    {
+      Locker locker(isolate);
+      HeapStatistics stats;
+      isolate->GetHeapStatistics(&stats);
+      total += stats.total_heap_size() + stats.malloced_memory();
+    }
+    return total;
+  }
+
+  bool SetBrainHeapLimit(CSHARP_STRING brainUid, int maxHeapMb, int maxGrowths)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (maxHeapMb < 0 || maxGrowths < 0)
+    {
+      std::ostringstream msg;
+      msg << "Invalid heap limit of " << maxHeapMb << " MB with " << maxGrowths << " growths.";
+      LogError(msg);
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(BRAIN_BY_UID_MUTEX);
+    BrainIsolateOptions &options = BRAIN_ISOLATE_OPTIONS[brainUid];
+    options.max_heap_mb = maxHeapMb;
+    options.max_heap_growths = maxGrowths;
+    return true;
+  }
+
+  bool SetBrainArrayBufferAllocator(CSHARP_STRING brainUid, int allocator)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (allocator < BRAIN_ARRAY_BUFFERS_DEFAULT || allocator > BRAIN_ARRAY_BUFFERS_POOLED_HUGE_PAGES)
+    {
+      std::ostringstream msg;
+      msg << "Unknown ArrayBuffer allocator: " << allocator;
+      LogError(msg);
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(BRAIN_BY_UID_MUTEX);
+    BRAIN_ISOLATE_OPTIONS[brainUid].array_buffer_allocator = allocator;
+    return true;
+  }
+
+  bool GetBrainArrayBufferStatistics(CSHARP_STRING brainUid, BrainArrayBufferStatistics *statsOut)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (statsOut == nullptr)
+    {
+      LogError("GetBrainArrayBufferStatistics: statsOut is null.");
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    PooledArrayBufferAllocator *allocator = brain->GetPooledAllocator();
+    if (allocator == nullptr)
+    {
+      std::ostringstream msg;
+      msg << "Brain " << brainUid << " does not use a pooled ArrayBuffer allocator.";
+      LogError(msg);
+      return false;
+    }
+    *statsOut = allocator->GetStatistics();
+    return true;
+  }
+
+  bool GetBrainHeapStatistics(CSHARP_STRING brainUid, BrainHeapStatistics *statsOut)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (statsOut == nullptr)
+    {
+      LogError("GetBrainHeapStatistics: statsOut is null.");
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->GetHeapStatistics(statsOut);
+    return true;
+  }
+
+  int GetBrainHeapSpaceStatistics(CSHARP_STRING brainUid, BrainHeapSpaceStatistics spacesOut[], int maxSpaces)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return 0;
+    }
+    if (spacesOut == nullptr || maxSpaces < 0)
+    {
+      LogError("GetBrainHeapSpaceStatistics: invalid output array.");
+      return 0;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return 0;
+    }
+    return brain->GetHeapSpaceStatistics(spacesOut, maxSpaces);
+  }
+
+  bool IdleCollect(CSHARP_STRING brainUid, double budgetMs)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->IdleCollect(std::max(0.0, budgetMs));
+  }
+
+  bool SetGcPacing(CSHARP_STRING brainUid, bool enabled)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->SetGcPacing(enabled);
+    return true;
+  }
+
+  bool GetBrainGcStatistics(CSHARP_STRING brainUid, BrainGcStatistics *statsOut)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    if (statsOut == nullptr)
+    {
+      LogError("GetBrainGcStatistics: statsOut is null.");
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->GetGcStatistics(statsOut);
+    return true;
+  }
+
+  bool ResetBrainGcStatistics(CSHARP_STRING brainUid)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->ResetGcStatistics();
+    return true;
+  }
+
+  bool SetCodeCacheDirectory(const char *directory)
+  {
+    return CODE_CACHE.SetDirectory(directory);
+  }
+
+  void GetCodeCacheStats(int *hits, int *misses, int *rejections)
+  {
+    *hits = CODE_CACHE.hits;
+    *misses = CODE_CACHE.misses;
+    *rejections = CODE_CACHE.rejections;
+  }
+
+  void ResetCodeCacheStats()
+  {
+    CODE_CACHE.hits = 0;
+    CODE_CACHE.misses = 0;
+    CODE_CACHE.rejections = 0;
+  }
+
+  bool CreateBrainSnapshot(CSHARP_STRING javascript, int numModules, CSHARP_STRING moduleUids[], CSHARP_STRING moduleSources[])
+  {
+    if (!IsStringValid(javascript, MAX_JAVASCRIPT_SOURCE_LENGTH) || numModules < 0)
+    {
+      return false;
+    }
+
+    std::shared_ptr<BrainSnapshot> snapshot = VoosBrain::CreateSnapshot(javascript, numModules, moduleUids, moduleSources);
+    if (!snapshot)
+    {
+      LogError("Failed to create brain snapshot. Brains will be reset without one.");
+      return false;
+    }
+    std::atomic_store(&BRAIN_SNAPSHOT, snapshot);
+    return true;
   }
 
-  ~ReusableContext()
+  void ClearBrainSnapshot()
   {
-    reusableContext_.Reset();
-    isolate_->Dispose();
-    delete create_params.array_buffer_allocator;
+    // Brains already reset from the old snapshot keep their own reference to
+    // it; resets racing with this either get the old snapshot or none.
+    std::atomic_store(&BRAIN_SNAPSHOT, std::shared_ptr<BrainSnapshot>());
   }
 
-  // This should be waaaayyy faster than Context::New(...).
-  v8::Local<v8::Context> GetReusableContext()
+  BYTE_ARRAY DummyArray = {};
+
+  bool UpdateAgentJson(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING json_in, StringFunction report_result)
   {
-    return v8::Local<v8::Context>::New(isolate_, reusableContext_);
+    return UpdateAgentJsonBytes(brainUid, agentUid, json_in, DummyArray, 0, report_result);
   }
 
-  // Everything in this block is fairly cheap. Even doing it 100x doesn't affect timings much.
-  // Assumes the isolate has a context active.
-  void CompileAndRun(const char *javascriptSource)
+  bool UpdateAgentJsonBytes(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING json_in, BYTE_ARRAY bytes_in, int length_in, StringFunction report_result)
   {
-    Local<String> source =
-        String::NewFromUtf8(isolate_, javascriptSource, NewStringType::kNormal).ToLocalChecked();
-    // Compile the source code.
-    MaybeLocal<Script> compiled = Script::Compile(isolate_->GetCurrentContext(), source);
-    if (compiled.IsEmpty())
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(agentUid, MAX_GUID_LENGTH) || !IsStringValid(json_in, MAX_JSON_LENGTH))
     {
-      LogError("Could not compile! JS source:");
-      LogError(javascriptSource);
-      return;
+      return false;
     }
 
-    TryCatch try_catch(isolate_);
-    MaybeLocal<Value> result = compiled.ToLocalChecked()->Run(GetIsolate()->GetCurrentContext());
-    if (try_catch.HasCaught())
+    if (length_in > MAX_BUFFER_SIZE)
     {
-      LogError("Exception caught while running:");
-      String::Utf8Value message(GetIsolate(), try_catch.Message()->Get());
-      LogError(*message);
+      LogError("Buffer was too big. Doing nothing.");
+      return false;
     }
-  }
-
-private:
-  Isolate::CreateParams create_params;
-  Isolate *isolate_;
-  Global<Context> reusableContext_;
-};
 
-static ReusableContext *CONTEXT_ = nullptr;
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    TraceScope trace("update", "UpdateAgentJson", brainUid);
+    return brain->UpdateAgentJson(json_in, bytes_in, length_in, [report_result](const char *json) {
+      if (report_result)
+      {
+        report_result(json);
+      }
+    });
+  }
 
-extern "C"
-{
-  void TestSort(int a[], int length)
+  bool SetActorFieldTable(CSHARP_STRING brainUid, CSHARP_STRING name, BYTE_ARRAY data, int fieldType, int componentsPerActor, int numActors, BYTE_ARRAY dirtyOut)
   {
-    std::sort(a, a + length);
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(name, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->SetActorFieldTable(name, (char *)data, (ActorFieldType)fieldType, componentsPerActor, numActors, (uint8_t *)dirtyOut);
   }
 
-  void SetDebugLogFunction(StringFunction function)
+  bool BeginActorFieldFrame(CSHARP_STRING brainUid)
   {
-    HOST_DEBUG_LOG_FUNCTION = function;
-    // Log("Host debug log function set");
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->BeginActorFieldFrame();
+    return true;
   }
 
-  void SetErrorLogFunction(StringFunction function)
+  bool EndActorFieldFrame(CSHARP_STRING brainUid)
   {
-    HOST_ERROR_LOG_FUNCTION = function;
-    // Log("Host error log function set");
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return false;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->EndActorFieldFrame();
+    return true;
   }
 
-  int InitializeV8(const char *runtimeFilesDirectory)
+  bool RemoveActorFieldTable(CSHARP_STRING brainUid, CSHARP_STRING name)
   {
-    if (!IsStringValid(runtimeFilesDirectory, MAX_FILEPATH_LENGTH))
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(name, MAX_GUID_LENGTH))
     {
-      return 1;
+      return false;
     }
-    if (strnlen(runtimeFilesDirectory, MAX_FILEPATH_LENGTH))
-      std::cout << "Got runtime files dir of " << runtimeFilesDirectory << std::endl;
-    std::string exePath = std::string(runtimeFilesDirectory) + "/foo.exe";
-    return InitializeV8WithExecutablePath(exePath.c_str());
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->RemoveActorFieldTable(name);
   }
 
-  int InitializeV8WithExecutablePath(const char *executablePath)
+  bool SetResultBuffer(CSHARP_STRING brainUid, BYTE_ARRAY buffer, int capacity)
   {
-    if (!IsStringValid(executablePath, MAX_FILEPATH_LENGTH))
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
     {
-      return 1;
+      return false;
     }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    brain->SetResultBuffer((char *)buffer, capacity);
+    return true;
+  }
 
-    if (V8_GLOBAL_STATE.platform != nullptr)
+  int UpdateAgentJsonToBuffer(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING json_in, BYTE_ARRAY bytes_in, int length_in)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(agentUid, MAX_GUID_LENGTH) || !IsStringValid(json_in, MAX_JSON_LENGTH))
     {
-      std::cout << "WARNING: InitializeV8WithExecutablePath called, but platform was already initialized! Doing nothing." << std::endl;
-      return 1;
+      return 0;
     }
 
-    // Initialize V8.
-    V8::InitializeICUDefaultLocation(executablePath);
-    V8::InitializeExternalStartupData(executablePath);
-    V8_GLOBAL_STATE.platform = platform::CreateDefaultPlatform();
-    V8::InitializePlatform(V8_GLOBAL_STATE.platform);
-    if (V8::Initialize())
+    if (length_in > MAX_BUFFER_SIZE)
     {
-      CONTEXT_ = new ReusableContext();
+      LogError("Buffer was too big. Doing nothing.");
       return 0;
     }
-    else
+
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
     {
-      return 1;
+      LogUnknownBrain(brainUid);
+      return 0;
     }
+    TraceScope trace("update", "UpdateAgentJsonToBuffer", brainUid);
+    return brain->UpdateAgentJsonToBuffer(json_in, bytes_in != nullptr ? bytes_in : DummyArray, length_in);
   }
 
-  void Evaluate(const char *javascriptSource)
+  int TakePendingResult(CSHARP_STRING brainUid)
   {
-    if (!IsStringValid(javascriptSource, MAX_JAVASCRIPT_SOURCE_LENGTH))
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
     {
-      return;
+      return -1;
     }
-    CONTEXT_->Evaluate(javascriptSource);
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return -1;
+    }
+    return brain->TakePendingResult();
   }
 
-  int EvaluateToInteger(const char *javascriptSource)
+  bool UpdateAgentDelta(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING patchJson, BYTE_ARRAY bytesIn, int lengthIn, StringFunction reportPatchJson)
   {
-    if (!IsStringValid(javascriptSource, MAX_JAVASCRIPT_SOURCE_LENGTH))
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(agentUid, MAX_GUID_LENGTH) || !IsStringValid(patchJson, MAX_JSON_LENGTH))
     {
-      return -1;
+      return false;
     }
 
-    int rv = 0;
-
-    // Create a new Isolate and make it the current one.
-    Isolate::CreateParams create_params;
-    create_params.array_buffer_allocator =
-        v8::ArrayBuffer::Allocator::NewDefaultAllocator();
-    Isolate *isolate = Isolate::New(create_params);
+    if (lengthIn > MAX_BUFFER_SIZE)
     {
-      Isolate::Scope isolate_scope(isolate);
-      // Create a stack-allocated handle scope.
-      HandleScope handle_scope(isolate);
-
-      Local<ObjectTemplate> global_template = ObjectTemplate::New(isolate);
-      SetupGlobalTemplate(isolate, global_template);
-
-      Local<Context> context = Context::New(isolate, 0, global_template);
-
-      // Enter the context for compiling and running the hello world script.
-      Context::Scope context_scope(context);
-
-      // Create a string containing the JavaScript source code.
-      Local<String> source =
-          String::NewFromUtf8(isolate, javascriptSource, NewStringType::kNormal).ToLocalChecked();
-      // Compile the source code.
-      Local<Script> script = Script::Compile(context, source).ToLocalChecked();
-      // Run the script to get the result.
-      Local<Value> result = script->Run(context).ToLocalChecked();
-      rv = result->Int32Value(context).FromJust();
+      LogError("Buffer was too big. Doing nothing.");
+      return false;
     }
-    // Dispose the isolate and tear down V8.
-    isolate->Dispose();
-    delete create_params.array_buffer_allocator;
 
-    return rv;
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    TraceScope trace("update", "UpdateAgentDelta", brainUid);
+    return brain->UpdateAgentDelta(agentUid, patchJson, bytesIn != nullptr ? bytesIn : DummyArray, lengthIn, [reportPatchJson](const char *json) {
+      if (reportPatchJson)
+      {
+        reportPatchJson(json);
+      }
+    });
   }
 
-  int DeinitializeV8()
+  bool ForgetAgentState(CSHARP_STRING brainUid, CSHARP_STRING agentUid)
   {
-    if (V8_GLOBAL_STATE.platform == nullptr)
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(agentUid, MAX_GUID_LENGTH))
     {
-      std::cout << "WARNING: DeinitializeV8 called before InitializeV8 called. Doing nothing." << std::endl;
-      return 1;
+      return false;
     }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return false;
+    }
+    return brain->ForgetAgentState(agentUid);
+  }
 
-    BRAIN_BY_UID.clear();
-
-    if (V8::Dispose())
+  bool SetBrainHostCallbacks(CSHARP_STRING brainUid, const BrainHostCallbacks *callbacks)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || callbacks == nullptr)
     {
-      V8::ShutdownPlatform();
-      delete V8_GLOBAL_STATE.platform;
-      V8_GLOBAL_STATE.platform = nullptr;
-      return 0;
+      return false;
     }
-    else
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
     {
-      return 1;
+      LogUnknownBrain(brainUid);
+      return false;
     }
+    brain->SetHostCallbacks(*callbacks);
+    return true;
   }
 
-  bool SetModule(CSHARP_STRING brainUid, CSHARP_STRING moduleUid, CSHARP_STRING javascript)
+  bool RegisterTypedService(CSHARP_STRING serviceName, CSHARP_STRING argsSchema, CSHARP_STRING resultSchema, TypedServiceFunction function)
   {
-    std::string brainKey(brainUid);
-    if (BRAIN_BY_UID.find(brainKey) == BRAIN_BY_UID.end())
+    if (!IsStringValid(serviceName, MAX_SERVICE_NAME_LENGTH))
     {
-      std::ostringstream errs;
-      errs << "Unknown brain UID: " << brainUid;
-      LogError(errs.str().c_str());
       return false;
     }
-    else
+    if (function == nullptr)
+    {
+      return ChangeTypedServices([serviceName](TypedServiceMap *services) { return services->erase(serviceName) > 0; });
+    }
+    if (argsSchema == nullptr || resultSchema == nullptr)
+    {
+      return false;
+    }
+    // Empty schemas are fine, for services with no args or no results.
+    if ((argsSchema[0] != '\0' && !IsStringValid(argsSchema, MAX_JSON_LENGTH)) ||
+        (resultSchema[0] != '\0' && !IsStringValid(resultSchema, MAX_JSON_LENGTH)))
+    {
+      return false;
+    }
+
+    std::shared_ptr<TypedService> service = std::make_shared<TypedService>();
+    service->name = serviceName;
+    service->function = function;
+    if (!service->args_schema.Parse(argsSchema, 0) || !service->result_schema.Parse(resultSchema, 0))
     {
-      VoosBrain &brain = *BRAIN_BY_UID[brainKey];
-      return brain.SetModule(moduleUid, javascript);
+      return false;
     }
+    return ChangeTypedServices([serviceName, &service](TypedServiceMap *services) {
+      (*services)[serviceName] = service;
+      return true;
+    });
   }
 
-  bool ResetBrain(CSHARP_STRING brainUid, CSHARP_STRING javascript)
+  bool SetBinaryTickSchemas(CSHARP_STRING brainUid, CSHARP_STRING requestSchema, int requestVersion, CSHARP_STRING responseSchema, int responseVersion)
   {
-    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(javascript, MAX_JAVASCRIPT_SOURCE_LENGTH))
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || requestSchema == nullptr || responseSchema == nullptr)
     {
       return false;
     }
-    std::string brainKey(brainUid);
-    std::unique_ptr<VoosBrain> brain = std::make_unique<VoosBrain>(javascript);
-    if (brain->valid)
+    // Empty schemas are fine, for ticks with no inputs or no outputs.
+    if ((requestSchema[0] != '\0' && !IsStringValid(requestSchema, MAX_JSON_LENGTH)) ||
+        (responseSchema[0] != '\0' && !IsStringValid(responseSchema, MAX_JSON_LENGTH)))
     {
-      BRAIN_BY_UID[brainKey] = std::move(brain);
-      return true;
+      return false;
     }
-    else
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
     {
-      std::ostringstream msg;
-      msg << "Failed to reset brain with javascript:" << std::endl;
-      PrintWithLineNumbers(msg, javascript);
-      LogError(msg.str().c_str());
+      LogUnknownBrain(brainUid);
       return false;
     }
+    return brain->SetBinaryTickSchemas(requestSchema, (uint32_t)requestVersion, responseSchema, (uint32_t)responseVersion);
   }
 
-  BYTE_ARRAY DummyArray = {};
+  int UpdateAgentBinary(CSHARP_STRING brainUid, CSHARP_STRING agentUid, BYTE_ARRAY request, int requestLength, BYTE_ARRAY bytesIn, int lengthIn, BYTE_ARRAY response, int responseCapacity)
+  {
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(agentUid, MAX_GUID_LENGTH))
+    {
+      return 0;
+    }
+    if (request == nullptr || requestLength < 0 || requestLength > MAX_BUFFER_SIZE || lengthIn > MAX_BUFFER_SIZE)
+    {
+      LogError("Bad binary request buffer. Doing nothing.");
+      return 0;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return 0;
+    }
+    TraceScope trace("update", "UpdateAgentBinary", brainUid);
+    return brain->UpdateAgentBinary((const char *)request, requestLength, bytesIn, lengthIn, (char *)response, responseCapacity);
+  }
 
-  bool UpdateAgentJson(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING json_in, StringFunction report_result)
+  int TakeBinaryResponse(CSHARP_STRING brainUid, BYTE_ARRAY response, int responseCapacity)
   {
-    return UpdateAgentJsonBytes(brainUid, agentUid, json_in, DummyArray, 0, report_result);
+    if (!IsStringValid(brainUid, MAX_GUID_LENGTH))
+    {
+      return 0;
+    }
+    std::shared_ptr<VoosBrain> brain = FindBrain(brainUid);
+    if (brain == nullptr)
+    {
+      LogUnknownBrain(brainUid);
+      return 0;
+    }
+    return brain->TakeBinaryResponse((char *)response, responseCapacity);
   }
 
-  bool UpdateAgentJsonBytes(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING json_in, BYTE_ARRAY bytes_in, int length_in, StringFunction report_result)
+  void SetBrainWorkerThreads(int numThreads)
   {
-    if (!IsStringValid(brainUid, MAX_GUID_LENGTH) || !IsStringValid(agentUid, MAX_GUID_LENGTH) || !IsStringValid(json_in, MAX_JSON_LENGTH))
+    if (numThreads <= 0)
     {
-      return false;
+      numThreads = std::max(1, (int)std::thread::hardware_concurrency());
     }
+    std::shared_ptr<BrainWorkerPool> pool = std::make_shared<BrainWorkerPool>(numThreads);
+    std::lock_guard<std::mutex> lock(BRAIN_WORKER_POOL_MUTEX);
+    BRAIN_WORKER_POOL = pool;
+  }
 
-    if (length_in > MAX_BUFFER_SIZE)
+  int UpdateAgentsJsonParallel(int count, CSHARP_STRING brainUids[], CSHARP_STRING agentUids[], CSHARP_STRING jsonIns[],
+                               BYTE_ARRAY bytesIns[], int lengthsIn[], IndexedStringFunction reportResult, bool resultsOut[])
+  {
+    if (count <= 0)
     {
-      LogError("Buffer was too big. Doing nothing.");
-      return false;
+      return 0;
+    }
+    std::shared_ptr<BrainWorkerPool> pool;
+    {
+      std::lock_guard<std::mutex> lock(BRAIN_WORKER_POOL_MUTEX);
+      if (!BRAIN_WORKER_POOL)
+      {
+        BRAIN_WORKER_POOL = std::make_shared<BrainWorkerPool>(std::max(1, (int)std::thread::hardware_concurrency()));
+      }
+      pool = BRAIN_WORKER_POOL;
     }
 
-    std::string brainKey(brainUid);
-    if (BRAIN_BY_UID.find(brainKey) == BRAIN_BY_UID.end())
+    // Look up everything first, so workers never touch the brain map.
+    std::vector<std::shared_ptr<VoosBrain>> brains(count);
+    for (int i = 0; i < count; i++)
     {
-      std::ostringstream errs;
-      errs << "Unknown brain UID: " << brainUid;
-      LogError(errs.str().c_str());
-      return false;
+      resultsOut[i] = false;
+      if (!IsStringValid(brainUids[i], MAX_GUID_LENGTH) || !IsStringValid(agentUids[i], MAX_GUID_LENGTH) || !IsStringValid(jsonIns[i], MAX_JSON_LENGTH))
+      {
+        continue;
+      }
+      if (lengthsIn != nullptr && lengthsIn[i] > MAX_BUFFER_SIZE)
+      {
+        LogError("Buffer was too big. Doing nothing.");
+        continue;
+      }
+      brains[i] = FindBrain(brainUids[i]);
+      if (brains[i] == nullptr)
+      {
+        LogUnknownBrain(brainUids[i]);
+      }
     }
-    else
+
+    pool->Run(count, [&](int i) {
+      if (brains[i] == nullptr)
+      {
+        return;
+      }
+      BYTE_ARRAY bytes = bytesIns != nullptr ? bytesIns[i] : DummyArray;
+      int length = lengthsIn != nullptr ? lengthsIn[i] : 0;
+      TraceScope trace("update", "UpdateAgentJson", brainUids[i]);
+      resultsOut[i] = brains[i]->UpdateAgentJson(jsonIns[i], bytes, length, [reportResult, i](const char *json) {
+        if (reportResult)
+        {
+          reportResult(i, json);
+        }
+      });
+    });
+
+    int numSucceeded = 0;
+    for (int i = 0; i < count; i++)
     {
-      VoosBrain &brain = *BRAIN_BY_UID[brainKey];
-      return brain.UpdateAgentJson(json_in, bytes_in, length_in, report_result);
+      numSucceeded += resultsOut[i] ? 1 : 0;
     }
+    return numSucceeded;
   }
 
   void SetLookupIntFunction(LookupIntFunction function)
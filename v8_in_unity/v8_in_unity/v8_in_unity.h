@@ -48,8 +48,289 @@ extern "C"
   // We are purposefully using int instead of size_t for length_in.
   V8_IN_UNITY_DLLEXPORT bool UpdateAgentJsonBytes(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING json_in, BYTE_ARRAY bytes_in, int length_in, StringFunction report_result);
 
+  // Results without copies. The host registers a buffer per brain once (kept
+  // across ResetBrain), and UpdateAgentJsonToBuffer writes the UTF-8 result
+  // into it, unterminated. Returns the result size, or 0 on failure. If the
+  // result does not fit, returns minus the size it needs. The host can then
+  // register a bigger buffer and call TakePendingResult to get it without
+  // ticking again. TakePendingResult returns the size or minus the needed size
+  // the same way, but -1 on failure, such as no pending result or an unknown
+  // brain.
+  V8_IN_UNITY_DLLEXPORT bool SetResultBuffer(CSHARP_STRING brainUid, BYTE_ARRAY buffer, int capacity);
+  V8_IN_UNITY_DLLEXPORT int UpdateAgentJsonToBuffer(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING json_in, BYTE_ARRAY bytes_in, int length_in);
+  V8_IN_UNITY_DLLEXPORT int TakePendingResult(CSHARP_STRING brainUid);
+
+  // Binary alternative to the JSON state. Schemas are comma-separated
+  // name:type lists, like "hp:f32,alive:bool,name:str,pos:vec3", with types
+  // bool, i32, f32, f64, str (uint32 length + UTF-8), vec3, quat and f32[]
+  // (uint32 count + floats). Requests and responses are a uint32 magic
+  // (0x534F4F56), a uint32 schema version, and then each field in order,
+  // unpadded and in native byte order. Either schema may be empty, for ticks
+  // with no inputs or no outputs. Schemas are kept across ResetBrain.
+  V8_IN_UNITY_DLLEXPORT bool SetBinaryTickSchemas(CSHARP_STRING brainUid, CSHARP_STRING requestSchema, int requestVersion, CSHARP_STRING responseSchema, int responseVersion);
+
+  // Returns the response size, or 0 on failure. If the response does not fit,
+  // returns minus the size it needs, and TakeBinaryResponse can fetch it
+  // without ticking again. A null response means the registered result buffer.
+  V8_IN_UNITY_DLLEXPORT int UpdateAgentBinary(CSHARP_STRING brainUid, CSHARP_STRING agentUid, BYTE_ARRAY request, int requestLength, BYTE_ARRAY bytesIn, int lengthIn, BYTE_ARRAY response, int responseCapacity);
+  V8_IN_UNITY_DLLEXPORT int TakeBinaryResponse(CSHARP_STRING brainUid, BYTE_ARRAY response, int responseCapacity);
+
+  // Persistent agent state. The brain keeps a state object per agent UID
+  // across calls. The host sends a JSON merge patch (RFC 7386) of what changed
+  // and gets back a merge patch of the top-level fields JS touched. States
+  // start out empty, and are dropped by ResetBrain.
+  V8_IN_UNITY_DLLEXPORT bool UpdateAgentDelta(CSHARP_STRING brainUid, CSHARP_STRING agentUid, CSHARP_STRING patchJson, BYTE_ARRAY bytesIn, int lengthIn, StringFunction reportPatchJson);
+  V8_IN_UNITY_DLLEXPORT bool ForgetAgentState(CSHARP_STRING brainUid, CSHARP_STRING agentUid);
+
+  // Modules can import modules set before them, by module UID. Setting a
+  // module again with the same source does nothing. Otherwise the modules that
+  // import it, directly or not, are loaded again too, so they see the new
+  // version. Errors in those are logged, and they keep their old version.
   V8_IN_UNITY_DLLEXPORT bool SetModule(CSHARP_STRING brainUid, CSHARP_STRING moduleUid, CSHARP_STRING javascript);
 
+  // Sets many modules at once, like calling SetModule for each in order, and
+  // returns how many succeeded. resultsOut may be null. With V8 6.9 or later,
+  // and more than one core, modules not in the code cache yet are compiled on
+  // background threads first, so the brain only deserializes them. Otherwise
+  // batches just set the modules on the calling thread.
+  V8_IN_UNITY_DLLEXPORT int SetModulesBatch(CSHARP_STRING brainUid, int count, CSHARP_STRING moduleUids[], CSHARP_STRING sources[], bool resultsOut[]);
+  // The same, without blocking. StartModulesBatch copies the modules and
+  // returns right away. Each PollModulesBatch call then sets the modules
+  // compiled so far, in order, for up to budgetMs (but at least one if
+  // possible), fills resultsOut (count entries) for the modules set so far,
+  // and returns how many are left. The batch is done once that is 0. Returns
+  // -1 if there is no batch. Only one batch per brain at a time.
+  V8_IN_UNITY_DLLEXPORT bool StartModulesBatch(CSHARP_STRING brainUid, int count, CSHARP_STRING moduleUids[], CSHARP_STRING sources[]);
+  V8_IN_UNITY_DLLEXPORT int PollModulesBatch(CSHARP_STRING brainUid, double budgetMs, bool resultsOut[]);
+
+  // Removing a module releases the brain's references to it. Modules that
+  // import it keep their own, lazy ones included: those not instantiated yet
+  // are instantiated first. RetainModules removes every module not listed,
+  // and returns how many it removed. Both start an incremental garbage
+  // collection to get the memory back. CollectBrainGarbage instead blocks
+  // until a full collection is done, and returns the heap bytes it freed.
+  V8_IN_UNITY_DLLEXPORT bool RemoveModule(CSHARP_STRING brainUid, CSHARP_STRING moduleUid);
+  V8_IN_UNITY_DLLEXPORT int RetainModules(CSHARP_STRING brainUid, int count, CSHARP_STRING moduleUids[]);
+  V8_IN_UNITY_DLLEXPORT long long CollectBrainGarbage(CSHARP_STRING brainUid);
+
+  // Lazy modules are only compiled by SetModule. They are instantiated and
+  // evaluated, along with whatever they import, the first time getVoosModule
+  // asks for one of them, and errors are logged then. Off by default. Kept
+  // across ResetBrain.
+  V8_IN_UNITY_DLLEXPORT bool SetLazyModules(CSHARP_STRING brainUid, bool lazy);
+
+  // Ticks that run longer than budgetMs, say because of an infinite loop, are
+  // terminated and fail with a timeout error. The brain keeps its state, so the
+  // next tick runs as usual. The budget also holds SetModule, for the module
+  // and the modules reloaded with it, and ResetBrain, for the new brain JS.
+  // Those fail the same way. 0 turns the budget off. Kept across ResetBrain.
+  V8_IN_UNITY_DLLEXPORT bool SetBrainTimeBudget(CSHARP_STRING brainUid, double budgetMs);
+
+  // By default, each tick runs every promise job, platform task and async
+  // service round it leads to before returning. With a task budget, microtasks
+  // only run at explicit checkpoints, and once budgetMs is spent after
+  // updateAgent returns, the rest waits for the next tick. Each tick still makes
+  // some progress. 0 goes back to the default. Kept across ResetBrain. The
+  // microtask queue belongs to the isolate, so like a heap limit, a budget
+  // gives the brain an isolate of its own from its next reset on. Until then,
+  // a brain in a shared isolate runs as if it had no budget.
+  V8_IN_UNITY_DLLEXPORT bool SetBrainTaskBudget(CSHARP_STRING brainUid, double budgetMs);
+
+  struct BrainTaskStatistics
+  {
+    // Left for later ticks: service results still to be settled, service calls
+    // still to be sent, and 1 more if a microtask checkpoint was put off.
+    int deferredTasks;
+    int deferredServiceResults;
+    int deferredServiceCalls;
+    // During the last tick.
+    int microtaskCheckpoints;
+    int platformTasks;
+    double taskMs;
+  };
+  V8_IN_UNITY_DLLEXPORT bool GetBrainTaskStatistics(CSHARP_STRING brainUid, BrainTaskStatistics *statsOut);
+
+  // Sampling CPU profiles. Only the thread that starts profiling is sampled, so
+  // start it on the thread that ticks the brain. Brains sharing an isolate are
+  // profiled together, and only one of them can profile at a time.
+  V8_IN_UNITY_DLLEXPORT bool StartBrainProfiling(CSHARP_STRING brainUid, int samplingIntervalUs);
+  // Reports the profile as Chrome DevTools .cpuprofile JSON. Functions defined
+  // in modules have the module UIDs as their URLs.
+  V8_IN_UNITY_DLLEXPORT bool StopBrainProfiling(CSHARP_STRING brainUid, StringFunction reportProfileJson);
+  V8_IN_UNITY_DLLEXPORT bool StopBrainProfilingToFile(CSHARP_STRING brainUid, CSHARP_STRING path);
+
+  // Records the phases of each UpdateAgent call, service calls and GC pauses
+  // of every brain into a ring of the latest maxEvents spans. Starting again
+  // clears the ring, and stopping keeps it for dumping.
+  V8_IN_UNITY_DLLEXPORT bool StartBrainTracing(int maxEvents);
+  V8_IN_UNITY_DLLEXPORT void StopBrainTracing();
+  // Reports the ring as Chrome trace-event JSON, which Perfetto also reads.
+  // Timestamps are microseconds since tracing started.
+  V8_IN_UNITY_DLLEXPORT bool DumpBrainTrace(StringFunction reportTraceJson);
+  V8_IN_UNITY_DLLEXPORT bool DumpBrainTraceToFile(CSHARP_STRING path);
+
+  // Calls from brain JS into native bindings, and from brains to host services,
+  // counted with their latencies. Bucket i counts calls that took from 2^i ns
+  // up to 2^(i+1) ns. Bucket 0 also counts 0 ns, the last bucket anything longer.
+  // Define V8_IN_UNITY_METRICS as 0 to compile the counting out.
+#ifndef V8_IN_UNITY_METRICS
+#define V8_IN_UNITY_METRICS 1
+#endif
+#define V8_IN_UNITY_METRICS_BUCKETS 32
+#define V8_IN_UNITY_METRICS_NAME_LENGTH 128
+  enum BrainMetricKind
+  {
+    BRAIN_METRIC_BINDING = 0,
+    BRAIN_METRIC_SERVICE = 1,
+  };
+  struct BrainMetric
+  {
+    char name[V8_IN_UNITY_METRICS_NAME_LENGTH];
+    int kind;
+    long long count;
+    long long totalNs;
+    long long maxNs;
+    long long buckets[V8_IN_UNITY_METRICS_BUCKETS];
+  };
+  // Writes up to maxMetrics metrics that have been called since the last
+  // reset, bindings first. Returns how many were written, or -1 if the brain is
+  // unknown or metrics were compiled out with V8_IN_UNITY_METRICS=0.
+  V8_IN_UNITY_DLLEXPORT int GetBrainMetrics(CSHARP_STRING brainUid, BrainMetric metricsOut[], int maxMetrics);
+  V8_IN_UNITY_DLLEXPORT bool ResetBrainMetrics(CSHARP_STRING brainUid);
+
+  // Timings are for the module's latest load, in milliseconds. For lazy
+  // modules, instantiating and evaluating happen on first use. Loads counts
+  // loads caused by the module's own source changing, and dependencyReloads
+  // those caused by a module it imports changing.
+  struct ModuleLoadStats
+  {
+    double compileMs;
+    double instantiateMs;
+    double evaluateMs;
+    int loads;
+    int dependencyReloads;
+    int skippedReloads;
+  };
+  V8_IN_UNITY_DLLEXPORT bool GetModuleLoadStats(CSHARP_STRING brainUid, CSHARP_STRING moduleUid, ModuleLoadStats *statsOut);
+
+  // By default every brain has its own isolate. With a pool size > 0, brains
+  // reset afterwards create their contexts in one of that many shared
+  // isolates instead, which saves a heap per brain. 0 goes back to the
+  // default. Existing brains are not moved.
+  V8_IN_UNITY_DLLEXPORT void SetSharedBrainIsolates(int poolSize);
+  // Sum over all isolates used by brains, in bytes.
+  V8_IN_UNITY_DLLEXPORT long long GetTotalBrainHeapSize();
+
+  // Heap limits, taking effect the next time the brain is reset. A brain with
+  // a limit always gets an isolate of its own, with an old generation of at
+  // most maxHeapMb megabytes. 0 goes back to V8's default. Near the limit, it
+  // grows by half, up to maxGrowths times. After that, the running script is
+  // terminated and the call fails, instead of V8 aborting the process, and the
+  // limit goes back to where it started.
+  V8_IN_UNITY_DLLEXPORT bool SetBrainHeapLimit(CSHARP_STRING brainUid, int maxHeapMb, int maxGrowths);
+
+  // Cheap enough to call every frame. With shared isolates, these cover every
+  // brain in the isolate. Sizes are in bytes.
+  struct BrainHeapStatistics
+  {
+    long long totalHeapSize;
+    long long usedHeapSize;
+    long long heapSizeLimit;
+    long long mallocedMemory;
+    long long externalMemory;
+    int nearHeapLimitCount;
+    int heapLimitTerminations;
+  };
+  V8_IN_UNITY_DLLEXPORT bool GetBrainHeapStatistics(CSHARP_STRING brainUid, BrainHeapStatistics *statsOut);
+
+  struct BrainHeapSpaceStatistics
+  {
+    const char *name; // Owned by V8, and valid for as long as the process.
+    long long spaceSize;
+    long long usedSize;
+    long long availableSize;
+    long long physicalSize;
+  };
+  // Returns the number of spaces written, at most maxSpaces.
+  V8_IN_UNITY_DLLEXPORT int GetBrainHeapSpaceStatistics(CSHARP_STRING brainUid, BrainHeapSpaceStatistics spacesOut[], int maxSpaces);
+
+  // Gives V8 up to budgetMs of the frame's spare time for garbage collection:
+  // the idle tasks V8 scheduled, like scavenges ahead of a full young
+  // generation, then incremental marking steps. Never a blocking full
+  // collection. Returns true once there is nothing left worth doing, so the
+  // host can stop calling it for this frame. Also false for unknown brains.
+  V8_IN_UNITY_DLLEXPORT bool IdleCollect(CSHARP_STRING brainUid, double budgetMs);
+
+  // With GC pacing on, the brain tracks how much each tick allocates, and
+  // IdleCollect does not report done while the next ticks would fill the
+  // young generation. Kept across ResetBrain.
+  V8_IN_UNITY_DLLEXPORT bool SetGcPacing(CSHARP_STRING brainUid, bool enabled);
+
+  // GC pauses, by where they landed. Like the heap statistics, these cover
+  // every brain in the isolate.
+  struct BrainGcStatistics
+  {
+    int pausesInUpdate;
+    double pauseMsInUpdate;
+    double maxPauseMsInUpdate;
+    int pausesInIdle;
+    double pauseMsInIdle;
+    int otherPauses;
+    double otherPauseMs;
+    // Only tracked with GC pacing on.
+    double allocatedBytesPerTick;
+  };
+  V8_IN_UNITY_DLLEXPORT bool GetBrainGcStatistics(CSHARP_STRING brainUid, BrainGcStatistics *statsOut);
+  V8_IN_UNITY_DLLEXPORT bool ResetBrainGcStatistics(CSHARP_STRING brainUid);
+
+  // Where a brain's ArrayBuffers get their memory. Like heap limits, this
+  // takes effect the next time the brain is reset, and a brain with a pooled
+  // allocator gets an isolate of its own. The pooled allocator bumps small
+  // buffers out of an arena that is reused from tick to tick, and keeps free
+  // lists of medium ones. Huge pages are only used on Linux, and only for
+  // large buffers.
+  enum BrainArrayBufferAllocator
+  {
+    BRAIN_ARRAY_BUFFERS_DEFAULT = 0,
+    BRAIN_ARRAY_BUFFERS_POOLED = 1,
+    BRAIN_ARRAY_BUFFERS_POOLED_HUGE_PAGES = 2,
+  };
+  V8_IN_UNITY_DLLEXPORT bool SetBrainArrayBufferAllocator(CSHARP_STRING brainUid, int allocator);
+
+  // Only for brains with a pooled allocator. Sizes are in bytes.
+  struct BrainArrayBufferStatistics
+  {
+    long long liveBytes;
+    long long peakLiveBytes;
+    // Held by the arena, whether in use or not.
+    long long arenaBytes;
+    // Held in free lists.
+    long long pooledBytes;
+    long long hugePageBytes;
+    long long allocations;
+    long long arenaAllocations;
+    // Served from a free list.
+    long long pooledAllocations;
+    long long hugePageAllocations;
+  };
+  V8_IN_UNITY_DLLEXPORT bool GetBrainArrayBufferStatistics(CSHARP_STRING brainUid, BrainArrayBufferStatistics *statsOut);
+
+  // Bytecode cache for brain JS and modules, stored on disk and keyed by a
+  // hash of the source. Pass null or an empty string to disable (default).
+  // Entries are written on a miss, and refreshed after the first update.
+  V8_IN_UNITY_DLLEXPORT bool SetCodeCacheDirectory(const char *directory);
+  V8_IN_UNITY_DLLEXPORT void GetCodeCacheStats(int *hits, int *misses, int *rejections);
+  V8_IN_UNITY_DLLEXPORT void ResetCodeCacheStats();
+
+  // Startup snapshots. Runs the brain JS once and serializes the resulting
+  // heap. Later ResetBrain calls with the exact same brain JS deserialize it
+  // instead, and set the given modules right away. V8 cannot serialize module
+  // records, so those modules are still evaluated per brain. The brain JS must
+  // not create ArrayBuffers at the top level, since those cannot be
+  // serialized. Only one snapshot is kept at a time.
+  V8_IN_UNITY_DLLEXPORT bool CreateBrainSnapshot(CSHARP_STRING javascript, int numModules, CSHARP_STRING moduleUids[], CSHARP_STRING moduleSources[]);
+  V8_IN_UNITY_DLLEXPORT void ClearBrainSnapshot();
+
   // Performance tests.
   typedef int (*LookupIntFunction)(int index);
   V8_IN_UNITY_DLLEXPORT void SetLookupIntFunction(LookupIntFunction function);
@@ -60,6 +341,31 @@ extern "C"
 
   V8_IN_UNITY_DLLEXPORT void SetCallServiceFunction(CallServiceFunction callService);
 
+  // JS's callVoosServiceAsync(name, args) returns a promise instead. Requests
+  // are queued and sent to the host all at once after updateAgent (and any
+  // promise jobs) returned, before postMessageFlush. The host reports each
+  // result with its index in the batch, before returning. Requests made by the
+  // promise jobs of a batch go out in a follow-up batch in the same tick. If
+  // no batch function is set, the call-service-function is called once per
+  // request instead. If the tick fails, requests not yet sent or settled are
+  // rejected at the end of it, instead of carrying over to the next tick.
+  typedef void (*ReportIndexedServiceResultFunction)(int index, CSHARP_STRING resultJson);
+  typedef void (*CallServicesBatchFunction)(int count, const char *serviceNames[], const char *argsJsons[], ReportIndexedServiceResultFunction reportFunction);
+  V8_IN_UNITY_DLLEXPORT void SetCallServicesBatchFunction(CallServicesBatchFunction callServicesBatch);
+
+  // Typed services skip JSON. The host declares a service's argument and
+  // result layouts as binary schema specs (see SetBinaryTickSchemas), and
+  // callVoosService(name, args) for that service then packs args' fields into
+  // the argument layout, with no header, and unpacks the result into an
+  // object. If every field is numeric (bool, i32, f32, f64, vec3, quat), args
+  // can also be an array or typed array with all the components in order, and
+  // a Float32Array passed as a third argument gets the result components
+  // instead of a new object. The function returns the result size, without
+  // writing anything if that is more than resultCapacity, or -1 on failure.
+  // A null function removes the service. Other services keep using JSON.
+  typedef int (*TypedServiceFunction)(const char *serviceName, const char *args, int argsLength, char *result, int resultCapacity);
+  V8_IN_UNITY_DLLEXPORT bool RegisterTypedService(CSHARP_STRING serviceName, CSHARP_STRING argsSchema, CSHARP_STRING resultSchema, TypedServiceFunction function);
+
   // Synchronous actor API.
 
   // These IDs are only guaranteed to be valid within a single UpdateAgent call.
@@ -88,4 +394,90 @@ extern "C"
   V8_IN_UNITY_DLLEXPORT void SetActorStringSetter(ActorStringSetter f);
   V8_IN_UNITY_DLLEXPORT void SetActorFloatGetter(ActorFloatGetter f);
   V8_IN_UNITY_DLLEXPORT void SetActorFloatSetter(ActorFloatSetter f);
+
+  // Batch actor API, for JS's get/setActor*Batch(actorIds, fieldId, values).
+  // Values are packed per actor: 3 floats for vectors, 4 for quaternions, and
+  // one byte (0 or 1) for booleans. If a batch callback is not set, the
+  // single-actor callback is called once per actor instead.
+  typedef void (*ActorVector3BatchGetter)(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, float *xyz_out);
+  typedef void (*ActorVector3BatchSetter)(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, const float *xyz);
+  typedef void (*ActorQuaternionBatchGetter)(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, float *xyzw_out);
+  typedef void (*ActorQuaternionBatchSetter)(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, const float *xyzw);
+  typedef void (*ActorBooleanBatchGetter)(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, unsigned char *values_out);
+  typedef void (*ActorBooleanBatchSetter)(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, const unsigned char *values);
+  typedef void (*ActorFloatBatchGetter)(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, float *values_out);
+  typedef void (*ActorFloatBatchSetter)(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, const float *values);
+
+  V8_IN_UNITY_DLLEXPORT void SetActorVector3BatchGetter(ActorVector3BatchGetter f);
+  V8_IN_UNITY_DLLEXPORT void SetActorVector3BatchSetter(ActorVector3BatchSetter f);
+  V8_IN_UNITY_DLLEXPORT void SetActorQuaternionBatchGetter(ActorQuaternionBatchGetter f);
+  V8_IN_UNITY_DLLEXPORT void SetActorQuaternionBatchSetter(ActorQuaternionBatchSetter f);
+  V8_IN_UNITY_DLLEXPORT void SetActorBooleanBatchGetter(ActorBooleanBatchGetter f);
+  V8_IN_UNITY_DLLEXPORT void SetActorBooleanBatchSetter(ActorBooleanBatchSetter f);
+  V8_IN_UNITY_DLLEXPORT void SetActorFloatBatchGetter(ActorFloatBatchGetter f);
+  V8_IN_UNITY_DLLEXPORT void SetActorFloatBatchSetter(ActorFloatBatchSetter f);
+
+  // Shared-memory actor fields. The host registers a block holding one field
+  // for every actor, like positions as 3 floats per actor, and JS sees it as
+  // actorFields[name], a typed array over the same memory. The memory must
+  // stay valid until it is replaced or removed, or the brain goes away.
+  // Registering the same block again every tick is cheap, and keeps JS's view.
+  // If dirtyOut is given (one byte per actor), entries are set to 1 for actors
+  // whose values changed between BeginActorFieldFrame and EndActorFieldFrame,
+  // so bracket all of a frame's ticks of the brain with them. Host writes in
+  // between count too. The host clears the flags. Tables are kept across
+  // ResetBrain.
+  enum ActorFieldType
+  {
+    ACTOR_FIELD_FLOAT32 = 0, // Float32Array
+    ACTOR_FIELD_INT32 = 1,   // Int32Array
+    ACTOR_FIELD_UINT8 = 2,   // Uint8Array
+  };
+  V8_IN_UNITY_DLLEXPORT bool SetActorFieldTable(CSHARP_STRING brainUid, CSHARP_STRING name, BYTE_ARRAY data, int fieldType, int componentsPerActor, int numActors, BYTE_ARRAY dirtyOut);
+  V8_IN_UNITY_DLLEXPORT bool RemoveActorFieldTable(CSHARP_STRING brainUid, CSHARP_STRING name);
+  V8_IN_UNITY_DLLEXPORT bool BeginActorFieldFrame(CSHARP_STRING brainUid);
+  V8_IN_UNITY_DLLEXPORT bool EndActorFieldFrame(CSHARP_STRING brainUid);
+
+  // Parallel updates. Brains can tick concurrently on a pool of worker
+  // threads, each brain holding its isolate's lock. Host callbacks used by
+  // such brains must be thread-safe, or be set per brain.
+
+  // Null entries fall back to the global callbacks set above. Kept across ResetBrain.
+  struct BrainHostCallbacks
+  {
+    CallServiceFunction callService;
+    ActorVector3Getter getActorVector3;
+    ActorVector3Setter setActorVector3;
+    ActorQuaternionGetter getActorQuaternion;
+    ActorQuaternionSetter setActorQuaternion;
+    ActorBooleanGetter getActorBoolean;
+    ActorBooleanSetter setActorBoolean;
+    ActorStringGetter getActorString;
+    ActorStringSetter setActorString;
+    ActorFloatGetter getActorFloat;
+    ActorFloatSetter setActorFloat;
+    ActorVector3BatchGetter getActorVector3Batch;
+    ActorVector3BatchSetter setActorVector3Batch;
+    ActorQuaternionBatchGetter getActorQuaternionBatch;
+    ActorQuaternionBatchSetter setActorQuaternionBatch;
+    ActorBooleanBatchGetter getActorBooleanBatch;
+    ActorBooleanBatchSetter setActorBooleanBatch;
+    ActorFloatBatchGetter getActorFloatBatch;
+    ActorFloatBatchSetter setActorFloatBatch;
+    CallServicesBatchFunction callServicesBatch;
+  };
+  V8_IN_UNITY_DLLEXPORT bool SetBrainHostCallbacks(CSHARP_STRING brainUid, const BrainHostCallbacks *callbacks);
+
+  // 0 or less uses one thread per core. Otherwise the pool is created on first use.
+  // Batches already running finish on the pool they started on.
+  V8_IN_UNITY_DLLEXPORT void SetBrainWorkerThreads(int numThreads);
+
+  // Ticks count brains at once and returns the number that succeeded, once
+  // all are done. Results are reported from worker threads, along with the
+  // index of the request. bytesIns and lengthsIn may be null. Brains reset
+  // while this runs finish their tick on the old brain. They must not have
+  // modules set meanwhile.
+  typedef void (*IndexedStringFunction)(int index, const char *);
+  V8_IN_UNITY_DLLEXPORT int UpdateAgentsJsonParallel(int count, CSHARP_STRING brainUids[], CSHARP_STRING agentUids[], CSHARP_STRING jsonIns[],
+                                                     BYTE_ARRAY bytesIns[], int lengthsIn[], IndexedStringFunction reportResult, bool resultsOut[]);
 }
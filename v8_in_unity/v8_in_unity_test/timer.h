@@ -79,29 +79,39 @@ private:
 
 #else
 
-// TODO TODO
+#include <chrono>
 #include <iostream>
 #include <string>
 
 class CpuTimer
 {
 public:
-  CpuTimer(const std::string &label) : hadError_(false), label_(label)
+  CpuTimer(const std::string &label) : label_(label), t0_(std::chrono::steady_clock::now())
   {
   }
 
   double GetElapsedMilliSeconds()
   {
-    return 0.0;
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - t0_;
+    return elapsed.count();
   }
 
   ~CpuTimer()
   {
+    double dms = GetElapsedMilliSeconds();
+    if (dms > 1e3)
+    {
+      std::cout << label_ << " " << (dms / 1e3) << " seconds" << std::endl;
+    }
+    else
+    {
+      std::cout << label_ << " " << (dms) << " milliseconds" << std::endl;
+    }
   }
 
 private:
-  bool hadError_;
   std::string label_;
+  std::chrono::steady_clock::time_point t0_;
 };
 
 #endif
@@ -18,11 +18,22 @@
 
 #include "../v8_in_unity/v8_in_unity.h"
 #include "timer.h"
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <string>
+#include <thread>
 #include <sstream>
 #include <cmath>
+#include <ctime>
+#include <cstring>
+#include <algorithm>
 
 using namespace std;
 
@@ -62,6 +73,11 @@ void myErrorLogFunction(const char *msg)
   // std::cerr << msg << endl;
 }
 
+// The brain the test is ticking, and how often budgeted work ran in another
+// brain's tick.
+static std::string ticking_brain;
+static int budgeted_work_elsewhere = 0;
+
 void myCallServiceFunction(const char *serviceName, const char *jsonArgs, ReportServiceResultFunction reportResult)
 {
   std::ostringstream result;
@@ -71,6 +87,14 @@ void myCallServiceFunction(const char *serviceName, const char *jsonArgs, Report
   {
     result << (x + 1);
   }
+  else if (strcmp(serviceName, "markBudgetedWork") == 0)
+  {
+    if (ticking_brain != "budgeted")
+    {
+      budgeted_work_elsewhere++;
+    }
+    result << 0;
+  }
   else if (strcmp(serviceName, "addTwo") == 0)
   {
     result << (x + 2);
@@ -253,6 +277,13 @@ void testPostMessageFlush()
   CHECK(reported_json == "{\"result\":\"lastTouchedByPostFlush\"}");
 }
 
+void OverheadActorVector3Getter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float *x, float *y, float *z)
+{
+  *x = 1.5f;
+  *y = 2.0f;
+  *z = 1.5f;
+}
+
 void testCallbackOverhead()
 {
   const char *agentUid = "pinky";
@@ -289,6 +320,45 @@ void testCallbackOverhead()
     CpuTimer timer("Native callback update");
     CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
   }
+  {
+    CHECK(ResetBrain(brainUid,
+                     "function updateAgent(state) {"
+                     "  let N = 200000;"
+                     "  let x = 0;"
+                     "  const v = {};"
+                     "  for (var i = 0; i < N; i++) {"
+                     "    getActorVector3(i % 500, 1, v);"
+                     "    x += v.x + v.y + v.z;"
+                     "  }"
+                     "  state.x = x;"
+                     "}"));
+    BrainHostCallbacks callbacks = {};
+    callbacks.getActorVector3 = OverheadActorVector3Getter;
+    CHECK(SetBrainHostCallbacks(brainUid, &callbacks));
+
+    CpuTimer timer("Vector3 reads into object");
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+    CHECK(reported_json == "{\"x\":1000000}");
+  }
+  {
+    CHECK(ResetBrain(brainUid,
+                     "function updateAgent(state) {"
+                     "  let N = 200000;"
+                     "  let x = 0;"
+                     "  const v = new Float32Array(3);"
+                     "  for (var i = 0; i < N; i++) {"
+                     "    getActorVector3(i % 500, 1, v);"
+                     "    x += v[0] + v[1] + v[2];"
+                     "  }"
+                     "  state.x = x;"
+                     "}"));
+
+    CpuTimer timer("Vector3 reads into Float32Array");
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+    CHECK(reported_json == "{\"x\":1000000}");
+  }
+  BrainHostCallbacks noCallbacks = {};
+  CHECK(SetBrainHostCallbacks(brainUid, &noCallbacks));
 }
 
 void testModules()
@@ -370,167 +440,2011 @@ void testManyModules()
   CHECK(reported_json == "{\"x\":3,\"y\":6,\"z\":9}");
 }
 
-void testPumpPromisesMessageLoopCalledAfterUpdateAgent()
+void testModuleImports()
 {
   const char *agentUid = "pinky";
   const char *brainUid = "brain";
+
   CHECK(ResetBrain(brainUid,
+                   "var mathLibLoads = 0;\n"
                    "function updateAgent(state) {\n"
-                   "  state.resolved = false;\n"
-                   "  const p = Promise.resolve(1).then(() => state.resolved = true);\n"
+                   "  state.y = getVoosModule('FooMath')['transform'](state.x);\n"
+                   "  state.z = getVoosModule('BarMath')['transform'](state.x);\n"
+                   "  state.loads = mathLibLoads;\n"
                    "}\n"));
 
-  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
-  CHECK(reported_json == "{\"resolved\":true}");
+  CHECK(SetModule(brainUid, "MathLib",
+                  "mathLibLoads++;\n"
+                  "export function scale(x, s) {\n"
+                  "  return x * s;\n"
+                  "}\n"));
+  CHECK(SetModule(brainUid, "FooMath",
+                  "import {scale} from 'MathLib';\n"
+                  "export function transform(x) {\n"
+                  "  return scale(x, 2);\n"
+                  "}\n"));
+  CHECK(SetModule(brainUid, "BarMath",
+                  "import * as lib from './MathLib.js';\n"
+                  "export function transform(x) {\n"
+                  "  return lib.scale(x, 3);\n"
+                  "}\n"));
+
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 3}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":3,\"y\":6,\"z\":9,\"loads\":1}");
+
+  error_msgs.str("");
+  CHECK(!SetModule(brainUid, "BazMath", "import {scale} from 'NoSuchLib';\n"));
+  CHECK(error_msgs.str().find("Cannot import 'NoSuchLib'") != std::string::npos);
+
+  // Compare many behaviors each carrying a copy of a library against
+  // importing one instance of it.
+  std::ostringstream library;
+  for (int i = 0; i < 200; i++)
+  {
+    library << "export function helper" << i << "(x) { return [x, " << i << "].map(v => v * 2).reduce((a, b) => a + b); }\n";
+  }
+  const int numBehaviors = 100;
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) {}\n"));
+  {
+    CpuTimer timer("Modules with copied library");
+    for (int i = 0; i < numBehaviors; i++)
+    {
+      std::ostringstream source;
+      source << library.str() << "export const id = " << i << ";\n";
+      CHECK(SetModule(brainUid, ("Copied" + std::to_string(i)).c_str(), source.str().c_str()));
+    }
+  }
+  long long copiedHeapSize = GetTotalBrainHeapSize();
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) {}\n"));
+  {
+    CpuTimer timer("Modules importing library");
+    CHECK(SetModule(brainUid, "Library", library.str().c_str()));
+    for (int i = 0; i < numBehaviors; i++)
+    {
+      std::ostringstream source;
+      source << "export * from 'Library';\n"
+             << "export const id = " << i << ";\n";
+      CHECK(SetModule(brainUid, ("Importing" + std::to_string(i)).c_str(), source.str().c_str()));
+    }
+  }
+  std::cout << "Brain heaps with copied library: " << copiedHeapSize << " bytes, with imports: " << GetTotalBrainHeapSize() << " bytes" << std::endl;
 }
 
-void testBasicService()
+void testModuleDependencyReload()
 {
   const char *agentUid = "pinky";
   const char *brainUid = "brain";
+
   CHECK(ResetBrain(brainUid,
+                   "var loads = {};\n"
+                   "function countLoad(name) { loads[name] = (loads[name] || 0) + 1; }\n"
                    "function updateAgent(state) {\n"
-                   "  state.four = callVoosService('addOne', 3);\n"
-                   "  state.five = callVoosService('addTwo', 3);\n"
+                   "  state.foo = getVoosModule('FooMath').transform(state.x);\n"
+                   "  state.bar = getVoosModule('BarMath').transform(state.x);\n"
+                   "  state.loads = loads;\n"
                    "}\n"));
 
-  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
-  std::cout << reported_json;
-  CHECK(reported_json == "{\"four\":4,\"five\":5}");
+  const char *mathLib = "countLoad('MathLib');\n"
+                        "export function scale(x) { return x * 2; }\n";
+  CHECK(SetModule(brainUid, "MathLib", mathLib));
+  CHECK(SetModule(brainUid, "FooMath",
+                  "import {scale} from 'MathLib';\n"
+                  "countLoad('FooMath');\n"
+                  "export function transform(x) { return scale(x) + 1; }\n"));
+  CHECK(SetModule(brainUid, "BarMath",
+                  "import {transform as foo} from 'FooMath';\n"
+                  "countLoad('BarMath');\n"
+                  "export function transform(x) { return foo(x) * 10; }\n"));
+  CHECK(SetModule(brainUid, "Independent",
+                  "countLoad('Independent');\n"
+                  "export const value = 1;\n"));
+
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 3}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":3,\"foo\":7,\"bar\":70,\"loads\":{\"MathLib\":1,\"FooMath\":1,\"BarMath\":1,\"Independent\":1}}");
+
+  // Same source: nothing is reloaded.
+  CHECK(SetModule(brainUid, "MathLib", mathLib));
+  ModuleLoadStats stats;
+  CHECK(GetModuleLoadStats(brainUid, "MathLib", &stats));
+  CHECK(stats.loads == 1);
+  CHECK(stats.skippedReloads == 1);
+  CHECK(stats.compileMs >= 0 && stats.instantiateMs >= 0 && stats.evaluateMs >= 0);
+
+  // New source: the module and everything importing it, directly or not.
+  CHECK(SetModule(brainUid, "MathLib",
+                  "countLoad('MathLib');\n"
+                  "export function scale(x) { return x * 3; }\n"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 3}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":3,\"foo\":10,\"bar\":100,\"loads\":{\"MathLib\":2,\"FooMath\":2,\"BarMath\":2,\"Independent\":1}}");
+  CHECK(GetModuleLoadStats(brainUid, "MathLib", &stats));
+  CHECK(stats.loads == 2 && stats.dependencyReloads == 0);
+  CHECK(GetModuleLoadStats(brainUid, "BarMath", &stats));
+  CHECK(stats.loads == 1 && stats.dependencyReloads == 1);
+  CHECK(GetModuleLoadStats(brainUid, "Independent", &stats));
+  CHECK(stats.loads == 1 && stats.dependencyReloads == 0);
+
+  // Dependents that no longer link keep their old version.
+  error_msgs.str("");
+  CHECK(SetModule(brainUid, "MathLib", "export function other(x) { return x; }\n"));
+  CHECK(error_msgs.str().find("Could not reload module 'FooMath' after 'MathLib' changed.") != std::string::npos);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 3}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":3,\"foo\":10,\"bar\":100,\"loads\":{\"MathLib\":2,\"FooMath\":2,\"BarMath\":3,\"Independent\":1}}");
+
+  // Unchanged sources are skipped safely while other threads tick or set.
+  const char *independent = "countLoad('Independent');\n"
+                            "export const value = 1;\n";
+  std::vector<std::thread> setters;
+  std::vector<int> failedSets(2, 0);
+  for (int t = 0; t < 2; t++)
+  {
+    setters.emplace_back([&failedSets, brainUid, independent, t]() {
+      for (int i = 0; i < 20; i++)
+      {
+        if (!SetModule(brainUid, "Independent", independent))
+        {
+          failedSets[t]++;
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 20; i++)
+  {
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 3}", myReportUpdatedAgentJson));
+  }
+  for (auto &setter : setters)
+  {
+    setter.join();
+  }
+  CHECK(failedSets[0] == 0 && failedSets[1] == 0);
+  CHECK(GetModuleLoadStats(brainUid, "Independent", &stats));
+  CHECK(stats.loads == 1 && stats.skippedReloads == 40);
+
+  CHECK(!GetModuleLoadStats(brainUid, "NoSuchModule", &stats));
 }
 
-void testVeryLongLogMessage()
+void testModulesBatch()
 {
   const char *agentUid = "pinky";
   const char *brainUid = "brain";
+
   CHECK(ResetBrain(brainUid,
                    "function updateAgent(state) {\n"
-                   "  sysError('x'.repeat(10 * 1024 * 1024));\n"
+                   "  state.y = getVoosModule('Batch10').transform(state.x);\n"
+                   "  state.z = getVoosModule('Batch19').transform(state.x);\n"
                    "}\n"));
-  error_msgs.str("");
-  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
-  CHECK(error_msgs.str().length() == 0);
+
+  // Each module imports the one before it.
+  const int count = 20;
+  std::vector<std::string> uids, sources;
+  for (int i = 0; i < count; i++)
+  {
+    std::ostringstream source;
+    if (i > 0)
+    {
+      source << "import {transform as previous} from 'Batch" << (i - 1) << "';\n"
+             << "export function transform(x) { return previous(x) + 1; }\n";
+    }
+    else
+    {
+      source << "export function transform(x) { return x; }\n";
+    }
+    uids.push_back("Batch" + std::to_string(i));
+    sources.push_back(source.str());
+  }
+  sources[5] = "export function transform(x) { syntax error }\n";
+  std::vector<const char *> uidPtrs, sourcePtrs;
+  for (int i = 0; i < count; i++)
+  {
+    uidPtrs.push_back(uids[i].c_str());
+    sourcePtrs.push_back(sources[i].c_str());
+  }
+
+  // Everything importing the broken module, directly or not, fails too.
+  bool results[count];
+  CHECK(SetModulesBatch(brainUid, count, uidPtrs.data(), sourcePtrs.data(), results) == 5);
+  CHECK(results[4] && !results[5] && !results[19]);
+
+  sources[5] = "import {transform as previous} from 'Batch4';\n"
+               "export function transform(x) { return previous(x) + 1; }\n";
+  sourcePtrs[5] = sources[5].c_str();
+  CHECK(StartModulesBatch(brainUid, count, uidPtrs.data(), sourcePtrs.data()));
+  CHECK(!StartModulesBatch(brainUid, count, uidPtrs.data(), sourcePtrs.data()));
+  int remaining;
+  int numPolls = 0;
+  while ((remaining = PollModulesBatch(brainUid, 0, results)) > 0)
+  {
+    numPolls++;
+  }
+  CHECK(remaining == 0);
+  // A zero budget still sets one module per poll.
+  CHECK(numPolls >= count - 1);
+  CHECK(std::count(results, results + count, true) == count);
+  CHECK(PollModulesBatch(brainUid, 0, results) == -1);
+
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 3}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":3,\"y\":13,\"z\":22}");
+
+  CHECK(SetModulesBatch(brainUid, 0, nullptr, nullptr, nullptr) == 0);
+
+  // Compare with setting the same modules one by one.
+  const int numLarge = 100;
+  std::ostringstream library;
+  for (int i = 0; i < 200; i++)
+  {
+    library << "export function helper" << i << "(x) { return [x, " << i << "].map(v => v * 2).reduce((a, b) => a + b); }\n";
+  }
+  std::vector<std::string> largeUids, largeSources;
+  for (int i = 0; i < numLarge; i++)
+  {
+    largeUids.push_back("Large" + std::to_string(i));
+    largeSources.push_back(library.str() + "export const id = " + std::to_string(i) + ";\n");
+  }
+  std::vector<const char *> largeUidPtrs, largeSourcePtrs;
+  for (int i = 0; i < numLarge; i++)
+  {
+    largeUidPtrs.push_back(largeUids[i].c_str());
+    largeSourcePtrs.push_back(largeSources[i].c_str());
+  }
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) {}\n"));
+  {
+    CpuTimer timer("Modules set one by one");
+    for (int i = 0; i < numLarge; i++)
+    {
+      CHECK(SetModule(brainUid, largeUidPtrs[i], largeSourcePtrs[i]));
+    }
+  }
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) {}\n"));
+  {
+    CpuTimer timer("Modules set in a batch");
+    CHECK(SetModulesBatch(brainUid, numLarge, largeUidPtrs.data(), largeSourcePtrs.data(), nullptr) == numLarge);
+  }
 }
 
-void testVeryLongCode()
+void testLazyModules()
 {
+  const char *agentUid = "pinky";
   const char *brainUid = "brain";
-  std::string code(10 * 1024 * 1024, 'x');
-  CHECK(!ResetBrain(brainUid, code.c_str()));
+  const char *brainJs = "var loads = [];\n"
+                        "function updateAgent(state) {\n"
+                        "  for (const name of state.use) state[name] = getVoosModule(name).value;\n"
+                        "  state.loads = loads;\n"
+                        "}\n";
+
+  CHECK(ResetBrain(brainUid, brainJs));
+  CHECK(SetLazyModules(brainUid, true));
+  CHECK(!SetLazyModules("noSuchBrain", true));
+  CHECK(SetModule(brainUid, "Dep", "loads.push('Dep');\nexport const value = 1;\n"));
+  CHECK(SetModule(brainUid, "Importer", "import {value as dep} from 'Dep';\nloads.push('Importer');\nexport const value = dep + 1;\n"));
+  CHECK(SetModule(brainUid, "Broken", "loads.push('Broken');\nthrow new Error('broken at load');\n"));
+  CHECK(SetModule(brainUid, "Unused", "loads.push('Unused');\nexport const value = 3;\n"));
+
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"use\":[]}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"use\":[],\"loads\":[]}");
+
+  // Imports are evaluated along with their importers, and only once.
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"use\":[\"Importer\",\"Dep\"]}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"use\":[\"Importer\",\"Dep\"],\"Importer\":2,\"Dep\":1,\"loads\":[\"Dep\",\"Importer\"]}");
+  ModuleLoadStats stats;
+  CHECK(GetModuleLoadStats(brainUid, "Importer", &stats));
+  CHECK(stats.loads == 1 && stats.evaluateMs >= 0);
+
+  error_msgs.str("");
+  CHECK(!UpdateAgentJson(brainUid, agentUid, "{\"use\":[\"Broken\"]}", myReportUpdatedAgentJson));
+  CHECK(error_msgs.str().find("Exception caught while evaluating lazy module 'Broken'") != std::string::npos);
+
+  // A lazy module that runs past the time budget ends the tick that used it,
+  // and the brain recovers for the next one.
+  CHECK(SetModule(brainUid, "Hang", "loads.push('Hang');\nwhile (true) {}\n"));
+  CHECK(SetBrainTimeBudget(brainUid, 50));
+  error_msgs.str("");
+  CHECK(!UpdateAgentJson(brainUid, agentUid, "{\"use\":[\"Hang\",\"Dep\"]}", myReportUpdatedAgentJson));
+  CHECK(error_msgs.str().find("Exception caught while evaluating lazy module 'Hang': Script was terminated.") != std::string::npos);
+  CHECK(error_msgs.str().find("TypeError") == std::string::npos);
+  CHECK(SetBrainTimeBudget(brainUid, 0));
+  CHECK(RemoveModule(brainUid, "Hang"));
+
+  // A new version is evaluated on its next use.
+  CHECK(SetModule(brainUid, "Dep", "loads.push('Dep2');\nexport const value = 10;\n"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"use\":[\"Dep\",\"Importer\"]}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"use\":[\"Dep\",\"Importer\"],\"Dep\":10,\"Importer\":11,\"loads\":[\"Dep\",\"Importer\",\"Broken\",\"Hang\",\"Dep2\",\"Importer\"]}");
+
+  // Kept across resets.
+  CHECK(ResetBrain(brainUid, brainJs));
+  CHECK(SetModule(brainUid, "Broken", "throw new Error('broken at load');\n"));
+
+  // Compare eager and lazy loading of many modules, of which few are used.
+  std::ostringstream library;
+  for (int i = 0; i < 200; i++)
+  {
+    library << "export function helper" << i << "(x) { return [x, " << i << "].map(v => v * 2).reduce((a, b) => a + b); }\n";
+  }
+  library << "export const table = new Array(10000).fill(0).map((_, i) => ({i}));\n"
+          << "export const value = table.length;\n";
+  for (bool lazy : {false, true})
+  {
+    CHECK(ResetBrain(brainUid, brainJs));
+    CHECK(SetLazyModules(brainUid, lazy));
+    {
+      CpuTimer timer(lazy ? "Lazy modules set" : "Eager modules set");
+      for (int i = 0; i < 100; i++)
+      {
+        CHECK(SetModule(brainUid, ("Library" + std::to_string(i)).c_str(), library.str().c_str()));
+      }
+    }
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{\"use\":[\"Library3\"]}", myReportUpdatedAgentJson));
+    std::cout << (lazy ? "Lazy" : "Eager") << " modules brain heaps: " << GetTotalBrainHeapSize() << " bytes" << std::endl;
+  }
+  CHECK(SetLazyModules(brainUid, false));
 }
 
-void testUpdateAgentArrayBuffer()
+void testRemoveModules()
 {
   const char *agentUid = "pinky";
   const char *brainUid = "brain";
 
-  std::vector<uint8_t> buf(1);
-  buf[0] = 42;
-
   CHECK(ResetBrain(brainUid,
-                   "function updateAgent(foo, buffer) {"
-                   "  const view = new DataView(buffer);"
-                   "  if(view.getUint8(0) != 42) throw 'ahhh';"
-                   "  view.setUint8(0, 123);"
-                   "}"));
+                   "function updateAgent(state) {\n"
+                   "  for (const name of state.use) {\n"
+                   "    const module = getVoosModule(name);\n"
+                   "    state[name] = module ? module.value : 'missing';\n"
+                   "  }\n"
+                   "}\n"));
+  CHECK(SetModule(brainUid, "A", "export const value = 1;\n"));
+  CHECK(SetModule(brainUid, "B", "import {value as a} from 'A';\nexport const value = a + 1;\n"));
+  CHECK(SetModule(brainUid, "C", "export const value = 3;\n"));
+
+  CHECK(RemoveModule(brainUid, "C"));
+  CHECK(!RemoveModule(brainUid, "C"));
+  ModuleLoadStats stats;
+  CHECK(!GetModuleLoadStats(brainUid, "C", &stats));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"use\":[\"A\",\"B\",\"C\",\"Unknown\"]}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"use\":[\"A\",\"B\",\"C\",\"Unknown\"],\"A\":1,\"B\":2,\"C\":\"missing\",\"Unknown\":\"missing\"}");
+
+  // B keeps the A it imported.
+  const char *retained[] = {"B"};
+  CHECK(RetainModules(brainUid, 1, retained) == 1);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"use\":[\"A\",\"B\"]}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"use\":[\"A\",\"B\"],\"A\":\"missing\",\"B\":2}");
+  CHECK(!SetModule(brainUid, "D", "import {value} from 'A';\n"));
+
+  // Memory comes back once nothing references the modules.
+  for (int i = 0; i < 50; i++)
+  {
+    CHECK(SetModule(brainUid, ("Big" + std::to_string(i)).c_str(),
+                    "export const table = new Array(10000).fill(0).map((_, i) => ({i}));\n"
+                    "export const value = table.length;\n"));
+  }
+  CollectBrainGarbage(brainUid);
+  CHECK(RetainModules(brainUid, 1, retained) == 50);
+  long long freed = CollectBrainGarbage(brainUid);
+  std::cout << "Freed " << freed << " bytes by removing modules" << std::endl;
+  CHECK(freed > 50 * 10000 * 16);
+  CHECK(RetainModules(brainUid, 0, nullptr) == 1);
+  CHECK(CollectBrainGarbage("noSuchBrain") == 0);
+
+  // Lazy importers that were never used keep their imports too.
+  CHECK(SetLazyModules(brainUid, true));
+  CHECK(SetModule(brainUid, "A", "export const value = 1;\n"));
+  CHECK(SetModule(brainUid, "B", "import {value as a} from 'A';\nexport const value = a + 1;\n"));
+  CHECK(SetModule(brainUid, "C", "import {value as b} from 'B';\nexport const value = b + 1;\n"));
+  CHECK(RemoveModule(brainUid, "A"));
+  CHECK(RetainModules(brainUid, 1, &retained[0]) == 1);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"use\":[\"A\",\"B\",\"C\"]}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"use\":[\"A\",\"B\",\"C\"],\"A\":\"missing\",\"B\":2,\"C\":\"missing\"}");
+  CHECK(SetLazyModules(brainUid, false));
+}
 
-  CHECK(UpdateAgentJsonBytes(brainUid, agentUid, "{}", &buf[0], (int)buf.size(), myReportUpdatedAgentJson));
-  CHECK(buf[0] == 123);
+void testBrainHeapLimits()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "limitedBrain";
+  const char *brainJs = "function updateAgent(state) {\n"
+                        "  const hog = [];\n"
+                        "  while (state.grow) hog.push(new Array(1000).fill(state.grow));\n"
+                        "  state.ticks = (state.ticks || 0) + 1;\n"
+                        "}\n";
+
+  CHECK(!SetBrainHeapLimit(brainUid, -1, 0));
+  CHECK(SetBrainHeapLimit(brainUid, 16, 1));
+  CHECK(ResetBrain(brainUid, brainJs));
+
+  BrainHeapStatistics stats;
+  CHECK(GetBrainHeapStatistics(brainUid, &stats));
+  long long limitedHeapSize = stats.heapSizeLimit;
+  CHECK(stats.usedHeapSize > 0);
+  CHECK(stats.usedHeapSize <= stats.totalHeapSize);
+  CHECK(stats.nearHeapLimitCount == 0);
+
+  // The runaway tick fails instead of taking the process down with it.
+  {
+    CpuTimer timer("runaway tick");
+    CHECK(!UpdateAgentJson(brainUid, agentUid, "{\"grow\":1}", myReportUpdatedAgentJson));
+  }
+  CHECK(GetBrainHeapStatistics(brainUid, &stats));
+  CHECK(stats.nearHeapLimitCount >= 2);
+  CHECK(stats.heapLimitTerminations == 1);
+
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"grow\":0}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"grow\":0,\"ticks\":1}");
+  CollectBrainGarbage(brainUid);
+  CHECK(GetBrainHeapStatistics(brainUid, &stats));
+  CHECK(stats.usedHeapSize < 16 << 20);
+
+  BrainHeapSpaceStatistics spaces[32];
+  int spaceCount = GetBrainHeapSpaceStatistics(brainUid, spaces, 32);
+  CHECK(spaceCount > 0);
+  long long usedTotal = 0;
+  for (int i = 0; i < spaceCount; i++)
+  {
+    CHECK(spaces[i].name != nullptr);
+    CHECK(spaces[i].usedSize <= spaces[i].spaceSize);
+    usedTotal += spaces[i].usedSize;
+  }
+  CHECK(usedTotal == stats.usedHeapSize);
+  CHECK(GetBrainHeapSpaceStatistics(brainUid, spaces, 1) == 1);
+  CHECK(!GetBrainHeapStatistics("noSuchBrain", &stats));
+
+  // Back to the default on the next reset.
+  CHECK(SetBrainHeapLimit(brainUid, 0, 0));
+  CHECK(ResetBrain(brainUid, brainJs));
+  CHECK(GetBrainHeapStatistics(brainUid, &stats));
+  CHECK(stats.heapSizeLimit > limitedHeapSize);
+  CHECK(stats.heapLimitTerminations == 0);
 }
 
-void testUnjsonbleResponseDoesNotCrash()
+void testIdleCollect()
 {
   const char *agentUid = "pinky";
   const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  const junk = [];\n"
+                   "  for (let i = 0; i < 2000; i++) junk.push({i, name: 'junk' + i});\n"
+                   "  state.count = junk.length;\n"
+                   "}\n"));
+  const int ticks = 300;
 
-  std::vector<uint8_t> buf(1);
-  buf[0] = 42;
+  BrainGcStatistics before;
+  CHECK(ResetBrainGcStatistics(brainUid));
+  {
+    CpuTimer timer("ticks without idle collection");
+    for (int i = 0; i < ticks; i++)
+    {
+      CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+    }
+  }
+  CHECK(GetBrainGcStatistics(brainUid, &before));
+  CHECK(before.pausesInUpdate > 0);
+  CHECK(before.pausesInIdle == 0);
+  CHECK(before.allocatedBytesPerTick == 0);
+
+  BrainGcStatistics after;
+  CHECK(SetGcPacing(brainUid, true));
+  // Leave a frame's worth of ticks to learn the allocation rate.
+  for (int i = 0; i < 10; i++)
+  {
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  }
+  CHECK(ResetBrainGcStatistics(brainUid));
+  {
+    CpuTimer timer("ticks with paced idle collection");
+    for (int i = 0; i < ticks; i++)
+    {
+      CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+      IdleCollect(brainUid, 10);
+    }
+  }
+  CHECK(GetBrainGcStatistics(brainUid, &after));
+  std::cout << "GC pauses in " << ticks << " ticks: " << before.pausesInUpdate << " (" << before.pauseMsInUpdate << " ms) without idle collection, "
+            << after.pausesInUpdate << " (" << after.pauseMsInUpdate << " ms) with, and " << after.pausesInIdle << " in idle time" << std::endl;
+  CHECK(after.pausesInUpdate < before.pausesInUpdate);
+  CHECK(after.pausesInIdle > 0);
+  CHECK(after.allocatedBytesPerTick > 2000 * 16);
+
+  // Pacing survives resets, but not the statistics of an isolate of its own.
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) {}"));
+  CHECK(GetBrainGcStatistics(brainUid, &after));
+  CHECK(after.allocatedBytesPerTick == 0);
+  CHECK(SetGcPacing(brainUid, false));
+  CHECK(!IdleCollect("noSuchBrain", 1));
+  CHECK(!GetBrainGcStatistics("noSuchBrain", &after));
+}
 
-  CHECK(ResetBrain(brainUid,
-                   "function updateAgent(obj) {"
-                   "  obj['cycle'] = obj;"
-                   "}"));
+void testPooledArrayBuffers()
+{
+  const char *agentUid = "pinky";
+  const char *pooledUid = "pooledBrain";
+  const char *defaultUid = "defaultBrain";
+  // Decodes the tick's bytes through lots of small views, like our real brains.
+  const char *brainJs = "function updateAgent(state, bytes) {\n"
+                        "  let sum = 0;\n"
+                        "  for (let i = 0; i < 200; i++) {\n"
+                        "    const copy = new Float32Array(64);\n"
+                        "    copy.set(new Float32Array(bytes, 0, 64));\n"
+                        "    const view = new DataView(new ArrayBuffer(256));\n"
+                        "    view.setFloat32(0, copy[i % 64]);\n"
+                        "    sum += view.getFloat32(0);\n"
+                        "  }\n"
+                        "  const scratch = new Uint8Array(state.scratchBytes);\n"
+                        "  scratch[scratch.length - 1] = 1;\n"
+                        "  state.sum = sum + scratch[scratch.length - 1];\n"
+                        "}\n";
+
+  CHECK(!SetBrainArrayBufferAllocator(pooledUid, 7));
+  CHECK(SetBrainArrayBufferAllocator(pooledUid, BRAIN_ARRAY_BUFFERS_POOLED));
+  CHECK(ResetBrain(pooledUid, brainJs));
+  CHECK(ResetBrain(defaultUid, brainJs));
+
+  std::vector<float> floats(64, 1.0f);
+  const char *state = "{\"scratchBytes\":16384}";
+  const int ticks = 2000;
+  {
+    CpuTimer timer("ticks with default ArrayBuffer allocator");
+    for (int i = 0; i < ticks; i++)
+    {
+      CHECK(UpdateAgentJsonBytes(defaultUid, agentUid, state, (BYTE_ARRAY)floats.data(), (int)(floats.size() * sizeof(float)), myReportUpdatedAgentJson));
+    }
+  }
+  {
+    CpuTimer timer("ticks with pooled ArrayBuffer allocator");
+    for (int i = 0; i < ticks; i++)
+    {
+      CHECK(UpdateAgentJsonBytes(pooledUid, agentUid, state, (BYTE_ARRAY)floats.data(), (int)(floats.size() * sizeof(float)), myReportUpdatedAgentJson));
+    }
+  }
+  CHECK(reported_json == "{\"scratchBytes\":16384,\"sum\":201}");
+
+  BrainArrayBufferStatistics stats;
+  CHECK(!GetBrainArrayBufferStatistics(defaultUid, &stats));
+  CHECK(GetBrainArrayBufferStatistics(pooledUid, &stats));
+  CHECK(stats.allocations >= ticks * 401);
+  CHECK(stats.arenaAllocations >= ticks * 400);
+  CHECK(stats.pooledAllocations > ticks / 2);
+  CHECK(stats.peakLiveBytes >= stats.liveBytes);
+  CHECK(stats.peakLiveBytes >= 16384);
+  // Dead buffers hand their chunks back, so the arena stays small.
+  CHECK(stats.arenaBytes <= 32 * 256 * 1024);
+  CollectBrainGarbage(pooledUid);
+  CHECK(GetBrainArrayBufferStatistics(pooledUid, &stats));
+  CHECK(stats.liveBytes < 16384);
+  std::cout << "Pooled allocator: " << stats.allocations << " allocations, peak " << stats.peakLiveBytes << " live bytes, "
+            << stats.arenaBytes << " bytes of arena" << std::endl;
+
+#ifdef __linux__
+  CHECK(SetBrainArrayBufferAllocator(pooledUid, BRAIN_ARRAY_BUFFERS_POOLED_HUGE_PAGES));
+  CHECK(ResetBrain(pooledUid, brainJs));
+  CHECK(UpdateAgentJsonBytes(pooledUid, agentUid, "{\"scratchBytes\":4194304}", (BYTE_ARRAY)floats.data(), (int)(floats.size() * sizeof(float)), myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"scratchBytes\":4194304,\"sum\":201}");
+  CHECK(GetBrainArrayBufferStatistics(pooledUid, &stats));
+  CHECK(stats.hugePageAllocations == 1);
+  CHECK(stats.hugePageBytes == 4194304);
+#endif
+
+  CHECK(SetBrainArrayBufferAllocator(pooledUid, BRAIN_ARRAY_BUFFERS_DEFAULT));
+  CHECK(ResetBrain(pooledUid, brainJs));
+  CHECK(!GetBrainArrayBufferStatistics(pooledUid, &stats));
+  CHECK(EvaluateToInteger("new Uint8Array(100000).length + new Uint8Array(10).length") == 100010);
+}
+
+void testBrainTimeBudget()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  const char *brainJs = "let ticks = 0;\n"
+                        "function updateAgent(state) {\n"
+                        "  ticks++;\n"
+                        "  while (state.hang) {}\n"
+                        "  state.ticks = ticks;\n"
+                        "}\n";
+  CHECK(ResetBrain(brainUid, brainJs));
+  CHECK(!SetBrainTimeBudget(brainUid, -1));
+  CHECK(SetBrainTimeBudget(brainUid, 50));
 
   error_msgs.str("");
-  CHECK(false == UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
-  CHECK(error_msgs.str().find("Could not JSON::Stringify object") != string::npos);
-}
+  {
+    CpuTimer timer("hung tick with a 50 ms budget");
+    CHECK(!UpdateAgentJson(brainUid, agentUid, "{\"hang\":true}", myReportUpdatedAgentJson));
+  }
+  CHECK(error_msgs.str().find("Error while calling updateAgent: Script was terminated.") != string::npos);
+  CHECK(error_msgs.str().find("Brain exceeded its time budget: {\"budgetMs\":50,\"elapsedMs\":") != string::npos);
+  CHECK(error_msgs.str().find("\"terminated\":true}") != string::npos);
 
-TEMP_ACTOR_ID expected_actor_id = 12;
-TEMP_ACTOR_ID expected_field_id = 34;
-bool actor_bool_value = false;
+  // Same context, so it remembers the hung tick.
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":2}");
 
-float actor_vec3_x = 0.1f;
-float actor_vec3_y = 0.1f;
-float actor_vec3_z = 0.1f;
+  // Ticks within budget are left alone, and don't leave the watchdog behind.
+  error_msgs.str("");
+  for (int i = 0; i < 1000; i++)
+  {
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  }
+  CHECK(reported_json == "{\"ticks\":1002}");
+  CHECK(error_msgs.str().empty());
 
-float actor_quat_x = 0.1f;
-float actor_quat_y = 0.1f;
-float actor_quat_z = 0.1f;
-float actor_quat_w = 0.1f;
+  // The budget survives resets, and only applies to the brain it was set on.
+  CHECK(ResetBrain(brainUid, brainJs));
+  CHECK(!UpdateAgentJson(brainUid, agentUid, "{\"hang\":true}", myReportUpdatedAgentJson));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":2}");
 
-void TestActorBooleanGetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, bool *value_out)
-{
-  CHECK(actor_id == expected_actor_id);
-  CHECK(field_id == expected_field_id);
-  *value_out = actor_bool_value;
-}
-void TestActorBooleanSetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, bool value)
-{
-  CHECK(actor_id == expected_actor_id);
-  CHECK(field_id == expected_field_id);
-  actor_bool_value = value;
+  // Module and brain JS top levels are held to it too.
+  error_msgs.str("");
+  CHECK(!SetModule(brainUid, "Hang", "while (true) {}\nexport const value = 1;\n"));
+  CHECK(error_msgs.str().find("Exception caught while evaluating module JS: Script was terminated.") != string::npos);
+  error_msgs.str("");
+  CHECK(!ResetBrain(brainUid, "while (true) {}\nfunction updateAgent(state) {}\n"));
+  CHECK(error_msgs.str().find("Exception caught while running brain JS: Script was terminated.") != string::npos);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":3}");
+
+  CHECK(SetBrainTimeBudget(brainUid, 0));
+  CHECK(!SetBrainTimeBudget("noSuchBrain", 10));
 }
 
-void TestActorVector3Getter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float *x, float *y, float *z)
+static std::string reported_profile;
+
+void myReportProfileJson(const char *json)
 {
-  CHECK(actor_id == expected_actor_id);
-  CHECK(field_id == expected_field_id);
-  *x = actor_vec3_x;
-  *y = actor_vec3_y;
-  *z = actor_vec3_z;
+  reported_profile = json;
 }
 
-void TestActorVector3Setter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float x, float y, float z)
+void testBrainProfiling()
 {
-  CHECK(actor_id == expected_actor_id);
-  CHECK(field_id == expected_field_id);
-  actor_vec3_x = x;
-  actor_vec3_y = y;
-  actor_vec3_z = z;
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.total = getVoosModule('HotBehavior').hotLoop(state.n) + getVoosModule('ColdBehavior').coldCall();\n"
+                   "}\n"));
+  CHECK(SetModule(brainUid, "HotBehavior",
+                  "export function hotLoop(n) {\n"
+                  "  let sum = 0;\n"
+                  "  for (let i = 0; i < n; i++) sum += Math.sqrt(i);\n"
+                  "  return Math.floor(sum);\n"
+                  "}\n"));
+  CHECK(SetModule(brainUid, "ColdBehavior", "export function coldCall() { return 1; }\n"));
+
+  CHECK(!StopBrainProfiling(brainUid, myReportProfileJson));
+  CHECK(!StartBrainProfiling(brainUid, 0));
+  CHECK(StartBrainProfiling(brainUid, 100));
+  CHECK(!StartBrainProfiling(brainUid, 100));
+  {
+    CpuTimer timer("profiled ticks");
+    for (int i = 0; i < 100; i++)
+    {
+      CHECK(UpdateAgentJson(brainUid, agentUid, "{\"n\":100000}", myReportUpdatedAgentJson));
+    }
+  }
+  CHECK(StopBrainProfiling(brainUid, myReportProfileJson));
+  CHECK(reported_profile.find("{\"nodes\":[{\"id\":1,\"callFrame\":{\"functionName\":\"(root)\"") == 0);
+  CHECK(reported_profile.find("\"functionName\":\"hotLoop\",\"scriptId\":") != string::npos);
+  CHECK(reported_profile.find("\"url\":\"HotBehavior\",\"lineNumber\":0,") != string::npos);
+  CHECK(reported_profile.find("\"samples\":[") != string::npos);
+  CHECK(reported_profile.find("\"timeDeltas\":[") != string::npos);
+  CHECK(!StopBrainProfiling(brainUid, myReportProfileJson));
+
+  // Profiling again, straight to a file.
+  const char *path = "brain_profile.cpuprofile";
+  CHECK(StartBrainProfiling(brainUid, 1000));
+  for (int i = 0; i < 20; i++)
+  {
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{\"n\":1000000}", myReportUpdatedAgentJson));
+  }
+  CHECK(StopBrainProfilingToFile(brainUid, path));
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  CHECK(contents.str().find("{\"nodes\":[") == 0);
+  CHECK(contents.str().find("\"url\":\"HotBehavior\"") != string::npos);
+  file.close();
+  std::remove(path);
+  CHECK(!StartBrainProfiling("noSuchBrain", 100));
+
+  // Resetting a brain mid-profile discards the profile, but says so.
+  CHECK(StartBrainProfiling(brainUid, 100));
+  error_msgs.str("");
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) {}\n"));
+  CHECK(error_msgs.str().find("profile is discarded") != string::npos);
+  CHECK(!StopBrainProfiling(brainUid, myReportProfileJson));
 }
 
-void TestActorQuaternionGetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float *x, float *y, float *z, float *w)
+static std::string reported_trace;
+
+void myReportTraceJson(const char *json)
 {
-  CHECK(actor_id == expected_actor_id);
-  CHECK(field_id == expected_field_id);
-  *x = actor_quat_x;
-  *y = actor_quat_y;
-  *z = actor_quat_z;
-  *w = actor_quat_w;
+  reported_trace = json;
 }
 
-void TestActorQuaternionSetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float x, float y, float z, float w)
+static int countOccurrences(const std::string &haystack, const std::string &needle)
 {
-  CHECK(actor_id == expected_actor_id);
-  CHECK(field_id == expected_field_id);
-  actor_quat_x = x;
-  actor_quat_y = y;
-  actor_quat_z = z;
-  actor_quat_w = w;
+  int count = 0;
+  for (size_t pos = haystack.find(needle); pos != string::npos; pos = haystack.find(needle, pos + needle.size()))
+  {
+    count++;
+  }
+  return count;
 }
 
-void testActorBoolAccessors()
+void testBrainTracing()
 {
-  SetActorBooleanGetter(TestActorBooleanGetter);
-  SetActorBooleanSetter(TestActorBooleanSetter);
-
   const char *agentUid = "pinky";
   const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  let garbage = [];\n"
+                   "  for (let i = 0; i < 100000; i++) garbage.push({i});\n"
+                   "  state.four = callVoosService('addOne', 3);\n"
+                   "}\n"));
 
-  actor_bool_value = true;
+  CHECK(!StartBrainTracing(0));
+  CHECK(StartBrainTracing(10000));
+  {
+    CpuTimer timer("traced ticks");
+    for (int i = 0; i < 10; i++)
+    {
+      CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+    }
+  }
+  StopBrainTracing();
+  CHECK(DumpBrainTrace(myReportTraceJson));
+  CHECK(reported_trace.find("{\"traceEvents\":[{\"name\":") == 0);
+  CHECK(countOccurrences(reported_trace, "{\"name\":\"UpdateAgentJson\",\"cat\":\"update\",\"ph\":\"X\",\"ts\":") == 10);
+  CHECK(countOccurrences(reported_trace, "\"args\":{\"brain\":\"brain\"}") == 10);
+  for (const char *phase : {"parse", "createArrayBuffer", "updateAgent", "runTasks", "stringify", "report"})
+  {
+    CHECK(countOccurrences(reported_trace, std::string("{\"name\":\"") + phase + "\",\"cat\":\"phase\"") == 10);
+  }
+  CHECK(countOccurrences(reported_trace, "{\"name\":\"addOne\",\"cat\":\"service\"") == 10);
+  CHECK(reported_trace.find("\"cat\":\"gc\"") != string::npos);
+  CHECK(reported_trace.find("\"otherData\":{\"droppedEvents\":0}}") != string::npos);
 
-  CHECK(ResetBrain(brainUid,
+  // Stopped, so nothing more is recorded.
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  std::string stopped_trace = reported_trace;
+  CHECK(DumpBrainTrace(myReportTraceJson));
+  CHECK(reported_trace == stopped_trace);
+
+  // A small ring keeps only the latest events.
+  CHECK(StartBrainTracing(5));
+  for (int i = 0; i < 10; i++)
+  {
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  }
+  StopBrainTracing();
+  CHECK(DumpBrainTrace(myReportTraceJson));
+  CHECK(countOccurrences(reported_trace, "\"ph\":\"X\"") == 5);
+  CHECK(reported_trace.find("\"droppedEvents\":0}") == string::npos);
+  // The last span to end is the outermost one.
+  CHECK(reported_trace.rfind("{\"name\":\"UpdateAgentJson\"") > reported_trace.rfind("{\"name\":\"report\""));
+
+  const char *path = "brain_trace.json";
+  CHECK(DumpBrainTraceToFile(path));
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  CHECK(contents.str() == reported_trace);
+  file.close();
+  std::remove(path);
+
+  {
+    CpuTimer timer("untraced ticks");
+    for (int i = 0; i < 10; i++)
+    {
+      CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+    }
+  }
+}
+
+void testBrainSnapshot()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+
+  // Roughly the size of our real brain JS.
+  std::ostringstream brainJs;
+  brainJs << "const helpers = {};\n";
+  for (int i = 0; i < 2000; i++)
+  {
+    brainJs << "helpers.f" << i << " = function(x) { return x + " << i << "; };\n";
+  }
+  brainJs << "function updateAgent(state) {\n"
+             "  state.y = getVoosModule('FooMath')['double'](helpers.f1(state.x));\n"
+             "}\n";
+  std::string brainJsString = brainJs.str();
+  const char *moduleUids[] = {"FooMath"};
+  const char *moduleSources[] = {"export function double(x) {\n"
+                                 "  return 2 * x;\n"
+                                 "}\n"};
+
+  const int N = 20;
+  double coldMs = 0;
+  double snapshotMs = 0;
+  {
+    CpuTimer timer("Cold brain resets");
+    for (int i = 0; i < N; i++)
+    {
+      CHECK(ResetBrain(brainUid, brainJsString.c_str()));
+      CHECK(SetModule(brainUid, moduleUids[0], moduleSources[0]));
+    }
+    coldMs = timer.GetElapsedMilliSeconds() / N;
+  }
+
+  CHECK(CreateBrainSnapshot(brainJsString.c_str(), 1, moduleUids, moduleSources));
+  {
+    CpuTimer timer("Snapshot brain resets");
+    for (int i = 0; i < N; i++)
+    {
+      CHECK(ResetBrain(brainUid, brainJsString.c_str()));
+    }
+    snapshotMs = timer.GetElapsedMilliSeconds() / N;
+  }
+  cout << "Average ms/reset: cold " << coldMs << ", snapshot " << snapshotMs << endl;
+
+  // The module should already be there, without calling SetModule.
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 3}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":3,\"y\":8}");
+
+  // Different brain JS should not use the snapshot.
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.helpers = typeof helpers;\n"
+                   "}\n"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"helpers\":\"undefined\"}");
+
+  // A broken module should fail the snapshot, and keep the old one.
+  const char *badModuleSources[] = {"export function double(x) {"};
+  error_msgs.str("");
+  CHECK(!CreateBrainSnapshot(brainJsString.c_str(), 1, moduleUids, badModuleSources));
+  CHECK(error_msgs.str().find("compiling module") != string::npos);
+
+  // Resets on another thread may race with replacing and clearing the snapshot.
+  int failedResets = 0;
+  std::thread resetter([&]() {
+    for (int i = 0; i < 20; i++)
+    {
+      if (!ResetBrain(brainUid, brainJsString.c_str()))
+      {
+        failedResets++;
+      }
+    }
+  });
+  for (int i = 0; i < 4; i++)
+  {
+    CHECK(CreateBrainSnapshot(brainJsString.c_str(), 1, moduleUids, moduleSources));
+    ClearBrainSnapshot();
+  }
+  resetter.join();
+  CHECK(failedResets == 0);
+
+  ClearBrainSnapshot();
+}
+
+// Visits the regular files in a directory, with their sizes.
+void forEachFile(const std::string &directory, const std::function<void(const std::string &, long long)> &visit)
+{
+#ifdef _WIN32
+  WIN32_FIND_DATAA data;
+  HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &data);
+  if (find == INVALID_HANDLE_VALUE)
+  {
+    return;
+  }
+  do
+  {
+    if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+      visit(directory + "\\" + data.cFileName, ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow);
+    }
+  } while (FindNextFileA(find, &data));
+  FindClose(find);
+#else
+  DIR *dir = opendir(directory.c_str());
+  if (dir == nullptr)
+  {
+    return;
+  }
+  while (dirent *entry = readdir(dir))
+  {
+    std::string path = directory + "/" + entry->d_name;
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+    {
+      visit(path, (long long)info.st_size);
+    }
+  }
+  closedir(dir);
+#endif
+}
+
+long long getDirectorySize(const std::string &directory, int *fileCountOut)
+{
+  long long size = 0;
+  *fileCountOut = 0;
+  forEachFile(directory, [&](const std::string &, long long fileSize) {
+    size += fileSize;
+    (*fileCountOut)++;
+  });
+  return size;
+}
+
+void removeDirectory(const std::string &directory)
+{
+  forEachFile(directory, [](const std::string &path, long long) { std::remove(path.c_str()); });
+#ifdef _WIN32
+  RemoveDirectoryA(directory.c_str());
+#else
+  rmdir(directory.c_str());
+#endif
+}
+
+void testCodeCache()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+
+  // Make the source unique per run, so leftovers from previous runs can't hit.
+  std::ostringstream brainJs;
+  brainJs << "// Run " << time(nullptr) << "\n"
+          << "function updateAgent(state) {\n"
+             "  state.y = 2 * state.x;\n"
+             "}\n";
+  std::string brainJsString = brainJs.str();
+
+  ResetCodeCacheStats();
+  CHECK(SetCodeCacheDirectory("v8_in_unity_test_code_cache"));
+
+  int hits, misses, rejections;
+  CHECK(ResetBrain(brainUid, brainJsString.c_str()));
+  GetCodeCacheStats(&hits, &misses, &rejections);
+  CHECK(hits == 0);
+  CHECK(misses == 1);
+
+  // Also refreshes the cache entry, now that updateAgent has been compiled.
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 3}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":3,\"y\":6}");
+
+  CHECK(ResetBrain(brainUid, brainJsString.c_str()));
+  GetCodeCacheStats(&hits, &misses, &rejections);
+  CHECK(hits == 1);
+  CHECK(misses == 1);
+  CHECK(rejections == 0);
+
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 4}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":4,\"y\":8}");
+
+  // Modules are cached too, where V8 supports it, and refreshed after they
+  // have run the same way.
+  const char *cacheDirectory = "v8_in_unity_test_code_cache";
+  int filesBefore, filesAfterCompile, filesAfterRun;
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  if (state.useModule) state.y = getVoosModule('CachedModule').triple(state.x);\n"
+                   "}\n"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  getDirectorySize(cacheDirectory, &filesBefore);
+  std::ostringstream moduleJs;
+  moduleJs << "// Run " << time(nullptr) << "\n"
+           << "export function triple(x) {\n"
+              "  return 3 * x;\n"
+              "}\n";
+  CHECK(SetModule(brainUid, "CachedModule", moduleJs.str().c_str()));
+  long long sizeAfterCompile = getDirectorySize(cacheDirectory, &filesAfterCompile);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"x\": 4, \"useModule\": true}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":4,\"useModule\":true,\"y\":12}");
+  long long sizeAfterRun = getDirectorySize(cacheDirectory, &filesAfterRun);
+  if (filesAfterCompile > filesBefore)
+  {
+    CHECK(sizeAfterRun > sizeAfterCompile);
+  }
+
+  // Disabled again, nothing should be counted.
+  ResetCodeCacheStats();
+  CHECK(SetCodeCacheDirectory(""));
+  CHECK(ResetBrain(brainUid, brainJsString.c_str()));
+  GetCodeCacheStats(&hits, &misses, &rejections);
+  CHECK(hits == 0);
+  CHECK(misses == 0);
+
+  removeDirectory(cacheDirectory);
+  CHECK(getDirectorySize(cacheDirectory, &filesAfterRun) == 0 && filesAfterRun == 0);
+}
+
+void testSharedBrainIsolates()
+{
+  const char *agentUid = "pinky";
+  const int N = 16;
+  const char *brainJs =
+      "var numUpdates = 0;\n"
+      "function updateAgent(state) {\n"
+      "  numUpdates++;\n"
+      "  state.numUpdates = numUpdates;\n"
+      "}\n";
+
+  std::vector<std::string> brainUids;
+  for (int i = 0; i < N; i++)
+  {
+    brainUids.push_back("sharedTestBrain" + std::to_string(i));
+  }
+
+  long long baseHeap = GetTotalBrainHeapSize();
+  double perIsolateMs = 0;
+  {
+    CpuTimer timer("Brain resets, isolate per brain");
+    for (const std::string &brainUid : brainUids)
+    {
+      CHECK(ResetBrain(brainUid.c_str(), brainJs));
+    }
+    perIsolateMs = timer.GetElapsedMilliSeconds() / N;
+  }
+  long long perIsolateHeap = GetTotalBrainHeapSize() - baseHeap;
+
+  SetSharedBrainIsolates(1);
+  double sharedMs = 0;
+  {
+    CpuTimer timer("Brain resets, shared isolate");
+    for (const std::string &brainUid : brainUids)
+    {
+      CHECK(ResetBrain(brainUid.c_str(), brainJs));
+    }
+    sharedMs = timer.GetElapsedMilliSeconds() / N;
+  }
+  long long sharedHeap = GetTotalBrainHeapSize() - baseHeap;
+
+  cout << "Average ms/reset: isolate per brain " << perIsolateMs << ", shared " << sharedMs << endl;
+  cout << "Heap KB/brain: isolate per brain " << (perIsolateHeap / N / 1024) << ", shared " << (sharedHeap / N / 1024) << endl;
+  CHECK(sharedHeap < perIsolateHeap);
+
+  // Globals must not leak between brains in the same isolate.
+  CHECK(UpdateAgentJson(brainUids[0].c_str(), agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(UpdateAgentJson(brainUids[0].c_str(), agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"numUpdates\":2}");
+  CHECK(UpdateAgentJson(brainUids[1].c_str(), agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"numUpdates\":1}");
+
+  // Modules and services look up the right brain through the context.
+  CHECK(ResetBrain(brainUids[0].c_str(),
+                   "function updateAgent(state) {\n"
+                   "  state.y = getVoosModule('FooMath')['transform'](callVoosService('addOne', state.x));\n"
+                   "}\n"));
+  CHECK(ResetBrain(brainUids[1].c_str(),
+                   "function updateAgent(state) {\n"
+                   "  state.y = getVoosModule('FooMath')['transform'](callVoosService('addTwo', state.x));\n"
+                   "}\n"));
+  CHECK(SetModule(brainUids[0].c_str(), "FooMath", "export function transform(x) { return 2 * x; }"));
+  CHECK(SetModule(brainUids[1].c_str(), "FooMath", "export function transform(x) { return 3 * x; }"));
+  CHECK(UpdateAgentJson(brainUids[0].c_str(), agentUid, "{\"x\": 1}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":1,\"y\":4}");
+  CHECK(UpdateAgentJson(brainUids[1].c_str(), agentUid, "{\"x\": 1}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"x\":1,\"y\":9}");
+
+  // Brains can be reset from several threads at once, while the pool changes.
+  std::vector<std::thread> resetters;
+  std::vector<int> failedResets(4, 0);
+  for (int t = 0; t < 4; t++)
+  {
+    resetters.emplace_back([&brainUids, &failedResets, brainJs, t]() {
+      for (int i = 0; i < 20; i++)
+      {
+        if (!ResetBrain(brainUids[t * 4 + i % 4].c_str(), brainJs))
+        {
+          failedResets[t]++;
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 20; i++)
+  {
+    SetSharedBrainIsolates(1 + i % 3);
+  }
+  for (auto &resetter : resetters)
+  {
+    resetter.join();
+  }
+  CHECK(std::count(failedResets.begin(), failedResets.end(), 0) == 4);
+  for (const std::string &brainUid : brainUids)
+  {
+    CHECK(UpdateAgentJson(brainUid.c_str(), agentUid, "{}", myReportUpdatedAgentJson));
+  }
+
+  SetSharedBrainIsolates(0);
+}
+
+static std::vector<std::string> parallel_reported_jsons;
+
+void myReportIndexedJson(int index, const char *json)
+{
+  // Each index is only reported by one worker.
+  parallel_reported_jsons[index] = std::string(json);
+}
+
+void myPerBrainFloatGetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float *value_out)
+{
+  *value_out = (float)(actor_id + field_id);
+}
+
+void testParallelUpdateAgents()
+{
+  const int N = 16;
+  const char *brainJs =
+      "function updateAgent(state) {\n"
+      "  let sum = 0;\n"
+      "  for (let i = 0; i < 200000; i++) { sum = (sum + i * state.x) % 1000003; }\n"
+      "  state.sum = sum;\n"
+      "  state.y = callVoosService('addOne', state.x);\n"
+      "}\n";
+
+  std::vector<std::string> brainUids;
+  std::vector<std::string> agentUids;
+  std::vector<std::string> jsonIns;
+  std::vector<std::string> expected;
+  for (int i = 0; i < N; i++)
+  {
+    brainUids.push_back("parallelTestBrain" + std::to_string(i));
+    agentUids.push_back("agent" + std::to_string(i));
+    jsonIns.push_back("{\"x\":" + std::to_string(i) + "}");
+    CHECK(ResetBrain(brainUids[i].c_str(), brainJs));
+    CHECK(UpdateAgentJson(brainUids[i].c_str(), agentUids[i].c_str(), jsonIns[i].c_str(), myReportUpdatedAgentJson));
+    expected.push_back(reported_json);
+  }
+
+  std::vector<const char *> brainUidPtrs, agentUidPtrs, jsonInPtrs;
+  for (int i = 0; i < N; i++)
+  {
+    brainUidPtrs.push_back(brainUids[i].c_str());
+    agentUidPtrs.push_back(agentUids[i].c_str());
+    jsonInPtrs.push_back(jsonIns[i].c_str());
+  }
+
+  const int threadCounts[] = {1, 2, 4, 8, 16};
+  for (int numThreads : threadCounts)
+  {
+    SetBrainWorkerThreads(numThreads);
+    parallel_reported_jsons.assign(N, "");
+    bool results[N];
+    double ms = 0;
+    {
+      CpuTimer timer("Parallel ticks");
+      CHECK(UpdateAgentsJsonParallel(N, brainUidPtrs.data(), agentUidPtrs.data(), jsonInPtrs.data(),
+                                     nullptr, nullptr, myReportIndexedJson, results) == N);
+      ms = timer.GetElapsedMilliSeconds();
+    }
+    cout << numThreads << " worker threads: " << (N * 1000.0 / ms) << " ticks/s" << endl;
+    for (int i = 0; i < N; i++)
+    {
+      CHECK(results[i]);
+      CHECK(parallel_reported_jsons[i] == expected[i]);
+    }
+  }
+
+  // Brains can be reset and the pool replaced while batches run.
+  std::thread resetter([&]() {
+    for (int i = 0; i < 5; i++)
+    {
+      CHECK(ResetBrain(brainUids[5].c_str(), brainJs));
+      SetBrainWorkerThreads(1 + i % 2);
+    }
+  });
+  for (int i = 0; i < 5; i++)
+  {
+    bool results[N];
+    CHECK(UpdateAgentsJsonParallel(N, brainUidPtrs.data(), agentUidPtrs.data(), jsonInPtrs.data(),
+                                   nullptr, nullptr, myReportIndexedJson, results) == N);
+  }
+  resetter.join();
+
+  // Unknown brains fail on their own, without taking the batch down.
+  brainUidPtrs[3] = "noSuchBrain";
+  bool results[N];
+  parallel_reported_jsons.assign(N, "");
+  CHECK(UpdateAgentsJsonParallel(N, brainUidPtrs.data(), agentUidPtrs.data(), jsonInPtrs.data(),
+                                 nullptr, nullptr, myReportIndexedJson, results) == N - 1);
+  CHECK(!results[3]);
+  CHECK(results[4]);
+  CHECK(parallel_reported_jsons[3] == "");
+
+  // Per-brain callbacks override the global ones, and survive resets.
+  BrainHostCallbacks callbacks = {};
+  callbacks.getActorFloat = myPerBrainFloatGetter;
+  CHECK(SetBrainHostCallbacks(brainUids[0].c_str(), &callbacks));
+  CHECK(!SetBrainHostCallbacks("noSuchBrain", &callbacks));
+  CHECK(ResetBrain(brainUids[0].c_str(),
+                   "function updateAgent(state) {\n"
+                   "  state.f = getActorFloat(12, 34);\n"
+                   "  state.y = callVoosService('addTwo', 1);\n"
+                   "}\n"));
+  CHECK(UpdateAgentJson(brainUids[0].c_str(), agentUids[0].c_str(), "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"f\":46,\"y\":3}");
+
+  // Brains sharing an isolate still get their own callbacks.
+  const char *floatBrainJs =
+      "function updateAgent(state) {\n"
+      "  state.f = getActorFloat(12, 34);\n"
+      "}\n";
+  SetSharedBrainIsolates(1);
+  CHECK(ResetBrain(brainUids[0].c_str(), floatBrainJs));
+  CHECK(ResetBrain(brainUids[1].c_str(), floatBrainJs));
+  for (int i = 0; i < 2; i++)
+  {
+    CHECK(UpdateAgentJson(brainUids[0].c_str(), agentUids[0].c_str(), "{}", myReportUpdatedAgentJson));
+    CHECK(reported_json == "{\"f\":46}");
+    error_msgs.str("");
+    CHECK(UpdateAgentJson(brainUids[1].c_str(), agentUids[1].c_str(), "{}", myReportUpdatedAgentJson));
+    CHECK(reported_json == "{}");
+    CHECK(error_msgs.str().find("No ACTOR_FLOAT_GETTER set") != string::npos);
+  }
+  SetSharedBrainIsolates(0);
+
+  SetBrainWorkerThreads(0);
+}
+
+// Host side of the binary tick channel.
+class BinaryWriter
+{
+public:
+  template <typename T>
+  BinaryWriter &Put(const T &value)
+  {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    data.insert(data.end(), bytes, bytes + sizeof(T));
+    return *this;
+  }
+
+  BinaryWriter &PutString(const std::string &value)
+  {
+    Put((unsigned int)value.size());
+    data.insert(data.end(), value.begin(), value.end());
+    return *this;
+  }
+
+  std::vector<char> data;
+};
+
+template <typename T>
+T GetBinary(const std::vector<char> &data, size_t *offset)
+{
+  T value;
+  memcpy(&value, data.data() + *offset, sizeof(T));
+  *offset += sizeof(T);
+  return value;
+}
+
+const unsigned int BINARY_MAGIC = 0x534F4F56;
+
+void testUpdateAgentBinary()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "binaryBrain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.hp -= 1;\n"
+                   "  state.alive = state.hp > 0;\n"
+                   "  state.name += '!';\n"
+                   "  state.pos.x += 1;\n"
+                   "  state.count = state.path.length;\n"
+                   "  state.path = [state.path[0] * 2, 0.5];\n"
+                   "}\n"));
+  CHECK(SetBinaryTickSchemas(brainUid, "hp:f32,alive:bool,name:str,pos:vec3,path:f32[]", 1,
+                             "hp:f32,alive:bool,name:str,pos:vec3,count:i32,path:f32[],missing:quat", 2));
+  CHECK(!SetBinaryTickSchemas(brainUid, "hp:float", 1, "", 1));
+
+  BinaryWriter request;
+  request.Put(BINARY_MAGIC).Put(1u);
+  request.Put(1.0f).Put((unsigned char)1).PutString("bob").Put(1.0f).Put(2.0f).Put(3.0f);
+  request.Put(3u).Put(4.0f).Put(5.0f).Put(6.0f);
+
+  std::vector<char> response(256);
+  int size = UpdateAgentBinary(brainUid, agentUid, request.data.data(), (int)request.data.size(), nullptr, 0, response.data(), (int)response.size());
+  CHECK(size == 8 + 4 + 1 + 4 + 4 + 12 + 4 + 4 + 8 + 16);
+
+  size_t offset = 0;
+  CHECK(GetBinary<unsigned int>(response, &offset) == BINARY_MAGIC);
+  CHECK(GetBinary<unsigned int>(response, &offset) == 2);
+  CHECK(GetBinary<float>(response, &offset) == 0.0f);
+  CHECK(GetBinary<unsigned char>(response, &offset) == 0);
+  CHECK(GetBinary<unsigned int>(response, &offset) == 4);
+  CHECK(std::string(response.data() + offset, 4) == "bob!");
+  offset += 4;
+  CHECK(GetBinary<float>(response, &offset) == 2.0f);
+  CHECK(GetBinary<float>(response, &offset) == 2.0f);
+  CHECK(GetBinary<float>(response, &offset) == 3.0f);
+  CHECK(GetBinary<int>(response, &offset) == 3);
+  CHECK(GetBinary<unsigned int>(response, &offset) == 2);
+  CHECK(GetBinary<float>(response, &offset) == 8.0f);
+  CHECK(GetBinary<float>(response, &offset) == 0.5f);
+  CHECK(GetBinary<float>(response, &offset) == 0.0f);
+
+  // Too small a buffer says how much is needed, and keeps the response.
+  std::vector<char> small(8);
+  CHECK(UpdateAgentBinary(brainUid, agentUid, request.data.data(), (int)request.data.size(), nullptr, 0, small.data(), (int)small.size()) == -size);
+  std::vector<char> retried(size);
+  CHECK(TakeBinaryResponse(brainUid, retried.data(), size) == size);
+  CHECK(std::equal(retried.begin(), retried.end(), response.begin()));
+  CHECK(TakeBinaryResponse(brainUid, retried.data(), size) == 0);
+
+  // Schemas survive resets.
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) { state.count = state.name.length; }"));
+  // The name loses its "!", and the path keeps its 3 elements instead of 2.
+  CHECK(UpdateAgentBinary(brainUid, agentUid, request.data.data(), (int)request.data.size(), nullptr, 0, response.data(), (int)response.size()) == size - 1 + 4);
+  offset = 8 + 4 + 1 + 4 + 3 + 12;
+  CHECK(GetBinary<int>(response, &offset) == 3);
+
+  // Wrong version, truncated and overlong requests are all rejected.
+  std::vector<char> bad = request.data;
+  bad[4] = 7;
+  CHECK(UpdateAgentBinary(brainUid, agentUid, bad.data(), (int)bad.size(), nullptr, 0, response.data(), (int)response.size()) == 0);
+  CHECK(UpdateAgentBinary(brainUid, agentUid, request.data.data(), (int)request.data.size() - 1, nullptr, 0, response.data(), (int)response.size()) == 0);
+  bad = request.data;
+  bad.push_back(0);
+  CHECK(UpdateAgentBinary(brainUid, agentUid, bad.data(), (int)bad.size(), nullptr, 0, response.data(), (int)response.size()) == 0);
+
+  // Compare with the JSON path, on the same state.
+  const int N = 2000;
+  const char *benchJs =
+      "function updateAgent(state) {\n"
+      "  state.pos.x += state.vel.x; state.pos.y += state.vel.y; state.pos.z += state.vel.z;\n"
+      "  state.hp -= 0.5;\n"
+      "}\n";
+  CHECK(ResetBrain(brainUid, benchJs));
+  CHECK(SetBinaryTickSchemas(brainUid, "hp:f32,name:str,pos:vec3,vel:vec3,path:f32[]", 1, "hp:f32,pos:vec3", 1));
+
+  std::ostringstream json;
+  json << "{\"hp\":10,\"name\":\"bob\",\"pos\":{\"x\":1,\"y\":2,\"z\":3},\"vel\":{\"x\":0.5,\"y\":0,\"z\":-0.5},\"path\":[";
+  BinaryWriter benchRequest;
+  benchRequest.Put(BINARY_MAGIC).Put(1u).Put(10.0f).PutString("bob");
+  benchRequest.Put(1.0f).Put(2.0f).Put(3.0f).Put(0.5f).Put(0.0f).Put(-0.5f).Put(64u);
+  for (int i = 0; i < 64; i++)
+  {
+    json << (i > 0 ? "," : "") << i;
+    benchRequest.Put((float)i);
+  }
+  json << "]}";
+  std::string jsonIn = json.str();
+
+  double jsonMs = 0;
+  {
+    CpuTimer timer("JSON ticks");
+    for (int i = 0; i < N; i++)
+    {
+      UpdateAgentJson(brainUid, agentUid, jsonIn.c_str(), myReportUpdatedAgentJson);
+    }
+    jsonMs = timer.GetElapsedMilliSeconds();
+  }
+  double binaryMs = 0;
+  bool allOk = true;
+  {
+    CpuTimer timer("Binary ticks");
+    for (int i = 0; i < N; i++)
+    {
+      allOk = allOk && UpdateAgentBinary(brainUid, agentUid, benchRequest.data.data(), (int)benchRequest.data.size(), nullptr, 0, response.data(), (int)response.size()) > 0;
+    }
+    binaryMs = timer.GetElapsedMilliSeconds();
+  }
+  CHECK(allOk);
+  offset = 8;
+  CHECK(GetBinary<float>(response, &offset) == 9.5f);
+  CHECK(GetBinary<float>(response, &offset) == 1.5f);
+  cout << "Average us/tick: JSON " << (jsonMs * 1000 / N) << ", binary " << (binaryMs * 1000 / N) << endl;
+}
+
+void testUpdateAgentDelta()
+{
+  const char *brainUid = "deltaBrain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.ticks = (state.ticks || 0) + 1;\n"
+                   "  if (state.hp !== undefined && state.hp <= 0) { delete state.hp; state.dead = true; }\n"
+                   "  if (state.moving) { state.pos.x += 1; }\n"
+                   "}\n"));
+
+  // The first patch is the whole state.
+  CHECK(UpdateAgentDelta(brainUid, "a", "{\"hp\":3,\"name\":\"bob\",\"moving\":false,\"pos\":{\"x\":0,\"y\":5}}", nullptr, 0, myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":1}");
+
+  // State persists, and only touched fields come back.
+  CHECK(UpdateAgentDelta(brainUid, "a", "{\"moving\":true}", nullptr, 0, myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":2,\"pos\":{\"x\":1,\"y\":5}}");
+
+  // Nested patches merge, nulls delete, and deletes come back as nulls.
+  CHECK(UpdateAgentDelta(brainUid, "a", "{\"pos\":{\"y\":null,\"z\":2},\"hp\":0,\"moving\":null}", nullptr, 0, myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":3,\"hp\":null,\"dead\":true}");
+  CHECK(UpdateAgentDelta(brainUid, "a", "{\"moving\":true}", nullptr, 0, myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":4,\"pos\":{\"x\":2,\"z\":2}}");
+
+  // Agents are separate.
+  CHECK(UpdateAgentDelta(brainUid, "b", "{}", nullptr, 0, myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":1}");
+
+  CHECK(ForgetAgentState(brainUid, "a"));
+  CHECK(!ForgetAgentState(brainUid, "a"));
+  CHECK(UpdateAgentDelta(brainUid, "a", "{}", nullptr, 0, myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"ticks\":1}");
+
+  error_msgs.str("");
+  CHECK(!UpdateAgentDelta(brainUid, "a", "[1,2]", nullptr, 0, myReportUpdatedAgentJson));
+  CHECK(error_msgs.str().find("must be a JSON object") != std::string::npos);
+
+  // A big world, where each tick only changes a little.
+  const int N = 500;
+  std::ostringstream bigState;
+  bigState << "{\"moving\":false,\"pos\":{\"x\":0},\"inventory\":[";
+  for (int i = 0; i < 1000; i++)
+  {
+    bigState << (i > 0 ? "," : "") << "{\"id\":" << i << ",\"name\":\"item" << i << "\"}";
+  }
+  bigState << "]}";
+  std::string full = bigState.str();
+  CHECK(UpdateAgentDelta(brainUid, "big", full.c_str(), nullptr, 0, myReportUpdatedAgentJson));
+  {
+    CpuTimer timer("Full state ticks");
+    for (int i = 0; i < N; i++)
+    {
+      UpdateAgentJson(brainUid, "big", full.c_str(), myReportUpdatedAgentJson);
+    }
+  }
+  {
+    CpuTimer timer("Delta state ticks");
+    for (int i = 0; i < N; i++)
+    {
+      UpdateAgentDelta(brainUid, "big", "{\"moving\":true}", nullptr, 0, myReportUpdatedAgentJson);
+    }
+  }
+  std::ostringstream expected;
+  expected << "{\"ticks\":" << (N + 1) << ",\"pos\":{\"x\":" << N << "}}";
+  CHECK(reported_json == expected.str());
+}
+
+void testUpdateAgentJsonToBuffer()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "bufferBrain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.greeting = 'héllo ' + state.name;\n"
+                   "}\n"));
+
+  // Without a buffer, we just learn the size.
+  const std::string expected = "{\"name\":\"" + std::string(20, 'x') + "\",\"greeting\":\"h\xC3\xA9llo " + std::string(20, 'x') + "\"}";
+  std::string jsonIn = "{\"name\":\"" + std::string(20, 'x') + "\"}";
+  CHECK(UpdateAgentJsonToBuffer(brainUid, agentUid, jsonIn.c_str(), nullptr, 0) == -(int)expected.size());
+
+  // Grow and retry, without ticking again.
+  std::vector<char> buffer(expected.size());
+  CHECK(SetResultBuffer(brainUid, buffer.data(), (int)buffer.size()));
+  CHECK(TakePendingResult(brainUid) == (int)expected.size());
+  CHECK(std::string(buffer.data(), buffer.size()) == expected);
+  CHECK(TakePendingResult(brainUid) == -1);
+  CHECK(TakePendingResult("noSuchBrain") == -1);
+
+  // Exactly full buffers are measured first, then written.
+  std::fill(buffer.begin(), buffer.end(), 0);
+  CHECK(UpdateAgentJsonToBuffer(brainUid, agentUid, jsonIn.c_str(), nullptr, 0) == (int)expected.size());
+  CHECK(std::string(buffer.data(), buffer.size()) == expected);
+
+  // The buffer survives resets, and binary responses can use it too.
+  std::vector<char> bigBuffer(1024);
+  CHECK(SetResultBuffer(brainUid, bigBuffer.data(), (int)bigBuffer.size()));
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) { state.x = 1; }"));
+  CHECK(UpdateAgentJsonToBuffer(brainUid, agentUid, "{}", nullptr, 0) == 7);
+  CHECK(std::string(bigBuffer.data(), 7) == "{\"x\":1}");
+  CHECK(SetBinaryTickSchemas(brainUid, "", 1, "x:i32", 1));
+  unsigned int header[2] = {0x534F4F56, 1};
+  CHECK(UpdateAgentBinary(brainUid, agentUid, header, sizeof(header), nullptr, 0, nullptr, 0) == 12);
+  size_t offset = 8;
+  CHECK(GetBinary<int>(bigBuffer, &offset) == 1);
+
+  CHECK(UpdateAgentJsonToBuffer("noSuchBrain", agentUid, "{}", nullptr, 0) == 0);
+
+  const int N = 2000;
+  std::string bigJsonIn = "{\"name\":\"" + std::string(1000, 'x') + "\"}";
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) { state.n = state.name.length; }"));
+  {
+    CpuTimer timer("Reported result ticks");
+    for (int i = 0; i < N; i++)
+    {
+      UpdateAgentJson(brainUid, agentUid, bigJsonIn.c_str(), myReportUpdatedAgentJson);
+    }
+  }
+  bool allOk = true;
+  {
+    CpuTimer timer("Buffered result ticks");
+    for (int i = 0; i < N; i++)
+    {
+      allOk = allOk && UpdateAgentJsonToBuffer(brainUid, agentUid, bigJsonIn.c_str(), nullptr, 0) > 0;
+    }
+  }
+  CHECK(allOk);
+  CHECK(SetResultBuffer(brainUid, nullptr, 0));
+}
+
+void testPumpPromisesMessageLoopCalledAfterUpdateAgent()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.resolved = false;\n"
+                   "  const p = Promise.resolve(1).then(() => state.resolved = true);\n"
+                   "}\n"));
+
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"resolved\":true}");
+}
+
+void testBasicService()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.four = callVoosService('addOne', 3);\n"
+                   "  state.five = callVoosService('addTwo', 3);\n"
+                   "}\n"));
+
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  std::cout << reported_json;
+  CHECK(reported_json == "{\"four\":4,\"five\":5}");
+}
+
+static std::vector<int> service_batch_sizes;
+
+void myCallServicesBatchFunction(int count, const char *serviceNames[], const char *argsJsons[], ReportIndexedServiceResultFunction reportResult)
+{
+  service_batch_sizes.push_back(count);
+  // Report out of order, and leave unknown services unreported.
+  for (int i = count - 1; i >= 0; i--)
+  {
+    if (strcmp(serviceNames[i], "double") == 0)
+    {
+      std::ostringstream result;
+      result << (atoi(argsJsons[i]) * 2);
+      reportResult(i, result.str().c_str());
+    }
+  }
+}
+
+void testAsyncService()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "async function quadruple(x) {\n"
+                   "  const doubled = await callVoosServiceAsync('double', x);\n"
+                   "  return await callVoosServiceAsync('double', doubled);\n"
+                   "}\n"
+                   "function updateAgent(state) {\n"
+                   "  Promise.all([quadruple(1), quadruple(2)]).then(values => state.values = values);\n"
+                   "  callVoosServiceAsync('unknown', 0).catch(e => state.error = e.message);\n"
+                   "  state.sync = callVoosService('addOne', 1);\n"
+                   "}\n"
+                   "function postMessageFlush(state) {\n"
+                   "  state.flushed = state.values !== undefined;\n"
+                   "}\n"));
+
+  SetCallServicesBatchFunction(myCallServicesBatchFunction);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"sync\":2,\"error\":\"Host service 'unknown' never reported back results.\",\"values\":[4,8],\"flushed\":true}");
+  // One batch for the first requests, and one for the follow-ups.
+  CHECK(service_batch_sizes.size() == 2);
+  CHECK(service_batch_sizes[0] == 3);
+  CHECK(service_batch_sizes[1] == 2);
+
+  // Per-brain batch functions win.
+  BrainHostCallbacks callbacks = {};
+  callbacks.callServicesBatch = myCallServicesBatchFunction;
+  CHECK(SetBrainHostCallbacks(brainUid, &callbacks));
+  SetCallServicesBatchFunction(nullptr);
+  service_batch_sizes.clear();
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(service_batch_sizes.size() == 2);
+  BrainHostCallbacks noCallbacks = {};
+  CHECK(SetBrainHostCallbacks(brainUid, &noCallbacks));
+
+  // Without a batch function, each request goes to the call-service-function.
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  callVoosServiceAsync('addOne', 1).then(x => callVoosServiceAsync('addTwo', x)).then(x => state.x = x);\n"
+                   "  callVoosServiceAsync('', 1).catch(e => state.error = e.message);\n"
+                   "}\n"));
+  service_batch_sizes.clear();
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"error\":\"callVoosServiceAsync needs a service name.\",\"x\":4}");
+  CHECK(service_batch_sizes.empty());
+
+  // Calls made by a failed tick are rejected, not sent with the next tick.
+  CHECK(ResetBrain(brainUid,
+                   "var rejection;\n"
+                   "function updateAgent(state) {\n"
+                   "  state.rejection = rejection;\n"
+                   "  if (state.fail) {\n"
+                   "    callVoosServiceAsync('double', 1).then(x => state.x = x, e => rejection = e.message);\n"
+                   "    throw new Error('failed');\n"
+                   "  }\n"
+                   "}\n"));
+  SetCallServicesBatchFunction(myCallServicesBatchFunction);
+  service_batch_sizes.clear();
+  error_msgs.str("");
+  CHECK(!UpdateAgentJson(brainUid, agentUid, "{\"fail\":true}", myReportUpdatedAgentJson));
+  CHECK(error_msgs.str().find("failed") != string::npos);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"rejection\":\"Host service 'double' was not called, because its tick failed.\"}");
+  CHECK(service_batch_sizes.empty());
+  SetCallServicesBatchFunction(nullptr);
+}
+
+static int typed_service_calls = 0;
+
+int myTypedServiceFunction(const char *serviceName, const char *args, int argsLength, char *result, int resultCapacity)
+{
+  typed_service_calls++;
+  if (strcmp(serviceName, "overlapSphere") == 0)
+  {
+    // center:vec3,radius:f32 -> count:i32,nearest:vec3,distances:f32[]
+    CHECK(argsLength == 16);
+    float center[3], radius;
+    memcpy(center, args, sizeof(center));
+    memcpy(&radius, args + 12, sizeof(radius));
+    int size = 4 + 12 + 4 + 2 * 4;
+    if (size > resultCapacity)
+    {
+      return size;
+    }
+    int count = 2;
+    float nearest[3] = {center[0] + radius, center[1], center[2]};
+    uint32_t num_distances = 2;
+    float distances[2] = {radius, radius * 2};
+    memcpy(result, &count, 4);
+    memcpy(result + 4, nearest, 12);
+    memcpy(result + 16, &num_distances, 4);
+    memcpy(result + 20, distances, 8);
+    return size;
+  }
+  if (strcmp(serviceName, "project") == 0)
+  {
+    // p:vec3,scale:f64 -> p:vec3,hit:bool
+    if (argsLength != 20)
+    {
+      return -1;
+    }
+    float p[3];
+    double scale;
+    memcpy(p, args, sizeof(p));
+    memcpy(&scale, args + 12, sizeof(scale));
+    if (resultCapacity < 13)
+    {
+      return 13;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      p[i] = (float)(p[i] * scale);
+    }
+    memcpy(result, p, sizeof(p));
+    result[12] = 1;
+    return 13;
+  }
+  if (strcmp(serviceName, "manyValues") == 0)
+  {
+    CHECK(argsLength == 0);
+    uint32_t count = 1000;
+    int size = 4 + count * 4;
+    if (size > resultCapacity)
+    {
+      return size;
+    }
+    memcpy(result, &count, 4);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      float value = (float)i;
+      memcpy(result + 4 + i * 4, &value, 4);
+    }
+    return size;
+  }
+  return -1;
+}
+
+void testTaskBudget()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "let done = 0;\n"
+                   "function work(x) {\n"
+                   "  let sum = 0;\n"
+                   "  for (let i = 0; i < 20000; i++) sum += i % (x + 1);\n"
+                   "  done++;\n"
+                   "}\n"
+                   "function updateAgent(state) {\n"
+                   "  for (let i = 0; i < (state.spawn || 0); i++) callVoosServiceAsync('double', i).then(work);\n"
+                   "  Promise.resolve().then(() => state.done = done);\n"
+                   "}\n"));
+  SetCallServicesBatchFunction(myCallServicesBatchFunction);
+  const int spawn = 2000;
+  const std::string spawnState = "{\"spawn\":" + std::to_string(spawn) + "}";
+
+  // By default, the whole burst lands in one tick.
+  BrainTaskStatistics stats;
+  {
+    CpuTimer timer("burst of async work in one tick");
+    CHECK(UpdateAgentJson(brainUid, agentUid, spawnState.c_str(), myReportUpdatedAgentJson));
+  }
+  CHECK(GetBrainTaskStatistics(brainUid, &stats));
+  CHECK(stats.deferredTasks == 0);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"done\":" + std::to_string(spawn) + "}");
+
+  // With a budget, it spreads over several ticks.
+  CHECK(!SetBrainTaskBudget(brainUid, -1));
+  CHECK(SetBrainTaskBudget(brainUid, 2));
+  CHECK(UpdateAgentJson(brainUid, agentUid, spawnState.c_str(), myReportUpdatedAgentJson));
+  CHECK(GetBrainTaskStatistics(brainUid, &stats));
+  CHECK(stats.deferredServiceResults > 0);
+  CHECK(stats.deferredTasks >= stats.deferredServiceResults);
+  CHECK(stats.microtaskCheckpoints > 0);
+  int ticks = 1;
+  double maxTaskMs = stats.taskMs;
+  {
+    CpuTimer timer("burst of async work with a 2 ms task budget");
+    while (stats.deferredTasks > 0 && ticks < 1000)
+    {
+      CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+      CHECK(GetBrainTaskStatistics(brainUid, &stats));
+      maxTaskMs = std::max(maxTaskMs, stats.taskMs);
+      ticks++;
+    }
+  }
+  std::cout << "Budgeted burst took " << ticks << " ticks, at most " << maxTaskMs << " ms of tasks each" << std::endl;
+  CHECK(ticks > 2);
+  CHECK(stats.deferredTasks == 0);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"done\":" + std::to_string(2 * spawn) + "}");
+
+  // Kept across resets.
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) { callVoosServiceAsync('double', 1).then(x => state.x = x); }"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(GetBrainTaskStatistics(brainUid, &stats));
+  CHECK(stats.deferredTasks == 0);
+  CHECK(reported_json == "{\"x\":2}");
+  CHECK(SetBrainTaskBudget(brainUid, 0));
+  CHECK(!GetBrainTaskStatistics("noSuchBrain", &stats));
+
+  // A budgeted brain's deferred work stays its own, even with shared isolates.
+  SetSharedBrainIsolates(1);
+  CHECK(ResetBrain("neighbor", "function updateAgent(state) { Promise.resolve().then(() => state.x = 1); }"));
+  const char *budgetedJs = "function updateAgent(state) {\n"
+                           "  for (let i = 0; i < (state.spawn || 0); i++) {\n"
+                           "    callVoosServiceAsync('double', i).then(() => callVoosService('markBudgetedWork', 0));\n"
+                           "  }\n"
+                           "}\n";
+  CHECK(ResetBrain("budgeted", budgetedJs));
+  CHECK(SetBrainTaskBudget("budgeted", 0.001));
+  CHECK(ResetBrain("budgeted", budgetedJs));
+  budgeted_work_elsewhere = 0;
+  ticking_brain = "budgeted";
+  CHECK(UpdateAgentJson("budgeted", agentUid, spawnState.c_str(), myReportUpdatedAgentJson));
+  CHECK(GetBrainTaskStatistics("budgeted", &stats));
+  CHECK(stats.deferredTasks > 0);
+  for (ticks = 0; stats.deferredTasks > 0 && ticks < 1000; ticks++)
+  {
+    ticking_brain = "neighbor";
+    CHECK(UpdateAgentJson("neighbor", agentUid, "{}", myReportUpdatedAgentJson));
+    CHECK(reported_json == "{\"x\":1}");
+    ticking_brain = "budgeted";
+    CHECK(UpdateAgentJson("budgeted", agentUid, "{}", myReportUpdatedAgentJson));
+    CHECK(GetBrainTaskStatistics("budgeted", &stats));
+  }
+  CHECK(stats.deferredTasks == 0);
+  CHECK(budgeted_work_elsewhere == 0);
+  ticking_brain.clear();
+  SetSharedBrainIsolates(0);
+  SetCallServicesBatchFunction(nullptr);
+}
+
+void testTypedService()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  CHECK(RegisterTypedService("overlapSphere", "center:vec3,radius:f32", "count:i32,nearest:vec3,distances:f32[]", myTypedServiceFunction));
+  CHECK(RegisterTypedService("project", "p:vec3,scale:f64", "p:vec3,hit:bool", myTypedServiceFunction));
+  CHECK(RegisterTypedService("manyValues", "", "values:f32[]", myTypedServiceFunction));
+  CHECK(RegisterTypedService("failing", "", "", myTypedServiceFunction));
+  CHECK(!RegisterTypedService("bad", "x:nope", "", myTypedServiceFunction));
+
+  CHECK(ResetBrain(brainUid,
+                   "const out = new Float32Array(4);\n"
+                   "function updateAgent(state) {\n"
+                   "  const hits = callVoosService('overlapSphere', {center: {x: 1, y: 2, z: 3}, radius: 0.5});\n"
+                   "  state.count = hits.count;\n"
+                   "  state.nearest = hits.nearest;\n"
+                   "  state.distances = Array.from(hits.distances);\n"
+                   "  state.projected = callVoosService('project', new Float32Array([1, 2, 3, 2]));\n"
+                   "  state.sameOut = callVoosService('project', [1, 2, 3, 3], out) === out;\n"
+                   "  state.out = Array.from(out);\n"
+                   "  state.numValues = callVoosService('manyValues', {}).values.length;\n"
+                   "  state.failed = callVoosService('failing', {});\n"
+                   "  state.wrongCount = callVoosService('project', [1, 2]);\n"
+                   "  state.four = callVoosService('addOne', 3);\n"
+                   "}\n"));
+
+  error_msgs.str("");
+  typed_service_calls = 0;
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"count\":2,\"nearest\":{\"x\":1.5,\"y\":2,\"z\":3},\"distances\":[0.5,1],"
+                         "\"projected\":{\"p\":{\"x\":2,\"y\":4,\"z\":6},\"hit\":true},\"sameOut\":true,\"out\":[3,6,9,1],"
+                         "\"numValues\":1000,\"four\":4}");
+  // manyValues is called again once the result buffer has grown.
+  CHECK(typed_service_calls == 6);
+  CHECK(error_msgs.str().find("Typed service 'failing' failed") != std::string::npos);
+  CHECK(error_msgs.str().find("Typed service 'project' takes 4 numbers, but got 2.") != std::string::npos);
+
+  // Compare with the same call through JSON.
+  CHECK(ResetBrain(brainUid,
+                   "const out = new Float32Array(4);\n"
+                   "const args = new Float32Array([1, 2, 3, 2]);\n"
+                   "function updateAgent(state) {\n"
+                   "  for (let i = 0; i < 100000; i++) callVoosService(state.service, args, out);\n"
+                   "}\n"));
+  {
+    CpuTimer timer("Typed service calls");
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{\"service\":\"project\"}", myReportUpdatedAgentJson));
+  }
+  {
+    CpuTimer timer("JSON service calls");
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{\"service\":\"addOne\"}", myReportUpdatedAgentJson));
+  }
+
+  // Results with bytes left over are rejected, also when read into an array.
+  CHECK(RegisterTypedService("project", "p:vec3,scale:f64", "p:vec3", myTypedServiceFunction));
+  CHECK(ResetBrain(brainUid,
+                   "const out = new Float32Array(3);\n"
+                   "function updateAgent(state) {\n"
+                   "  state.obj = callVoosService('project', [1, 2, 3, 2]);\n"
+                   "  state.arr = callVoosService('project', [1, 2, 3, 2], out);\n"
+                   "}\n"));
+  error_msgs.str("");
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{}");
+  CHECK(countOccurrences(error_msgs.str(), "Result of typed service 'project' does not match its schema 'p:vec3'.") == 2);
+
+  CHECK(RegisterTypedService("project", nullptr, nullptr, nullptr));
+  CHECK(!RegisterTypedService("project", nullptr, nullptr, nullptr));
+  CHECK(RegisterTypedService("overlapSphere", nullptr, nullptr, nullptr));
+  CHECK(RegisterTypedService("manyValues", nullptr, nullptr, nullptr));
+  CHECK(RegisterTypedService("failing", nullptr, nullptr, nullptr));
+}
+
+void testVeryLongLogMessage()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  sysError('x'.repeat(10 * 1024 * 1024));\n"
+                   "}\n"));
+  error_msgs.str("");
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(error_msgs.str().length() == 0);
+}
+
+void testVeryLongCode()
+{
+  const char *brainUid = "brain";
+  std::string code(10 * 1024 * 1024, 'x');
+  CHECK(!ResetBrain(brainUid, code.c_str()));
+}
+
+void testUpdateAgentArrayBuffer()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+
+  std::vector<uint8_t> buf(1);
+  buf[0] = 42;
+
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(foo, buffer) {"
+                   "  const view = new DataView(buffer);"
+                   "  if(view.getUint8(0) != 42) throw 'ahhh';"
+                   "  view.setUint8(0, 123);"
+                   "}"));
+
+  CHECK(UpdateAgentJsonBytes(brainUid, agentUid, "{}", &buf[0], (int)buf.size(), myReportUpdatedAgentJson));
+  CHECK(buf[0] == 123);
+}
+
+void testUnjsonbleResponseDoesNotCrash()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+
+  std::vector<uint8_t> buf(1);
+  buf[0] = 42;
+
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(obj) {"
+                   "  obj['cycle'] = obj;"
+                   "}"));
+
+  error_msgs.str("");
+  CHECK(false == UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(error_msgs.str().find("Could not JSON::Stringify object") != string::npos);
+}
+
+TEMP_ACTOR_ID expected_actor_id = 12;
+TEMP_ACTOR_ID expected_field_id = 34;
+bool actor_bool_value = false;
+
+float actor_vec3_x = 0.1f;
+float actor_vec3_y = 0.1f;
+float actor_vec3_z = 0.1f;
+
+float actor_quat_x = 0.1f;
+float actor_quat_y = 0.1f;
+float actor_quat_z = 0.1f;
+float actor_quat_w = 0.1f;
+
+void TestActorBooleanGetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, bool *value_out)
+{
+  CHECK(actor_id == expected_actor_id);
+  CHECK(field_id == expected_field_id);
+  *value_out = actor_bool_value;
+}
+void TestActorBooleanSetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, bool value)
+{
+  CHECK(actor_id == expected_actor_id);
+  CHECK(field_id == expected_field_id);
+  actor_bool_value = value;
+}
+
+void TestActorVector3Getter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float *x, float *y, float *z)
+{
+  CHECK(actor_id == expected_actor_id);
+  CHECK(field_id == expected_field_id);
+  *x = actor_vec3_x;
+  *y = actor_vec3_y;
+  *z = actor_vec3_z;
+}
+
+void TestActorVector3Setter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float x, float y, float z)
+{
+  CHECK(actor_id == expected_actor_id);
+  CHECK(field_id == expected_field_id);
+  actor_vec3_x = x;
+  actor_vec3_y = y;
+  actor_vec3_z = z;
+}
+
+void TestActorQuaternionGetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float *x, float *y, float *z, float *w)
+{
+  CHECK(actor_id == expected_actor_id);
+  CHECK(field_id == expected_field_id);
+  *x = actor_quat_x;
+  *y = actor_quat_y;
+  *z = actor_quat_z;
+  *w = actor_quat_w;
+}
+
+void TestActorQuaternionSetter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float x, float y, float z, float w)
+{
+  CHECK(actor_id == expected_actor_id);
+  CHECK(field_id == expected_field_id);
+  actor_quat_x = x;
+  actor_quat_y = y;
+  actor_quat_z = z;
+  actor_quat_w = w;
+}
+
+void testActorBoolAccessors()
+{
+  SetActorBooleanGetter(TestActorBooleanGetter);
+  SetActorBooleanSetter(TestActorBooleanSetter);
+
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+
+  actor_bool_value = true;
+
+  CHECK(ResetBrain(brainUid,
                    "function updateAgent(obj) {"
                    "  const prev = getActorBoolean(12, 34);"
                    "  if(prev != true) throw 'ahhh';"
@@ -640,6 +2554,312 @@ void testStringAccessors()
   CHECK(expected == test_actor_string);
 }
 
+const int NUM_BATCH_ACTORS = 500;
+static float batch_actor_positions[NUM_BATCH_ACTORS * 3];
+static unsigned char batch_actor_flags[NUM_BATCH_ACTORS];
+
+void TestActorVector3BatchGetter(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, float *xyz_out)
+{
+  for (int i = 0; i < count; i++)
+  {
+    memcpy(xyz_out + 3 * i, batch_actor_positions + 3 * actor_ids[i], 3 * sizeof(float));
+  }
+}
+
+void TestActorVector3BatchSetter(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, const float *xyz)
+{
+  for (int i = 0; i < count; i++)
+  {
+    memcpy(batch_actor_positions + 3 * actor_ids[i], xyz + 3 * i, 3 * sizeof(float));
+  }
+}
+
+void TestActorBooleanBatchSetter(const TEMP_ACTOR_ID *actor_ids, int count, ACTOR_FIELD_ID field_id, const unsigned char *values)
+{
+  for (int i = 0; i < count; i++)
+  {
+    batch_actor_flags[actor_ids[i]] = values[i];
+  }
+}
+
+void BenchActorVector3Getter(TEMP_ACTOR_ID actor_id, ACTOR_FIELD_ID field_id, float *x, float *y, float *z)
+{
+  *x = batch_actor_positions[3 * actor_id];
+  *y = batch_actor_positions[3 * actor_id + 1];
+  *z = batch_actor_positions[3 * actor_id + 2];
+}
+
+void testActorBatchAccessors()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+
+  for (int i = 0; i < NUM_BATCH_ACTORS * 3; i++)
+  {
+    batch_actor_positions[i] = (float)i;
+  }
+  SetActorVector3BatchGetter(TestActorVector3BatchGetter);
+  SetActorVector3BatchSetter(TestActorVector3BatchSetter);
+  SetActorBooleanBatchSetter(TestActorBooleanBatchSetter);
+
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  const ids = new Uint16Array([3, 1, 4]);\n"
+                   "  const pos = getActorVector3Batch(ids, 7, new Float32Array(9));\n"
+                   "  state.pos = Array.from(pos);\n"
+                   "  for (let i = 0; i < pos.length; i++) { pos[i] += 0.5; }\n"
+                   "  setActorVector3Batch(ids, 7, pos);\n"
+                   "  setActorBooleanBatch(ids.subarray(1), 7, new Uint8Array([1, 0]));\n"
+                   "}\n"));
+  batch_actor_flags[1] = 0;
+  batch_actor_flags[4] = 1;
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"pos\":[9,10,11,3,4,5,12,13,14]}");
+  CHECK(batch_actor_positions[9] == 9.5f);
+  CHECK(batch_actor_positions[14] == 14.5f);
+  CHECK(batch_actor_positions[0] == 0.0f);
+  CHECK(batch_actor_flags[1] == 1);
+  CHECK(batch_actor_flags[4] == 0);
+
+  // Without batch callbacks, the single-actor ones are used.
+  SetActorVector3BatchGetter(nullptr);
+  SetActorVector3Getter(TestActorVector3Getter);
+  actor_vec3_x = 1;
+  actor_vec3_y = 2;
+  actor_vec3_z = 3;
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.pos = Array.from(getActorVector3Batch(new Uint16Array([12, 12]), 34, new Float32Array(6)));\n"
+                   "}\n"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"pos\":[1,2,3,1,2,3]}");
+
+  // Bad arguments are errors, not crashes.
+  error_msgs.str("");
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  getActorVector3Batch([1, 2], 34, new Float32Array(6));\n"
+                   "  getActorVector3Batch(new Uint16Array(3), 34, new Float32Array(6));\n"
+                   "  setActorBooleanBatch(new Uint16Array(1), 34, new Float32Array(1));\n"
+                   "}\n"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(error_msgs.str().find("Uint16Array of actor IDs") != std::string::npos);
+  CHECK(error_msgs.str().find("too short") != std::string::npos);
+  CHECK(error_msgs.str().find("Uint8Array of values") != std::string::npos);
+
+  // Reading every actor's position, one call per actor vs. one per batch.
+  SetActorVector3Getter(BenchActorVector3Getter);
+  CHECK(ResetBrain(brainUid,
+                   "const ids = new Uint16Array(500).map((_, i) => i);\n"
+                   "const positions = new Float32Array(1500);\n"
+                   "function updateAgent(state) {\n"
+                   "  let sum = 0;\n"
+                   "  for (let tick = 0; tick < 200; tick++) {\n"
+                   "    if (state.batch) {\n"
+                   "      getActorVector3Batch(ids, 0, positions);\n"
+                   "      for (let i = 0; i < 1500; i += 3) { sum += positions[i]; }\n"
+                   "    } else {\n"
+                   "      const v = {};\n"
+                   "      for (let i = 0; i < 500; i++) { getActorVector3(i, 0, v); sum += v.x; }\n"
+                   "    }\n"
+                   "  }\n"
+                   "  state.sum = sum;\n"
+                   "}\n"));
+  SetActorVector3BatchGetter(TestActorVector3BatchGetter);
+  std::string singleResult, batchResult;
+  {
+    CpuTimer timer("Single actor position reads");
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{\"batch\":false}", myReportUpdatedAgentJson));
+    singleResult = reported_json;
+  }
+  {
+    CpuTimer timer("Batch actor position reads");
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{\"batch\":true}", myReportUpdatedAgentJson));
+    batchResult = reported_json;
+  }
+  CHECK(singleResult.substr(singleResult.find("sum")) == batchResult.substr(batchResult.find("sum")));
+
+  SetActorVector3Getter(TestActorVector3Getter);
+  SetActorVector3BatchGetter(nullptr);
+  SetActorVector3BatchSetter(nullptr);
+  SetActorBooleanBatchSetter(nullptr);
+}
+
+void testActorFieldTables()
+{
+  const char *agentUid = "pinky";
+  const char *brainUid = "fieldTableBrain";
+  const int numActors = 4;
+  float positions[numActors * 3] = {0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3};
+  unsigned char flags[numActors] = {0, 0, 0, 0};
+  unsigned char positionsDirty[numActors] = {0, 0, 0, 0};
+
+  CHECK(ResetBrain(brainUid,
+                   "var firstView;\n"
+                   "function updateAgent(state) {\n"
+                   "  const pos = actorFields.positions;\n"
+                   "  firstView = firstView || pos;\n"
+                   "  state.sameView = firstView === pos;\n"
+                   "  state.length = pos.length;\n"
+                   "  pos[state.actor * 3] += 10;\n"
+                   "  pos[3] = pos[3];\n"
+                   "  if (actorFields.flags) actorFields.flags[state.actor] = 1;\n"
+                   "}\n"));
+  CHECK(SetActorFieldTable(brainUid, "positions", positions, ACTOR_FIELD_FLOAT32, 3, numActors, positionsDirty));
+  CHECK(SetActorFieldTable(brainUid, "flags", flags, ACTOR_FIELD_UINT8, 1, numActors, nullptr));
+
+  // Changes are found once per frame, however many ticks it has.
+  CHECK(BeginActorFieldFrame(brainUid));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"actor\":2}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"actor\":2,\"sameView\":true,\"length\":12}");
+  CHECK(positionsDirty[2] == 0);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"actor\":1}", myReportUpdatedAgentJson));
+  CHECK(EndActorFieldFrame(brainUid));
+  CHECK(positions[3] == 11);
+  CHECK(positions[6] == 12);
+  CHECK(flags[2] == 1);
+  // Writing back the same value does not count as a change.
+  CHECK(positionsDirty[0] == 0 && positionsDirty[1] == 1 && positionsDirty[2] == 1 && positionsDirty[3] == 0);
+
+  // Re-registering the same memory keeps the view, and dirty bits accumulate
+  // until the host clears them.
+  positions[0] = 100;
+  CHECK(SetActorFieldTable(brainUid, "positions", positions, ACTOR_FIELD_FLOAT32, 3, numActors, positionsDirty));
+  CHECK(BeginActorFieldFrame(brainUid));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"actor\":3}", myReportUpdatedAgentJson));
+  CHECK(EndActorFieldFrame(brainUid));
+  CHECK(reported_json == "{\"actor\":3,\"sameView\":true,\"length\":12}");
+  CHECK(positions[0] == 100);
+  CHECK(positions[9] == 13);
+  CHECK(positionsDirty[0] == 0 && positionsDirty[2] == 1 && positionsDirty[3] == 1);
+
+  // Ticks outside a frame are not tracked.
+  memset(positionsDirty, 0, sizeof(positionsDirty));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"actor\":0}", myReportUpdatedAgentJson));
+  CHECK(EndActorFieldFrame(brainUid));
+  CHECK(positions[0] == 110);
+  CHECK(positionsDirty[0] == 0);
+  CHECK(!BeginActorFieldFrame("noSuchBrain"));
+
+  // New memory detaches the old view.
+  float morePositions[numActors * 2 * 3] = {};
+  CHECK(SetActorFieldTable(brainUid, "positions", morePositions, ACTOR_FIELD_FLOAT32, 3, numActors * 2, nullptr));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{\"actor\":7}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"actor\":7,\"sameView\":false,\"length\":24}");
+  CHECK(morePositions[21] == 10);
+  CHECK(positions[9] == 13);
+
+  // Tables survive resets, and can be removed.
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  state.tables = Object.keys(actorFields).sort().join();\n"
+                   "}\n"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"tables\":\"flags,positions\"}");
+  CHECK(RemoveActorFieldTable(brainUid, "flags"));
+  CHECK(!RemoveActorFieldTable(brainUid, "flags"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(reported_json == "{\"tables\":\"positions\"}");
+
+  CHECK(!SetActorFieldTable(brainUid, "bad", positions, 7, 3, numActors, nullptr));
+  CHECK(!SetActorFieldTable(brainUid, "bad", positions, ACTOR_FIELD_FLOAT32, 0, numActors, nullptr));
+  CHECK(!SetActorFieldTable(brainUid, "bad", nullptr, ACTOR_FIELD_FLOAT32, 3, numActors, nullptr));
+}
+
+#if V8_IN_UNITY_METRICS
+void testBrainMetrics()
+{
+  SetActorBooleanGetter(TestActorBooleanGetter);
+  const char *agentUid = "pinky";
+  const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  for (let i = 0; i < 100; i++) {\n"
+                   "    getActorBoolean(12, 34);\n"
+                   "  }\n"
+                   "  state.four = callVoosService('addOne', 3);\n"
+                   "  state.five = callVoosService('addTwo', 3);\n"
+                   "}\n"));
+  CHECK(ResetBrainMetrics(brainUid));
+
+  for (int i = 0; i < 10; i++)
+  {
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  }
+
+  BrainMetric metrics[8];
+  CHECK(GetBrainMetrics(brainUid, metrics, 8) == 4);
+  CHECK(strcmp(metrics[0].name, "callVoosService") == 0);
+  CHECK(metrics[0].kind == BRAIN_METRIC_BINDING);
+  CHECK(metrics[0].count == 20);
+  CHECK(strcmp(metrics[1].name, "getActorBoolean") == 0);
+  CHECK(metrics[1].count == 1000);
+  CHECK(strcmp(metrics[2].name, "addOne") == 0);
+  CHECK(metrics[2].kind == BRAIN_METRIC_SERVICE);
+  CHECK(metrics[2].count == 10);
+  CHECK(strcmp(metrics[3].name, "addTwo") == 0);
+  for (int i = 0; i < 4; i++)
+  {
+    const BrainMetric &metric = metrics[i];
+    long long bucketTotal = 0;
+    for (long long bucket : metric.buckets)
+    {
+      bucketTotal += bucket;
+    }
+    CHECK(bucketTotal == metric.count);
+    CHECK(metric.maxNs <= metric.totalNs);
+  }
+  // The service call is part of its binding's time.
+  CHECK(metrics[0].totalNs >= metrics[2].totalNs + metrics[3].totalNs);
+
+  // Truncated to what fits, and emptied by a reset.
+  CHECK(GetBrainMetrics(brainUid, metrics, 1) == 1);
+  CHECK(ResetBrainMetrics(brainUid));
+  CHECK(GetBrainMetrics(brainUid, metrics, 8) == 0);
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(GetBrainMetrics(brainUid, metrics, 8) == 4);
+  CHECK(metrics[2].count == 1);
+
+  // Names built at runtime count with the literal ones.
+  CHECK(ResetBrain(brainUid,
+                   "function updateAgent(state) {\n"
+                   "  callVoosService('addOne', 1);\n"
+                   "  callVoosService(['add', 'One'].join(''), 1);\n"
+                   "}\n"));
+  CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  CHECK(GetBrainMetrics(brainUid, metrics, 8) == 2);
+  CHECK(strcmp(metrics[1].name, "addOne") == 0);
+  CHECK(metrics[1].count == 2);
+
+  {
+    CpuTimer timer("100k getActorBoolean calls with metrics");
+    CHECK(ResetBrain(brainUid,
+                     "function updateAgent(state) {\n"
+                     "  for (let i = 0; i < 100000; i++) {\n"
+                     "    getActorBoolean(12, 34);\n"
+                     "  }\n"
+                     "}\n"));
+    CHECK(UpdateAgentJson(brainUid, agentUid, "{}", myReportUpdatedAgentJson));
+  }
+
+  error_msgs.str("");
+  CHECK(GetBrainMetrics("noSuchBrain", metrics, 8) == -1);
+  CHECK(!ResetBrainMetrics("noSuchBrain"));
+  CHECK(!error_msgs.str().empty());
+}
+#else
+void testBrainMetrics()
+{
+  const char *brainUid = "brain";
+  CHECK(ResetBrain(brainUid, "function updateAgent(state) {}\n"));
+  BrainMetric metrics[8];
+  error_msgs.str("");
+  CHECK(GetBrainMetrics(brainUid, metrics, 8) == -1);
+  CHECK(!ResetBrainMetrics(brainUid));
+  CHECK(error_msgs.str().find("metrics were compiled out") != std::string::npos);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
   SetDebugLogFunction(myDebugLogFunction);
@@ -673,8 +2893,29 @@ int main(int argc, char *argv[])
   testModules();
   testModuleHotload();
   testManyModules();
+  testModuleImports();
+  testModuleDependencyReload();
+  testModulesBatch();
+  testLazyModules();
+  testRemoveModules();
+  testBrainHeapLimits();
+  testIdleCollect();
+  testPooledArrayBuffers();
+  testBrainTimeBudget();
+  testBrainProfiling();
+  testBrainTracing();
+  testBrainSnapshot();
+  testCodeCache();
+  testSharedBrainIsolates();
+  testParallelUpdateAgents();
+  testUpdateAgentBinary();
+  testUpdateAgentDelta();
+  testUpdateAgentJsonToBuffer();
   testPumpPromisesMessageLoopCalledAfterUpdateAgent();
   testBasicService();
+  testAsyncService();
+  testTaskBudget();
+  testTypedService();
   testVeryLongLogMessage();
   testVeryLongCode();
   testUpdateAgentArrayBuffer();
@@ -683,6 +2924,9 @@ int main(int argc, char *argv[])
   testActorVec3Accessors();
   testActorQuatAccessors();
   testStringAccessors();
+  testActorBatchAccessors();
+  testActorFieldTables();
+  testBrainMetrics();
 
   int deinitRv = DeinitializeV8();
   if (deinitRv != 0)